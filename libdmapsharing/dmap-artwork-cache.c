@@ -0,0 +1,722 @@
+/*
+ * Cache of rendered artwork and thumbnails used by DmapControlShare and
+ * DmapImageShare
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <glib/gstdio.h>
+
+#ifdef HAVE_GDKPIXBUF
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#endif /* HAVE_GDKPIXBUF */
+
+#include "dmap-artwork-cache.h"
+
+struct DmapArtworkCache
+{
+	gint refs;		/* Held by the owner and each render */
+	gsize max_size;		/* Bytes; 0 means unbounded */
+	gsize size;
+	GQueue *entries;	/* _ArtworkEntry, most recently used first */
+	GHashTable *index;	/* Key to link in entries */
+	GHashTable *pending;	/* Key to GList of waiting GTasks */
+	guint running;		/* Renders on a worker thread */
+	guint max_running;
+	GQueue *queued;		/* Render GTasks waiting for a thread */
+	gchar *format;		/* gdk-pixbuf image type */
+	gchar *dir;		/* Renders kept on disk, or NULL */
+};
+
+typedef struct
+{
+	gchar *key;
+	GBytes *bytes;
+} _ArtworkEntry;
+
+typedef struct
+{
+	DmapArtworkCache *cache;
+	gchar *key;
+	gchar *filename;
+	guint width;
+	guint height;
+	gchar *format;
+	gchar *stored;		/* Where the render is kept on disk, or NULL */
+} _Render;
+
+static void
+_entry_free (_ArtworkEntry * entry)
+{
+	g_free (entry->key);
+	g_bytes_unref (entry->bytes);
+	g_free (entry);
+}
+
+static void
+_unref (DmapArtworkCache * cache)
+{
+	if (0 != --cache->refs) {
+		return;
+	}
+
+	g_queue_free (cache->queued);
+	g_hash_table_destroy (cache->pending);
+	g_hash_table_destroy (cache->index);
+	g_queue_free_full (cache->entries, (GDestroyNotify) _entry_free);
+	g_free (cache->format);
+	g_free (cache->dir);
+	g_free (cache);
+}
+
+static gchar *
+_key (const gchar * filename, guint width, guint height)
+{
+	GStatBuf buf;
+	gchar *key = NULL;
+
+	/* A changed image file never hits a stale entry. */
+	if (0 != g_stat (filename, &buf)) {
+		goto done;
+	}
+
+	key = g_strdup_printf ("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT
+	                       "\n%ux%u", filename, (gint64) buf.st_mtime,
+	                       (gint64) buf.st_size, width, height);
+
+done:
+	return key;
+}
+
+static GBytes *
+_lookup (DmapArtworkCache * cache, const gchar * key)
+{
+	GList *link;
+	_ArtworkEntry *entry;
+	GBytes *bytes = NULL;
+
+	link = g_hash_table_lookup (cache->index, key);
+	if (NULL == link) {
+		goto done;
+	}
+
+	g_queue_unlink (cache->entries, link);
+	g_queue_push_head_link (cache->entries, link);
+
+	entry = link->data;
+	bytes = g_bytes_ref (entry->bytes);
+
+done:
+	return bytes;
+}
+
+static void
+_evict (DmapArtworkCache * cache)
+{
+	_ArtworkEntry *entry;
+
+	while (0 != cache->max_size && cache->size > cache->max_size) {
+		entry = g_queue_pop_tail (cache->entries);
+		if (NULL == entry) {
+			break;
+		}
+
+		g_debug ("Evicting artwork %s", entry->key);
+
+		cache->size -= g_bytes_get_size (entry->bytes);
+		g_hash_table_remove (cache->index, entry->key);
+		_entry_free (entry);
+	}
+}
+
+static void
+_insert (DmapArtworkCache * cache, const gchar * key, GBytes * bytes)
+{
+	GList *link;
+	_ArtworkEntry *entry;
+
+	link = g_hash_table_lookup (cache->index, key);
+	if (NULL != link) {
+		entry = link->data;
+		cache->size -= g_bytes_get_size (entry->bytes);
+		g_bytes_unref (entry->bytes);
+		entry->bytes = g_bytes_ref (bytes);
+		g_queue_unlink (cache->entries, link);
+		g_queue_push_head_link (cache->entries, link);
+	} else {
+		entry = g_new0 (_ArtworkEntry, 1);
+		entry->key = g_strdup (key);
+		entry->bytes = g_bytes_ref (bytes);
+		g_queue_push_head (cache->entries, entry);
+		g_hash_table_insert (cache->index, entry->key,
+		                     cache->entries->head);
+	}
+
+	cache->size += g_bytes_get_size (bytes);
+
+	_evict (cache);
+}
+
+static void
+_render_free (_Render * render)
+{
+	_unref (render->cache);
+	g_free (render->key);
+	g_free (render->filename);
+	g_free (render->format);
+	g_free (render->stored);
+	g_free (render);
+}
+
+/* Returns where the render of key is stored on disk. The key holds the
+ * image's path, modification time and size, so finding a stored render
+ * never requires reading the image itself. */
+static gchar *
+_stored_path (DmapArtworkCache * cache, const gchar * key)
+{
+	gchar *hash, *name, *path;
+
+	hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+	name = g_strdup_printf ("%s.%s", hash, cache->format);
+	path = g_build_filename (cache->dir, name, NULL);
+
+	g_free (hash);
+	g_free (name);
+
+	return path;
+}
+
+static void
+_render_thread (GTask * task,
+                G_GNUC_UNUSED gpointer source_object,
+                gpointer task_data,
+                G_GNUC_UNUSED GCancellable * cancellable)
+{
+	gchar *contents = NULL;
+	gsize contents_len;
+	gchar *buffer = NULL;
+	gsize buffer_len;
+	GError *error = NULL;
+	_Render *render = task_data;
+#ifdef HAVE_GDKPIXBUF
+	GInputStream *stream;
+	GdkPixbuf *artwork;
+
+	if (NULL != render->stored
+	 && g_file_get_contents (render->stored, &buffer, &buffer_len, NULL)) {
+		goto rendered;
+	}
+#endif /* HAVE_GDKPIXBUF */
+
+	if (!g_file_get_contents (render->filename, &contents, &contents_len,
+	                          &error)) {
+		g_task_return_error (task, error);
+		goto done;
+	}
+
+#ifdef HAVE_GDKPIXBUF
+	stream = g_memory_input_stream_new_from_data (contents, contents_len,
+	                                              NULL);
+	artwork = gdk_pixbuf_new_from_stream_at_scale (stream,
+	                                               render->width,
+	                                               render->height,
+	                                               TRUE,
+	                                               NULL,
+	                                              &error);
+	g_object_unref (stream);
+	if (NULL == artwork) {
+		g_task_return_error (task, error);
+		goto done;
+	}
+
+	if (!gdk_pixbuf_save_to_buffer (artwork, &buffer, &buffer_len,
+	                                render->format, &error, NULL)) {
+		g_object_unref (artwork);
+		g_task_return_error (task, error);
+		goto done;
+	}
+	g_object_unref (artwork);
+
+	/* Written whole or not at all, so never read back truncated. */
+	if (NULL != render->stored
+	 && !g_file_set_contents (render->stored, buffer, buffer_len, &error)) {
+		g_debug ("Cannot store %s: %s", render->stored, error->message);
+		g_clear_error (&error);
+	}
+
+rendered:
+#else
+	buffer = contents;
+	buffer_len = contents_len;
+	contents = NULL;
+#endif /* HAVE_GDKPIXBUF */
+
+	g_task_return_pointer (task,
+	                       g_bytes_new_take (buffer, buffer_len),
+	                       (GDestroyNotify) g_bytes_unref);
+
+done:
+	g_free (contents);
+}
+
+static void
+_render_start (GTask * render_task)
+{
+	_Render *render = g_task_get_task_data (render_task);
+
+	render->cache->running++;
+	g_task_run_in_thread (render_task, _render_thread);
+	g_object_unref (render_task);
+}
+
+static void
+_render_done (G_GNUC_UNUSED GObject * source_object,
+              GAsyncResult * result,
+              gpointer user_data)
+{
+	GList *iter, *waiting;
+	GBytes *bytes;
+	GTask *next;
+	GError *error = NULL;
+	_Render *render = user_data;
+	DmapArtworkCache *cache = render->cache;
+
+	cache->running--;
+	next = g_queue_pop_head (cache->queued);
+	if (NULL != next) {
+		_render_start (next);
+	}
+
+	bytes = g_task_propagate_pointer (G_TASK (result), &error);
+	if (NULL != bytes) {
+		_insert (cache, render->key, bytes);
+	}
+
+	waiting = g_hash_table_lookup (cache->pending, render->key);
+	g_hash_table_remove (cache->pending, render->key);
+
+	for (iter = waiting; iter; iter = iter->next) {
+		GTask *task = iter->data;
+
+		if (NULL != bytes) {
+			g_task_return_pointer (task,
+			                       g_bytes_ref (bytes),
+			                       (GDestroyNotify) g_bytes_unref);
+		} else {
+			g_task_return_error (task, g_error_copy (error));
+		}
+
+		g_object_unref (task);
+	}
+
+	g_list_free (waiting);
+
+	if (NULL != bytes) {
+		g_bytes_unref (bytes);
+	}
+	g_clear_error (&error);
+}
+
+DmapArtworkCache *
+dmap_artwork_cache_new (gsize max_size)
+{
+	DmapArtworkCache *cache;
+
+	cache = g_new0 (DmapArtworkCache, 1);
+	cache->refs = 1;
+	cache->max_size = max_size;
+	cache->entries = g_queue_new ();
+	cache->index = g_hash_table_new (g_str_hash, g_str_equal);
+	cache->pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+	                                        g_free, NULL);
+	cache->max_running = MAX (1, g_get_num_processors ());
+	cache->queued = g_queue_new ();
+	cache->format = g_strdup ("png");
+
+	return cache;
+}
+
+void
+dmap_artwork_cache_set_format (DmapArtworkCache * cache, const gchar * format)
+{
+	g_free (cache->format);
+	cache->format = g_strdup (format);
+}
+
+void
+dmap_artwork_cache_set_dir (DmapArtworkCache * cache, const gchar * dir)
+{
+	g_free (cache->dir);
+	cache->dir = g_strdup (dir);
+
+	if (NULL != dir && 0 != g_mkdir_with_parents (dir, 0700)) {
+		g_warning ("Cannot create artwork directory %s", dir);
+	}
+}
+
+void
+dmap_artwork_cache_free (DmapArtworkCache * cache)
+{
+	if (NULL != cache) {
+		/* Renders in progress keep the cache until they finish. */
+		_unref (cache);
+	}
+}
+
+GBytes *
+dmap_artwork_cache_lookup (DmapArtworkCache * cache,
+                           const gchar * filename,
+                           guint width,
+                           guint height)
+{
+	gchar *key;
+	GBytes *bytes = NULL;
+
+	key = _key (filename, width, height);
+	if (NULL != key) {
+		bytes = _lookup (cache, key);
+	}
+
+	g_free (key);
+
+	return bytes;
+}
+
+void
+dmap_artwork_cache_render_async (DmapArtworkCache * cache,
+                                 const gchar * filename,
+                                 guint width,
+                                 guint height,
+                                 GAsyncReadyCallback callback,
+                                 gpointer user_data)
+{
+	gchar *key;
+	GList *waiting;
+	GBytes *bytes;
+	GTask *task, *render_task;
+	_Render *render;
+
+	task = g_task_new (NULL, NULL, callback, user_data);
+
+	key = _key (filename, width, height);
+	if (NULL == key) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+		                         "Cannot read artwork %s", filename);
+		g_object_unref (task);
+		goto done;
+	}
+
+	bytes = _lookup (cache, key);
+	if (NULL != bytes) {
+		g_task_return_pointer (task, bytes,
+		                       (GDestroyNotify) g_bytes_unref);
+		g_object_unref (task);
+		goto done;
+	}
+
+	/* Wait for a render of the same entry already under way. */
+	waiting = g_hash_table_lookup (cache->pending, key);
+	if (NULL != waiting) {
+		waiting = g_list_append (waiting, task);
+		goto done;
+	}
+
+	g_hash_table_insert (cache->pending, g_strdup (key),
+	                     g_list_append (NULL, task));
+
+	cache->refs++;
+
+	render = g_new0 (_Render, 1);
+	render->cache = cache;
+	render->key = g_strdup (key);
+	render->filename = g_strdup (filename);
+	render->width = width;
+	render->height = height;
+	render->format = g_strdup (cache->format);
+	if (NULL != cache->dir) {
+		render->stored = _stored_path (cache, key);
+	}
+
+	render_task = g_task_new (NULL, NULL, _render_done, render);
+	g_task_set_task_data (render_task, render,
+	                      (GDestroyNotify) _render_free);
+
+	/* Decoding is CPU-bound; more renders than cores only add memory. */
+	if (cache->running < cache->max_running) {
+		_render_start (render_task);
+	} else {
+		g_queue_push_tail (cache->queued, render_task);
+	}
+
+done:
+	g_free (key);
+}
+
+GBytes *
+dmap_artwork_cache_render_finish (G_GNUC_UNUSED DmapArtworkCache * cache,
+                                  GAsyncResult * result,
+                                  GError ** error)
+{
+	return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+#include <string.h>
+
+static GBytes *
+_bytes_test (gsize size)
+{
+	return g_bytes_new_take (g_malloc0 (size), size);
+}
+
+START_TEST(_artwork_cache_lru_test)
+{
+	GBytes *bytes, *hit;
+	DmapArtworkCache *cache;
+
+	cache = dmap_artwork_cache_new (25);
+
+	bytes = _bytes_test (10);
+	_insert (cache, "a", bytes);
+	_insert (cache, "b", bytes);
+	g_bytes_unref (bytes);
+
+	/* Using "a" leaves "b" the least recently used. */
+	hit = _lookup (cache, "a");
+	ck_assert (NULL != hit);
+	g_bytes_unref (hit);
+
+	bytes = _bytes_test (10);
+	_insert (cache, "c", bytes);
+	g_bytes_unref (bytes);
+
+	ck_assert (NULL == _lookup (cache, "b"));
+
+	hit = _lookup (cache, "a");
+	ck_assert (NULL != hit);
+	g_bytes_unref (hit);
+
+	hit = _lookup (cache, "c");
+	ck_assert (NULL != hit);
+	g_bytes_unref (hit);
+
+	ck_assert_int_eq (20, cache->size);
+
+	dmap_artwork_cache_free (cache);
+}
+END_TEST
+
+START_TEST(_artwork_cache_replace_test)
+{
+	GBytes *bytes, *hit;
+	DmapArtworkCache *cache;
+
+	cache = dmap_artwork_cache_new (0);
+
+	bytes = _bytes_test (10);
+	_insert (cache, "a", bytes);
+	g_bytes_unref (bytes);
+
+	bytes = _bytes_test (4);
+	_insert (cache, "a", bytes);
+	g_bytes_unref (bytes);
+
+	hit = _lookup (cache, "a");
+	ck_assert (NULL != hit);
+	ck_assert_int_eq (4, g_bytes_get_size (hit));
+	g_bytes_unref (hit);
+
+	ck_assert_int_eq (4, cache->size);
+	ck_assert_int_eq (1, g_queue_get_length (cache->entries));
+
+	dmap_artwork_cache_free (cache);
+}
+END_TEST
+
+static void
+_render_done_test (G_GNUC_UNUSED GObject * source_object,
+                   GAsyncResult * result,
+                   gpointer user_data)
+{
+	GAsyncResult **out = user_data;
+
+	*out = g_object_ref (result);
+}
+
+static GBytes *
+_render_test (DmapArtworkCache * cache, const gchar * filename)
+{
+	GBytes *bytes;
+	GAsyncResult *result = NULL;
+
+	dmap_artwork_cache_render_async (cache, filename, 4, 4,
+	                                 _render_done_test, &result);
+	while (NULL == result) {
+		g_main_context_iteration (NULL, TRUE);
+	}
+
+	bytes = dmap_artwork_cache_render_finish (cache, result, NULL);
+	g_object_unref (result);
+
+	return bytes;
+}
+
+static void
+_remove_dir_test (const gchar * path)
+{
+	GDir *dir;
+	const gchar *name;
+
+	dir = g_dir_open (path, 0, NULL);
+	while (NULL != (name = g_dir_read_name (dir))) {
+		gchar *child = g_build_filename (path, name, NULL);
+
+		if (g_file_test (child, G_FILE_TEST_IS_DIR)) {
+			_remove_dir_test (child);
+		} else {
+			g_remove (child);
+		}
+
+		g_free (child);
+	}
+	g_dir_close (dir);
+
+	g_rmdir (path);
+}
+
+START_TEST(_artwork_cache_set_dir_test)
+{
+	gchar *tmp, *dir, *stored;
+	DmapArtworkCache *cache;
+
+	tmp = g_dir_make_tmp ("dmap-artwork-XXXXXX", NULL);
+	ck_assert (NULL != tmp);
+	dir = g_build_filename (tmp, "thumbnails", NULL);
+
+	cache = dmap_artwork_cache_new (0);
+
+	dmap_artwork_cache_set_dir (cache, dir);
+	ck_assert (g_file_test (dir, G_FILE_TEST_IS_DIR));
+
+	stored = _stored_path (cache, "key");
+	ck_assert (g_str_has_prefix (stored, dir));
+	ck_assert (g_str_has_suffix (stored, ".png"));
+	g_free (stored);
+
+	/* The format names the file, so formats never collide. */
+	dmap_artwork_cache_set_format (cache, "jpeg");
+	stored = _stored_path (cache, "key");
+	ck_assert (g_str_has_suffix (stored, ".jpeg"));
+	g_free (stored);
+
+	dmap_artwork_cache_set_dir (cache, NULL);
+	ck_assert (NULL == cache->dir);
+
+	dmap_artwork_cache_free (cache);
+	_remove_dir_test (tmp);
+	g_free (dir);
+	g_free (tmp);
+}
+END_TEST
+
+#ifdef HAVE_GDKPIXBUF
+static void
+_image_test (const gchar * path, gint size)
+{
+	GdkPixbuf *pixbuf;
+
+	pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, size, size);
+	gdk_pixbuf_fill (pixbuf, 0x336699ff);
+	ck_assert (gdk_pixbuf_save (pixbuf, path, "png", NULL, NULL));
+	g_object_unref (pixbuf);
+}
+
+static gboolean
+_is_jpeg_test (GBytes * bytes)
+{
+	const guint8 *data;
+	gsize size;
+
+	data = g_bytes_get_data (bytes, &size);
+
+	return size > 2 && 0xff == data[0] && 0xd8 == data[1];
+}
+#endif /* HAVE_GDKPIXBUF */
+
+START_TEST(_artwork_cache_disk_store_test)
+{
+#ifdef HAVE_GDKPIXBUF
+	gchar *tmp, *image, *key, *stored;
+	GBytes *bytes;
+	DmapArtworkCache *cache;
+
+	tmp = g_dir_make_tmp ("dmap-artwork-XXXXXX", NULL);
+	ck_assert (NULL != tmp);
+	image = g_build_filename (tmp, "image.png", NULL);
+	_image_test (image, 8);
+
+	cache = dmap_artwork_cache_new (0);
+	dmap_artwork_cache_set_dir (cache, tmp);
+	dmap_artwork_cache_set_format (cache, "jpeg");
+
+	bytes = _render_test (cache, image);
+	ck_assert (NULL != bytes);
+	ck_assert (_is_jpeg_test (bytes));
+	g_bytes_unref (bytes);
+
+	key = _key (image, 4, 4);
+	stored = _stored_path (cache, key);
+	ck_assert (g_file_test (stored, G_FILE_TEST_IS_REGULAR));
+
+	dmap_artwork_cache_free (cache);
+
+	/* A new cache takes the stored render as is, without decoding. */
+	ck_assert (g_file_set_contents (stored, "stored", -1, NULL));
+
+	cache = dmap_artwork_cache_new (0);
+	dmap_artwork_cache_set_dir (cache, tmp);
+	dmap_artwork_cache_set_format (cache, "jpeg");
+
+	bytes = _render_test (cache, image);
+	ck_assert (NULL != bytes);
+	ck_assert_int_eq (6, g_bytes_get_size (bytes));
+	ck_assert (0 == memcmp ("stored", g_bytes_get_data (bytes, NULL), 6));
+	g_bytes_unref (bytes);
+
+	/* A changed image has a new size, so misses the stored render. */
+	_image_test (image, 16);
+
+	bytes = _render_test (cache, image);
+	ck_assert (NULL != bytes);
+	ck_assert (_is_jpeg_test (bytes));
+	g_bytes_unref (bytes);
+
+	dmap_artwork_cache_free (cache);
+	_remove_dir_test (tmp);
+	g_free (stored);
+	g_free (key);
+	g_free (image);
+	g_free (tmp);
+#endif /* HAVE_GDKPIXBUF */
+}
+END_TEST
+
+#include "dmap-artwork-cache-suite.c"
+
+#endif
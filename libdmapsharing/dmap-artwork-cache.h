@@ -0,0 +1,64 @@
+/*
+ * Cache of rendered artwork and thumbnails used by DmapControlShare and
+ * DmapImageShare
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DMAP_ARTWORK_CACHE_H
+#define _DMAP_ARTWORK_CACHE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Encoded artwork, PNG unless set otherwise, keyed by image file, its
+ * modification time and size, and the requested bounding size. Images
+ * are decoded and scaled on a worker thread; concurrent requests for the
+ * same entry share one render, and no more renders run at once than there
+ * are processors. The cache is kept below a maximum size by dropping the
+ * least recently used entries. Given a directory, renders are also kept
+ * there under the same key, so are found without reading the image, and
+ * reused across restarts. Call from one main context only.
+ */
+typedef struct DmapArtworkCache DmapArtworkCache;
+
+DmapArtworkCache *dmap_artwork_cache_new (gsize max_size);
+void    dmap_artwork_cache_free (DmapArtworkCache * cache);
+
+/* Apply to renders started afterwards. */
+void    dmap_artwork_cache_set_format (DmapArtworkCache * cache,
+                                       const gchar * format);
+void    dmap_artwork_cache_set_dir (DmapArtworkCache * cache,
+                                    const gchar * dir);
+
+/* Returns a new reference, or NULL on a miss. */
+GBytes *dmap_artwork_cache_lookup (DmapArtworkCache * cache,
+                                   const gchar * filename,
+                                   guint width,
+                                   guint height);
+
+void    dmap_artwork_cache_render_async (DmapArtworkCache * cache,
+                                         const gchar * filename,
+                                         guint width,
+                                         guint height,
+                                         GAsyncReadyCallback callback,
+                                         gpointer user_data);
+GBytes *dmap_artwork_cache_render_finish (DmapArtworkCache * cache,
+                                          GAsyncResult * result,
+                                          GError ** error);
+
+G_END_DECLS
+#endif /* _DMAP_ARTWORK_CACHE_H */
@@ -23,6 +23,7 @@
 #include "config.h"
 
 #include <time.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -39,9 +40,12 @@
 #include <libdmapsharing/dmap-structure.h>
 #include <libdmapsharing/dmap-private-utils.h>
 #include <libdmapsharing/dmap-utils.h>
+#include <libdmapsharing/dmap-transcode-cache.h>
+#include <libdmapsharing/dmap-shared-stream.h>
 
 #ifdef HAVE_GSTREAMERAPP
 #include <libdmapsharing/dmap-transcode-stream.h>
+#include <libdmapsharing/dmap-transcode-stream-private.h>
 #endif /* HAVE_GSTREAMERAPP */
 
 static guint _get_desired_port (DmapShare * share);
@@ -65,7 +69,131 @@ static void _add_entry_to_mlcl (guint id, DmapRecord * record, gpointer mb);
 #define DAAP_TYPE_OF_SERVICE "_daap._tcp"
 #define DAAP_PORT 3689
 
-G_DEFINE_TYPE (DmapAvShare, dmap_av_share, DMAP_TYPE_SHARE);
+/* Transcode scheduling: at most transcode_max pipelines run at once; the
+ * rest wait, paused, in per-priority FIFOs. A lower value is served first.
+ */
+typedef enum {
+	TRANSCODE_PRIORITY_PLAYBACK = 0,
+	TRANSCODE_PRIORITY_PROBE,
+	TRANSCODE_PRIORITY_PREFETCH,
+	TRANSCODE_PRIORITY_COUNT
+} TranscodePriority;
+
+struct DmapAvSharePrivate
+{
+	gchar *transcode_cache_dir;
+	guint64 transcode_cache_size;
+	DmapTranscodeCache *transcode_cache;	/* Created on first use */
+
+	guint transcode_max;		/* 0 means unlimited */
+	guint transcode_prefetch;	/* Upcoming tracks to transcode early */
+	guint transcode_active;
+	GQueue *transcode_queue[TRANSCODE_PRIORITY_COUNT];
+
+	GHashTable *shared_streams;	/* Key to DmapSharedStream */
+};
+
+enum {
+	PROP_0,
+	PROP_TRANSCODE_CACHE_DIR,
+	PROP_TRANSCODE_CACHE_SIZE,
+	PROP_TRANSCODE_MAX_CONCURRENT,
+	PROP_TRANSCODE_ACTIVE,
+	PROP_TRANSCODE_QUEUED,
+	PROP_TRANSCODE_PREFETCH
+};
+
+#define DEFAULT_TRANSCODE_MAX_CONCURRENT 4
+#define DEFAULT_TRANSCODE_PREFETCH 2
+#define PREFETCH_READ_WAIT_MSECONDS 100	/* Off the main loop, so may block */
+
+static guint _transcode_queued (DmapAvShare *share);
+static void _transcode_dispatch (DmapAvShare *share);
+
+G_DEFINE_TYPE_WITH_PRIVATE (DmapAvShare, dmap_av_share, DMAP_TYPE_SHARE);
+
+static void
+_set_property (GObject * object,
+               guint prop_id,
+               const GValue * value, GParamSpec * pspec)
+{
+	DmapAvShare *share = DMAP_AV_SHARE (object);
+
+	switch (prop_id) {
+	case PROP_TRANSCODE_CACHE_DIR:
+		g_free (share->priv->transcode_cache_dir);
+		share->priv->transcode_cache_dir = g_value_dup_string (value);
+		break;
+	case PROP_TRANSCODE_CACHE_SIZE:
+		share->priv->transcode_cache_size = g_value_get_uint64 (value);
+		break;
+	case PROP_TRANSCODE_MAX_CONCURRENT:
+		share->priv->transcode_max = g_value_get_uint (value);
+		_transcode_dispatch (share);
+		break;
+	case PROP_TRANSCODE_PREFETCH:
+		share->priv->transcode_prefetch = g_value_get_uint (value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+_get_property (GObject * object,
+               guint prop_id, GValue * value, GParamSpec * pspec)
+{
+	DmapAvShare *share = DMAP_AV_SHARE (object);
+
+	switch (prop_id) {
+	case PROP_TRANSCODE_CACHE_DIR:
+		g_value_set_string (value, share->priv->transcode_cache_dir);
+		break;
+	case PROP_TRANSCODE_CACHE_SIZE:
+		g_value_set_uint64 (value, share->priv->transcode_cache_size);
+		break;
+	case PROP_TRANSCODE_MAX_CONCURRENT:
+		g_value_set_uint (value, share->priv->transcode_max);
+		break;
+	case PROP_TRANSCODE_ACTIVE:
+		g_value_set_uint (value, share->priv->transcode_active);
+		break;
+	case PROP_TRANSCODE_QUEUED:
+		g_value_set_uint (value, _transcode_queued (share));
+		break;
+	case PROP_TRANSCODE_PREFETCH:
+		g_value_set_uint (value, share->priv->transcode_prefetch);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+_finalize (GObject * object)
+{
+	guint i;
+	DmapAvShare *share = DMAP_AV_SHARE (object);
+
+	for (i = 0; i < G_N_ELEMENTS (share->priv->transcode_queue); i++) {
+		/* Messages went with the server, so these are empty. */
+		g_queue_free (share->priv->transcode_queue[i]);
+	}
+
+	/* Each entry holds a reference to share, so this is empty. */
+	g_hash_table_destroy (share->priv->shared_streams);
+
+	dmap_transcode_cache_unref (share->priv->transcode_cache);
+	g_free (share->priv->transcode_cache_dir);
+
+#ifdef HAVE_GSTREAMERAPP
+	dmap_transcode_stream_pool_unref ();
+#endif /* HAVE_GSTREAMERAPP */
+
+	G_OBJECT_CLASS (dmap_av_share_parent_class)->finalize (object);
+}
 
 static void
 dmap_av_share_class_init (DmapAvShareClass * klass)
@@ -73,6 +201,10 @@ dmap_av_share_class_init (DmapAvShareClass * klass)
 	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 	DmapShareClass *parent_class = DMAP_SHARE_CLASS (object_class);
 
+	object_class->get_property = _get_property;
+	object_class->set_property = _set_property;
+	object_class->finalize = _finalize;
+
 	parent_class->get_desired_port = _get_desired_port;
 	parent_class->get_type_of_service = _get_type_of_service;
 	parent_class->message_add_standard_headers = _message_add_standard_headers;
@@ -81,11 +213,91 @@ dmap_av_share_class_init (DmapAvShareClass * klass)
 	parent_class->databases_browse_xxx = _databases_browse_xxx;
 	parent_class->databases_items_xxx = _databases_items_xxx;
 	parent_class->server_info = _server_info;
+
+	g_object_class_install_property (object_class,
+					 PROP_TRANSCODE_CACHE_DIR,
+					 g_param_spec_string ("transcode-cache-dir",
+							      "Transcode cache directory",
+							      "Directory in which to keep finished transcodes, or NULL",
+							      NULL,
+							      G_PARAM_READWRITE |
+							      G_PARAM_CONSTRUCT_ONLY));
+
+	g_object_class_install_property (object_class,
+					 PROP_TRANSCODE_CACHE_SIZE,
+					 g_param_spec_uint64 ("transcode-cache-size",
+							      "Transcode cache size",
+							      "Maximum size of transcode cache in bytes, or 0 for no limit",
+							      0,
+							      G_MAXUINT64,
+							      0,
+							      G_PARAM_READWRITE |
+							      G_PARAM_CONSTRUCT_ONLY));
+
+	g_object_class_install_property (object_class,
+					 PROP_TRANSCODE_MAX_CONCURRENT,
+					 g_param_spec_uint ("transcode-max-concurrent",
+							    "Maximum concurrent transcodes",
+							    "Maximum number of transcode pipelines to run at once, or 0 for no limit",
+							    0,
+							    G_MAXUINT,
+							    DEFAULT_TRANSCODE_MAX_CONCURRENT,
+							    G_PARAM_READWRITE));
+
+	g_object_class_install_property (object_class,
+					 PROP_TRANSCODE_ACTIVE,
+					 g_param_spec_uint ("transcode-active",
+							    "Active transcodes",
+							    "Number of transcode pipelines running",
+							    0,
+							    G_MAXUINT,
+							    0,
+							    G_PARAM_READABLE));
+
+	g_object_class_install_property (object_class,
+					 PROP_TRANSCODE_QUEUED,
+					 g_param_spec_uint ("transcode-queued",
+							    "Queued transcodes",
+							    "Number of requests waiting for a transcode pipeline",
+							    0,
+							    G_MAXUINT,
+							    0,
+							    G_PARAM_READABLE));
+
+	g_object_class_install_property (object_class,
+					 PROP_TRANSCODE_PREFETCH,
+					 g_param_spec_uint ("transcode-prefetch",
+							    "Transcode prefetch",
+							    "Number of upcoming tracks to transcode into the transcode cache ahead of time",
+							    0,
+							    G_MAXUINT,
+							    DEFAULT_TRANSCODE_PREFETCH,
+							    G_PARAM_READWRITE));
 }
 
 static void
-dmap_av_share_init (G_GNUC_UNUSED DmapAvShare * share)
+dmap_av_share_init (DmapAvShare * share)
 {
+	guint i;
+
+	share->priv = dmap_av_share_get_instance_private (share);
+
+	share->priv->transcode_max = DEFAULT_TRANSCODE_MAX_CONCURRENT;
+	share->priv->transcode_prefetch = DEFAULT_TRANSCODE_PREFETCH;
+
+#ifdef HAVE_GSTREAMERAPP
+	/* Keeps idle transcode pipelines around while this share exists. */
+	dmap_transcode_stream_pool_ref ();
+#endif /* HAVE_GSTREAMERAPP */
+
+	for (i = 0; i < G_N_ELEMENTS (share->priv->transcode_queue); i++) {
+		share->priv->transcode_queue[i] = g_queue_new ();
+	}
+
+	share->priv->shared_streams = g_hash_table_new_full (g_str_hash,
+	                                                     g_str_equal,
+	                                                     g_free,
+	                                                     NULL);
 }
 
 DmapAvShare *
@@ -326,17 +538,201 @@ done:
 	return fnval;
 }
 
+static DmapTranscodeCache *
+_get_transcode_cache (DmapAvShare *share)
+{
+	if (NULL == share->priv->transcode_cache
+	 && NULL != share->priv->transcode_cache_dir) {
+		share->priv->transcode_cache =
+			dmap_transcode_cache_new (share->priv->transcode_cache_dir,
+			                          share->priv->transcode_cache_size);
+	}
+
+	return share->priv->transcode_cache;
+}
+
+/* Returns the cache key of the transcoded form of record, or NULL if the
+ * record will not be transcoded or there is no cache. */
+static gchar *
+_transcode_cache_key (DmapAvShare *share,
+                      DmapAvRecord *record,
+                      const gchar *transcode_mimetype)
+{
+	gchar *key = NULL;
+	gchar *format = NULL;
+	gchar *location = NULL;
+	gboolean has_video;
+
+	if (NULL == _get_transcode_cache (share)) {
+		goto done;
+	}
+
+	g_object_get (record, "location", &location,
+	                      "format", &format,
+	                      "has-video", &has_video, NULL);
+	if (NULL == location || NULL == format) {
+		goto done;
+	}
+
+	if (!_should_transcode (share, format, has_video, transcode_mimetype)) {
+		goto done;
+	}
+
+	key = dmap_transcode_cache_key (location, transcode_mimetype);
+
+done:
+	g_free (location);
+	g_free (format);
+
+	return key;
+}
+
+typedef struct {
+	DmapTranscodeCache *cache;
+	gchar *key;
+	ChunkData *cd;
+} TranscodeCacheStore;
+
+static void
+_transcode_cache_store_finished (G_GNUC_UNUSED SoupMessage * message,
+                                 TranscodeCacheStore *store)
+{
+	/* Runs before dmap_private_utils_chunked_message_finished. */
+	dmap_transcode_cache_store_end (store->cache,
+	                                store->key,
+	                                store->cd->tee,
+	                                store->cd->eof);
+
+	g_clear_object (&store->cd->tee);
+	dmap_transcode_cache_unref (store->cache);
+	g_free (store->key);
+	g_free (store);
+}
+
+/* Each running transcode pipeline holds one slot until it is torn down. */
+static void
+_transcode_slot_take (DmapAvShare *share)
+{
+	share->priv->transcode_active++;
+	g_object_notify (G_OBJECT (share), "transcode-active");
+}
+
+static void
+_transcode_slot_release (DmapAvShare *share)
+{
+	g_assert (share->priv->transcode_active > 0);
+
+	share->priv->transcode_active--;
+	g_object_notify (G_OBJECT (share), "transcode-active");
+
+	_transcode_dispatch (share);
+}
+
+static void
+_transcode_active_finished_cb (G_GNUC_UNUSED SoupMessage *message,
+                               DmapAvShare *share)
+{
+	_transcode_slot_release (share);
+}
+
+/* Concurrent requests for the same record in the same format read one
+ * source stream (and run one transcode) through a DmapSharedStream. */
+typedef struct {
+	DmapAvShare *share;
+	gchar *key;
+	DmapSharedStream *shared;
+	gboolean transcoding;	/* Holds a transcode slot */
+} SharedStreamEntry;
+
+static gchar *
+_shared_stream_key (const gchar *location, const gchar *mimetype)
+{
+	return g_strconcat (location, "\n", mimetype ? mimetype : "", NULL);
+}
+
+static void
+_shared_stream_entry_free (SharedStreamEntry *entry)
+{
+	DmapAvShare *share = entry->share;
+
+	/* Another stream may have replaced this one after it closed to
+	 * newcomers. */
+	if (entry->shared == g_hash_table_lookup (share->priv->shared_streams,
+	                                          entry->key)) {
+		g_hash_table_remove (share->priv->shared_streams, entry->key);
+	}
+
+	/* The pipeline outlives the request that started it while others
+	 * are still reading; only now is it gone. */
+	if (entry->transcoding) {
+		_transcode_slot_release (share);
+	}
+
+	g_free (entry->key);
+	g_free (entry);
+	g_object_unref (share);
+}
+
+/* Returns a new reader of a stream already open for key, or NULL. */
+static GInputStream *
+_shared_stream_join (DmapAvShare *share, const gchar *key)
+{
+	DmapSharedStream *shared;
+	GInputStream *stream = NULL;
+
+	shared = g_hash_table_lookup (share->priv->shared_streams, key);
+	if (NULL != shared) {
+		stream = dmap_shared_stream_subscribe (shared);
+	}
+
+	return stream;
+}
+
+/* Takes ownership of stream and original_stream; returns the first
+ * reader of the resulting shared stream. If transcoding, the shared
+ * stream holds a transcode slot for as long as it lives. */
+static GInputStream *
+_shared_stream_start (DmapAvShare *share,
+                      const gchar *key,
+                      GInputStream *stream,
+                      GInputStream *original_stream,
+                      gboolean transcoding)
+{
+	SharedStreamEntry *entry;
+
+	entry = g_new0 (SharedStreamEntry, 1);
+	entry->share = g_object_ref (share);
+	entry->key = g_strdup (key);
+	entry->transcoding = transcoding;
+	if (transcoding) {
+		_transcode_slot_take (share);
+	}
+	entry->shared = dmap_shared_stream_new (stream, original_stream,
+	                                        (GDestroyNotify) _shared_stream_entry_free,
+	                                        entry);
+
+	g_hash_table_replace (share->priv->shared_streams,
+	                      g_strdup (key),
+	                      entry->shared);
+
+	return dmap_shared_stream_subscribe (entry->shared);
+}
+
 static void
 _send_chunked_file (DmapAvShare *share, SoupServer * server, SoupMessage * message,
 		   DmapAvRecord * record, guint64 filesize, guint64 offset,
-		   const gchar * transcode_mimetype)
+		   const gchar * transcode_mimetype, GFile * cached,
+		   const gchar * cache_key)
 {
 	gchar *format = NULL;
 	gchar *location = NULL;
 	GInputStream *stream = NULL;
 	gboolean has_video;
+	gboolean transcoding;
+	gchar *shared_key = NULL;
 	GError *error = NULL;
 	ChunkData *cd = NULL;
+	TranscodeCacheStore *store = NULL;
 	gboolean teardown = TRUE;
 
 	cd = g_new0 (ChunkData, 1);
@@ -354,13 +750,6 @@ _send_chunked_file (DmapAvShare *share, SoupServer * server, SoupMessage * messa
 
 	cd->server = server;
 
-	stream = G_INPUT_STREAM (dmap_av_record_read (record, &error));
-	if (error != NULL) {
-		dmap_share_emit_error(DMAP_SHARE(share), DMAP_STATUS_OPEN_FAILED,
-		                     "Cannot open %s", error->message);
-		goto done;
-	}
-
 	g_object_get (record, "format", &format, NULL);
 	if (NULL == format) {
 		dmap_share_emit_error(DMAP_SHARE(share), DMAP_STATUS_RECORD_MISSING_FIELD,
@@ -368,8 +757,40 @@ _send_chunked_file (DmapAvShare *share, SoupServer * server, SoupMessage * messa
 		goto done;
 	}
 
+	transcoding = NULL == cached
+	           && _should_transcode (share, format, has_video, transcode_mimetype);
+
+	/* Readers starting from the beginning can share one source. */
+	if (NULL == cached && 0 == offset) {
+		shared_key = _shared_stream_key (location,
+		                                 transcoding ? transcode_mimetype : NULL);
+
+		cd->stream = _shared_stream_join (share, shared_key);
+		if (NULL != cd->stream) {
+			g_debug ("Joining stream of %s already in progress", location);
+			cd->original_stream = NULL;
+			goto headers;
+		}
+	}
+
+	if (NULL != cached) {
+		/* Serve an earlier transcode as a regular file. */
+		stream = G_INPUT_STREAM (g_file_read (cached, NULL, &error));
+	} else {
+		stream = G_INPUT_STREAM (dmap_av_record_read (record, &error));
+	}
+	if (error != NULL) {
+		dmap_share_emit_error(DMAP_SHARE(share), DMAP_STATUS_OPEN_FAILED,
+		                     "Cannot open %s", error->message);
+		goto done;
+	}
+
 	// Not presently transcoding videos (see also same comments elsewhere).
-	if (_should_transcode (share, format, has_video, transcode_mimetype)) {
+	if (NULL != cached) {
+		g_debug ("Sending cached transcode of %s", location);
+		cd->original_stream = NULL;
+		cd->stream = stream;
+	} else if (transcoding) {
 #ifdef HAVE_GSTREAMERAPP
 		cd->original_stream = stream;
 		cd->stream = dmap_transcode_stream_new (transcode_mimetype, stream);
@@ -392,6 +813,17 @@ _send_chunked_file (DmapAvShare *share, SoupServer * server, SoupMessage * messa
 		goto done;
 	}
 
+	if (offset != 0 && !(G_IS_SEEKABLE (cd->stream)
+	                  && g_seekable_can_seek (G_SEEKABLE (cd->stream)))) {
+		/* E.g., a QuickTime transcode has no fixed byte rate to seek
+		 * by; send the whole body instead of failing the request. */
+		g_debug ("Stream cannot seek; ignoring range");
+		soup_message_headers_remove (message->response_headers,
+		                             "Content-Range");
+		soup_message_set_status (message, SOUP_STATUS_OK);
+		offset = 0;
+	}
+
 	if (offset != 0) {
 		if (g_seekable_seek (G_SEEKABLE (cd->stream), offset, G_SEEK_SET, NULL, &error) == FALSE) {
 			dmap_share_emit_error(DMAP_SHARE(share), DMAP_STATUS_SEEK_FAILED,
@@ -401,10 +833,44 @@ _send_chunked_file (DmapAvShare *share, SoupServer * server, SoupMessage * messa
 		filesize -= offset;
 	}
 
+	/* Keep a copy of a complete transcode for later requests. */
+	if (NULL != cache_key && transcoding && 0 == offset
+	 && NULL != cd->original_stream) {
+		cd->tee = dmap_transcode_cache_store_begin (share->priv->transcode_cache,
+		                                            cache_key);
+		if (NULL != cd->tee) {
+			store = g_new0 (TranscodeCacheStore, 1);
+
+			store->cache = dmap_transcode_cache_ref (share->priv->transcode_cache);
+			store->key = g_strdup (cache_key);
+			store->cd = cd;
+
+			g_signal_connect (message, "finished",
+			                  G_CALLBACK (_transcode_cache_store_finished),
+			                  store);
+		}
+	}
+
+	if (NULL != shared_key) {
+		/* The shared stream now owns both; see teardown below. */
+		cd->stream = _shared_stream_start (share, shared_key,
+		                                   cd->stream,
+		                                   cd->original_stream,
+		                                   NULL != cd->original_stream);
+		cd->original_stream = NULL;
+		stream = NULL;
+	} else if (NULL != cd->original_stream) {
+		/* A ranged transcode serves this request alone. */
+		_transcode_slot_take (share);
+		g_signal_connect (message, "finished",
+		                  G_CALLBACK (_transcode_active_finished_cb), share);
+	}
+
+headers:
 	/* Free memory after each chunk sent out over network. */
 	soup_message_body_set_accumulate (message->response_body, FALSE);
 
-	if (! _should_transcode (share, format, has_video, transcode_mimetype)) {
+	if (!transcoding) {
 	        /* NOTE: iTunes seems to require this or it stops reading
 	         * video data after about 2.5MB. Perhaps this is so iTunes
 	         * knows how much data to buffer.
@@ -421,6 +887,10 @@ _send_chunked_file (DmapAvShare *share, SoupServer * server, SoupMessage * messa
 		/* NOTE: Roku clients support only HTTP 1.0. */
 		g_debug ("Using HTTP 1.0 encoding.");
 		soup_message_headers_set_encoding (message->response_headers, SOUP_ENCODING_EOF);
+
+		/* The end of the body is the end of the connection. */
+		soup_message_headers_append (message->response_headers,
+		                             "Connection", "Close");
 	} else {
 		/* NOTE: Can not provide Content-Length when performing
 		 * real-time transcoding.
@@ -428,9 +898,6 @@ _send_chunked_file (DmapAvShare *share, SoupServer * server, SoupMessage * messa
 		g_debug ("Using HTTP 1.1 chunked encoding.");
 		soup_message_headers_set_encoding (message->response_headers, SOUP_ENCODING_CHUNKED);
 	}
-
-	soup_message_headers_append (message->response_headers, "Connection",
-				     "Close");
 	soup_message_headers_append (message->response_headers,
 				     "Content-Type",
 				     "application/x-dmap-tagged");
@@ -465,6 +932,14 @@ done:
 
 		soup_message_set_status (message, SOUP_STATUS_INTERNAL_SERVER_ERROR);
 
+		if (NULL != store) {
+			g_signal_handlers_disconnect_by_func (message,
+			                                      _transcode_cache_store_finished,
+			                                      store);
+			cd->eof = FALSE;
+			_transcode_cache_store_finished (message, store);
+		}
+
 		if (NULL != cd && NULL != cd->stream) {
 			ok = g_input_stream_close (cd->stream, NULL, &error);
 			if (!ok) {
@@ -491,6 +966,7 @@ done:
 
 	g_free (location);
 	g_free (format);
+	g_free (shared_key);
 
 	if (NULL != error) {
 		g_error_free(error);
@@ -499,6 +975,383 @@ done:
 	return;
 }
 
+typedef struct {
+	DmapAvShare *share;
+	TranscodePriority priority;
+	SoupServer *server;
+	SoupMessage *message;		/* NULL for a prefetch */
+	DmapAvRecord *record;
+	guint64 filesize;
+	guint64 offset;
+	gchar *transcode_mimetype;
+	gchar *cache_key;
+	/* Prefetch only. The entry is opened and committed on the main
+	 * loop; the worker thread only writes to cache_stream. */
+	DmapTranscodeCache *cache;
+	GOutputStream *cache_stream;
+	gboolean complete;
+} TranscodeJob;
+
+static void
+_transcode_job_free (TranscodeJob *job)
+{
+	if (NULL != job->message) {
+		g_object_unref (job->message);
+	}
+	if (NULL != job->cache_stream) {
+		g_object_unref (job->cache_stream);
+	}
+	dmap_transcode_cache_unref (job->cache);
+	g_object_unref (job->record);
+	g_free (job->transcode_mimetype);
+	g_free (job->cache_key);
+	g_free (job);
+}
+
+static TranscodePriority
+_transcode_priority (SoupMessage *message)
+{
+	TranscodePriority priority = TRANSCODE_PRIORITY_PLAYBACK;
+	const gchar *range_header;
+	guint64 start, end;
+
+	if (SOUP_METHOD_HEAD == message->method) {
+		priority = TRANSCODE_PRIORITY_PROBE;
+		goto done;
+	}
+
+	/* A closed, small range (e.g., "bytes=0-1") checks the stream
+	 * rather than playing it. */
+	range_header = soup_message_headers_get_one (message->request_headers,
+	                                             "Range");
+	if (NULL != range_header
+	 && 2 == sscanf (range_header, "bytes=%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+	                 &start, &end)
+	 && end >= start
+	 && end - start < DMAP_SHARE_CHUNK_SIZE) {
+		priority = TRANSCODE_PRIORITY_PROBE;
+	}
+
+done:
+	return priority;
+}
+
+static void
+_prefetch_thread (G_GNUC_UNUSED GTask *task,
+                  G_GNUC_UNUSED gpointer source_object,
+                  G_GNUC_UNUSED gpointer task_data,
+                  G_GNUC_UNUSED GCancellable *cancellable)
+{
+#ifdef HAVE_GSTREAMERAPP
+	gssize read_size;
+	gchar *chunk = NULL;
+	GInputStream *stream = NULL;
+	GInputStream *transcode_stream = NULL;
+	GError *error = NULL;
+	TranscodeJob *job = task_data;
+
+	stream = G_INPUT_STREAM (dmap_av_record_read (job->record, &error));
+	if (NULL == stream) {
+		g_warning ("Cannot open record to prefetch: %s", error->message);
+		goto done;
+	}
+
+	transcode_stream = dmap_transcode_stream_new (job->transcode_mimetype,
+	                                              stream);
+	if (NULL == transcode_stream || stream == transcode_stream) {
+		g_warning ("Could not set up transcode to prefetch");
+		goto done;
+	}
+
+	dmap_transcode_stream_set_read_wait (DMAP_TRANSCODE_STREAM (transcode_stream),
+	                                     PREFETCH_READ_WAIT_MSECONDS);
+
+	chunk = g_malloc (DMAP_SHARE_CHUNK_SIZE);
+
+	for (;;) {
+		read_size = g_input_stream_read (transcode_stream, chunk,
+		                                 DMAP_SHARE_CHUNK_SIZE,
+		                                 NULL, &error);
+		if (read_size < 0
+		 && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+			/* Waited above; this is a worker thread, so
+			 * just ask again. */
+			g_clear_error (&error);
+			continue;
+		}
+
+		if (read_size <= 0
+		 || !g_output_stream_write_all (job->cache_stream, chunk, read_size,
+		                                NULL, NULL, &error)) {
+			break;
+		}
+	}
+
+	if (NULL != error) {
+		g_warning ("Error prefetching transcode: %s", error->message);
+		goto done;
+	}
+
+	/* Read by _prefetch_done once the task completes. */
+	job->complete = TRUE;
+	g_debug ("Prefetched transcode %s", job->cache_key);
+
+done:
+	if (NULL != transcode_stream && stream != transcode_stream) {
+		g_input_stream_close (transcode_stream, NULL, NULL);
+		g_object_unref (transcode_stream);
+	}
+
+	if (NULL != stream) {
+		g_input_stream_close (stream, NULL, NULL);
+		g_object_unref (stream);
+	}
+
+	g_free (chunk);
+	g_clear_error (&error);
+#endif /* HAVE_GSTREAMERAPP */
+}
+
+static void
+_prefetch_done (GObject *source_object,
+                GAsyncResult *result,
+                G_GNUC_UNUSED gpointer user_data)
+{
+	TranscodeJob *job = g_task_get_task_data (G_TASK (result));
+
+	/* Back on the main loop, so the cache may be used again. */
+	dmap_transcode_cache_store_end (job->cache, job->cache_key,
+	                                job->cache_stream, job->complete);
+
+	_transcode_slot_release (DMAP_AV_SHARE (source_object));
+}
+
+/* Takes ownership of job. */
+static void
+_transcode_job_start (TranscodeJob *job, gboolean paused)
+{
+	GTask *task;
+	DmapAvShare *share = job->share;
+
+	if (NULL == job->message) {
+		job->cache_stream =
+			dmap_transcode_cache_store_begin (share->priv->transcode_cache,
+			                                  job->cache_key);
+		if (NULL == job->cache_stream) {
+			/* Already being stored, perhaps by a client request. */
+			g_debug ("Not prefetching %s; already being stored",
+			         job->cache_key);
+			_transcode_job_free (job);
+			goto done;
+		}
+
+		/* The worker must not touch the share or its cache. */
+		job->cache = dmap_transcode_cache_ref (share->priv->transcode_cache);
+		_transcode_slot_take (share);
+
+		task = g_task_new (share, NULL, _prefetch_done, NULL);
+		g_task_set_task_data (task, job, (GDestroyNotify) _transcode_job_free);
+		g_task_run_in_thread (task, _prefetch_thread);
+		g_object_unref (task);
+		goto done;
+	}
+
+	/* Takes a slot once its pipeline is running, unless it joins one. */
+	_send_chunked_file (share, job->server, job->message, job->record,
+	                    job->filesize, job->offset, job->transcode_mimetype,
+	                    NULL, job->cache_key);
+
+	if (paused) {
+		soup_server_unpause_message (job->server, job->message);
+	}
+
+	_transcode_job_free (job);
+
+done:
+	return;
+}
+
+static void
+_transcode_queued_finished_cb (G_GNUC_UNUSED SoupMessage *message,
+                               TranscodeJob *job)
+{
+	DmapAvShare *share = job->share;
+
+	/* Client went away while waiting. */
+	g_queue_remove (share->priv->transcode_queue[job->priority], job);
+	g_object_notify (G_OBJECT (share), "transcode-queued");
+
+	_transcode_job_free (job);
+}
+
+static TranscodeJob *
+_transcode_queue_pop (DmapAvShare *share)
+{
+	guint i;
+	TranscodeJob *job = NULL;
+
+	for (i = 0; i < TRANSCODE_PRIORITY_COUNT && NULL == job; i++) {
+		job = g_queue_pop_head (share->priv->transcode_queue[i]);
+	}
+
+	return job;
+}
+
+static void
+_transcode_dispatch (DmapAvShare *share)
+{
+	TranscodeJob *job;
+
+	while (0 == share->priv->transcode_max
+	    || share->priv->transcode_active < share->priv->transcode_max) {
+		job = _transcode_queue_pop (share);
+		if (NULL == job) {
+			break;
+		}
+
+		g_object_notify (G_OBJECT (share), "transcode-queued");
+
+		if (NULL != job->message) {
+			g_signal_handlers_disconnect_by_func (job->message,
+			                                      _transcode_queued_finished_cb,
+			                                      job);
+		}
+
+		_transcode_job_start (job, TRUE);
+	}
+}
+
+static guint
+_transcode_queued (DmapAvShare *share)
+{
+	guint i, queued = 0;
+
+	for (i = 0; i < TRANSCODE_PRIORITY_COUNT; i++) {
+		queued += g_queue_get_length (share->priv->transcode_queue[i]);
+	}
+
+	return queued;
+}
+
+static void
+_send_file (DmapAvShare *share, SoupServer * server, SoupMessage * message,
+            DmapAvRecord * record, guint64 filesize, guint64 offset,
+            const gchar * transcode_mimetype, GFile * cached,
+            const gchar * cache_key)
+{
+	gchar *format = NULL;
+	gchar *location = NULL;
+	gchar *shared_key = NULL;
+	gboolean has_video;
+	DmapSharedStream *shared = NULL;
+	TranscodeJob *job;
+
+	g_object_get (record, "format", &format,
+	                      "location", &location,
+	                      "has-video", &has_video, NULL);
+
+	if (NULL != location && 0 == offset) {
+		shared_key = _shared_stream_key (location, transcode_mimetype);
+		shared = g_hash_table_lookup (share->priv->shared_streams,
+		                              shared_key);
+	}
+
+	if (NULL != cached
+	 || NULL == format
+	 || !_should_transcode (share, format, has_video, transcode_mimetype)
+	 || (NULL != shared && dmap_shared_stream_joinable (shared))) {
+		/* Cheap, or joins a running transcode whose shared stream
+		 * already holds a slot; not subject to scheduling. */
+		_send_chunked_file (share, server, message, record, filesize,
+		                    offset, transcode_mimetype, cached, cache_key);
+		goto done;
+	}
+
+	job = g_new0 (TranscodeJob, 1);
+	job->share = share;
+	job->priority = _transcode_priority (message);
+	job->server = server;
+	job->message = g_object_ref (message);
+	job->record = g_object_ref (record);
+	job->filesize = filesize;
+	job->offset = offset;
+	job->transcode_mimetype = g_strdup (transcode_mimetype);
+	job->cache_key = g_strdup (cache_key);
+
+	if (0 == share->priv->transcode_max
+	 || share->priv->transcode_active < share->priv->transcode_max) {
+		_transcode_job_start (job, FALSE);
+		goto done;
+	}
+
+	g_debug ("Queueing transcode; %u active", share->priv->transcode_active);
+
+	soup_server_pause_message (server, message);
+	g_signal_connect (message, "finished",
+	                  G_CALLBACK (_transcode_queued_finished_cb), job);
+	g_queue_push_tail (share->priv->transcode_queue[job->priority], job);
+	g_object_notify (G_OBJECT (share), "transcode-queued");
+
+done:
+	g_free (format);
+	g_free (location);
+	g_free (shared_key);
+}
+
+void
+dmap_av_share_prefetch (DmapAvShare * share, GList * records)
+{
+	guint n;
+	guint64 size;
+	GList *iter;
+	GFile *cached;
+	gchar *cache_key;
+	gchar *transcode_mimetype = NULL;
+	TranscodeJob *job;
+	GQueue *queue = share->priv->transcode_queue[TRANSCODE_PRIORITY_PREFETCH];
+
+	/* A new hint supersedes older ones that have not yet started. */
+	while (NULL != (job = g_queue_pop_head (queue))) {
+		_transcode_job_free (job);
+	}
+
+	g_object_get (share, "transcode-mimetype", &transcode_mimetype, NULL);
+
+	for (iter = records, n = 0;
+	     NULL != iter && n < share->priv->transcode_prefetch;
+	     iter = iter->next, n++) {
+		/* NULL unless record needs transcoding and there is a cache. */
+		cache_key = _transcode_cache_key (share, iter->data,
+		                                  transcode_mimetype);
+		if (NULL == cache_key) {
+			continue;
+		}
+
+		cached = dmap_transcode_cache_lookup (share->priv->transcode_cache,
+		                                      cache_key, &size);
+		if (NULL != cached) {
+			g_object_unref (cached);
+			g_free (cache_key);
+			continue;
+		}
+
+		job = g_new0 (TranscodeJob, 1);
+		job->share = share;
+		job->priority = TRANSCODE_PRIORITY_PREFETCH;
+		job->record = g_object_ref (iter->data);
+		job->transcode_mimetype = g_strdup (transcode_mimetype);
+		job->cache_key = cache_key;
+
+		g_queue_push_tail (queue, job);
+	}
+
+	g_free (transcode_mimetype);
+
+	g_object_notify (G_OBJECT (share), "transcode-queued");
+
+	_transcode_dispatch (share);
+}
+
 static void
 _add_entry_to_mlcl (guint id, DmapRecord * record, gpointer _mb)
 {
@@ -932,6 +1785,10 @@ _databases_items_xxx (DmapShare * share,
 	const gchar *range_header;
 	guint64 filesize;
 	guint64 offset = 0;
+	gchar *cache_key = NULL;
+	GFile *cached = NULL;
+	gchar *location = NULL;
+	gchar *identity = NULL;
 
 	rest_of_path = strchr (path + 1, '/');
 	id_str = rest_of_path + 9;
@@ -949,10 +1806,34 @@ _databases_items_xxx (DmapShare * share,
 		goto done;
 	}
 
-	g_object_get (record, "filesize", &filesize, NULL);
+	g_object_get (record, "filesize", &filesize,
+	                      "location", &location, NULL);
+	g_object_get (share, "transcode-mimetype", &transcode_mimetype, NULL);
 
 	DMAP_SHARE_GET_CLASS (share)->message_add_standard_headers
 		(share, msg);
+
+	/* A repeated request for an unchanged file costs a 304. */
+	if (NULL != location) {
+		identity = g_strdup_printf ("%u\n%s\n%" G_GUINT64_FORMAT "\n%s",
+		                            id, location, filesize,
+		                            transcode_mimetype ? transcode_mimetype : "");
+		if (dmap_private_utils_message_not_modified (msg, identity,
+		                                             dmap_private_utils_uri_mtime (location),
+		                                             DMAP_SHARE_ITEM_MAX_AGE)) {
+			goto done;
+		}
+	}
+
+	cache_key = _transcode_cache_key (DMAP_AV_SHARE (share), record,
+	                                  transcode_mimetype);
+	if (NULL != cache_key) {
+		/* A hit replaces filesize with that of the transcoded file. */
+		cached = dmap_transcode_cache_lookup (DMAP_AV_SHARE (share)->priv->transcode_cache,
+		                                      cache_key,
+		                                     &filesize);
+	}
+
 	soup_message_headers_append (msg->response_headers, "Accept-Ranges",
 				     "bytes");
 
@@ -983,11 +1864,14 @@ _databases_items_xxx (DmapShare * share,
 	} else {
 		soup_message_set_status (msg, SOUP_STATUS_OK);
 	}
-	g_object_get (share, "transcode-mimetype", &transcode_mimetype, NULL);
-	_send_chunked_file (DMAP_AV_SHARE(share), server, msg, record, filesize,
-	                    offset, transcode_mimetype);
+	_send_file (DMAP_AV_SHARE(share), server, msg, record, filesize,
+	            offset, transcode_mimetype, cached, cache_key);
 
 done:
+	if (NULL != cached) {
+		g_object_unref (cached);
+	}
+
 	if (NULL != record) {
 		g_object_unref (record);
 	}
@@ -997,6 +1881,9 @@ done:
 	}
 
 	g_free(transcode_mimetype);
+	g_free(cache_key);
+	g_free(location);
+	g_free(identity);
 }
 
 static struct DmapMetaDataMap *
@@ -1349,6 +2236,60 @@ START_TEST(_should_transcode_test_yes_trancode_mimetype_to_mp4)
 }
 END_TEST
 
+START_TEST(_transcode_priority_test_playback)
+{
+	SoupMessage *message = soup_message_new(SOUP_METHOD_GET, "http://test/");
+	ck_assert_int_eq(TRANSCODE_PRIORITY_PLAYBACK, _transcode_priority(message));
+
+	soup_message_headers_append(message->request_headers, "Range", "bytes=1024-");
+	ck_assert_int_eq(TRANSCODE_PRIORITY_PLAYBACK, _transcode_priority(message));
+	g_object_unref(message);
+}
+END_TEST
+
+START_TEST(_transcode_priority_test_probe)
+{
+	SoupMessage *message = soup_message_new(SOUP_METHOD_HEAD, "http://test/");
+	ck_assert_int_eq(TRANSCODE_PRIORITY_PROBE, _transcode_priority(message));
+	g_object_unref(message);
+
+	message = soup_message_new(SOUP_METHOD_GET, "http://test/");
+	soup_message_headers_append(message->request_headers, "Range", "bytes=0-1");
+	ck_assert_int_eq(TRANSCODE_PRIORITY_PROBE, _transcode_priority(message));
+	g_object_unref(message);
+}
+END_TEST
+
+START_TEST(_transcode_slot_shared_stream_test)
+{
+	DmapShare *share;
+	GInputStream *source, *first, *second;
+	guint active;
+
+	share = _build_share_test("_transcode_slot_shared_stream_test");
+	source = g_memory_input_stream_new_from_data ("data", 4, NULL);
+
+	first = _shared_stream_start (DMAP_AV_SHARE (share), "key", source,
+	                              NULL, TRUE);
+	second = _shared_stream_join (DMAP_AV_SHARE (share), "key");
+	ck_assert_ptr_ne (NULL, second);
+
+	g_object_get (share, "transcode-active", &active, NULL);
+	ck_assert_uint_eq (1, active);
+
+	/* The first reader leaving does not stop the pipeline. */
+	g_object_unref (first);
+	g_object_get (share, "transcode-active", &active, NULL);
+	ck_assert_uint_eq (1, active);
+
+	g_object_unref (second);
+	g_object_get (share, "transcode-active", &active, NULL);
+	ck_assert_uint_eq (0, active);
+
+	g_object_unref (share);
+}
+END_TEST
+
 START_TEST(_get_desired_port_test)
 {
 	DmapShare *share = _build_share_test("_get_desired_port_test");
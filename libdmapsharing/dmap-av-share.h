@@ -111,6 +111,21 @@ DmapAvShare *dmap_av_share_new (const char *name, const char *password,
 			   DmapDb * db, DmapContainerDb * container_db,
 			   gchar * transcode_mimetype);
 
+/**
+ * dmap_av_share_prefetch:
+ * @share: a #DmapAvShare.
+ * @records: (element-type DmapAvRecord): the records expected to be
+ * requested next, in order.
+ *
+ * Hint that the first #DmapAvShare:transcode-prefetch records in @records
+ * will soon be requested. Those that need transcoding are transcoded into
+ * the transcode cache in the background, at a lower priority than
+ * client requests, so that they can be sent without a start-up delay.
+ * Has no effect unless #DmapAvShare:transcode-cache-dir is set. Each call
+ * replaces hints that have not yet been acted on.
+ */
+void dmap_av_share_prefetch (DmapAvShare * share, GList * records);
+
 #endif /* _DMAP_AV_SHARE_H */
 
 G_END_DECLS
@@ -0,0 +1,216 @@
+/*
+ * Bounded log of library changes used by DmapShare to answer delta requests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include "dmap-change-log.h"
+
+struct DmapChangeLog
+{
+	guint max_entries;
+	guint floor;		/* Oldest revision deltas can start from */
+	GQueue *changes;	/* _Change, oldest revision first */
+	GHashTable *index;	/* ID to link in changes */
+};
+
+typedef struct
+{
+	guint id;
+	guint revision;
+	gboolean deleted;
+} _Change;
+
+DmapChangeLog *
+dmap_change_log_new (guint revision, guint max_entries)
+{
+	DmapChangeLog *log;
+
+	log = g_new0 (DmapChangeLog, 1);
+	log->max_entries = max_entries;
+	log->floor = revision;
+	log->changes = g_queue_new ();
+	log->index = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	return log;
+}
+
+void
+dmap_change_log_free (DmapChangeLog * log)
+{
+	if (NULL == log) {
+		return;
+	}
+
+	g_hash_table_destroy (log->index);
+	g_queue_free_full (log->changes, g_free);
+	g_free (log);
+}
+
+void
+dmap_change_log_record (DmapChangeLog * log,
+                        guint id,
+                        guint revision,
+                        gboolean deleted)
+{
+	GList *link;
+	_Change *change, *tail;
+
+	/* Keep the queue ordered even if the revision went backwards. */
+	tail = g_queue_peek_tail (log->changes);
+	if (NULL != tail && revision < tail->revision) {
+		revision = tail->revision;
+	}
+
+	link = g_hash_table_lookup (log->index, GUINT_TO_POINTER (id));
+	if (NULL != link) {
+		g_queue_unlink (log->changes, link);
+		g_queue_push_tail_link (log->changes, link);
+		change = link->data;
+	} else {
+		change = g_new0 (_Change, 1);
+		change->id = id;
+		g_queue_push_tail (log->changes, change);
+		g_hash_table_insert (log->index, GUINT_TO_POINTER (id),
+		                     log->changes->tail);
+	}
+
+	change->revision = revision;
+	change->deleted = deleted;
+
+	while (0 != log->max_entries
+	    && g_queue_get_length (log->changes) > log->max_entries) {
+		change = g_queue_pop_head (log->changes);
+		g_hash_table_remove (log->index,
+		                     GUINT_TO_POINTER (change->id));
+
+		/* Clients older than this would miss the change. */
+		log->floor = MAX (log->floor, change->revision + 1);
+
+		g_free (change);
+	}
+}
+
+gboolean
+dmap_change_log_since (DmapChangeLog * log,
+                       guint revision,
+                       GArray * changed,
+                       GArray * deleted)
+{
+	GList *link;
+	gboolean ok = FALSE;
+
+	if (revision < log->floor) {
+		goto done;
+	}
+
+	for (link = g_queue_peek_tail_link (log->changes);
+	     NULL != link;
+	     link = link->prev) {
+		_Change *change = link->data;
+
+		if (change->revision < revision) {
+			break;
+		}
+
+		g_array_append_val (change->deleted ? deleted : changed,
+		                    change->id);
+	}
+
+	ok = TRUE;
+
+done:
+	return ok;
+}
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+
+START_TEST(_change_log_since_test)
+{
+	GArray *changed, *deleted;
+	DmapChangeLog *log;
+
+	log = dmap_change_log_new (1, 0);
+
+	dmap_change_log_record (log, 10, 1, FALSE);
+	dmap_change_log_record (log, 11, 2, FALSE);
+	dmap_change_log_record (log, 12, 2, TRUE);
+
+	/* Modifying 10 again moves it to revision 3. */
+	dmap_change_log_record (log, 10, 3, FALSE);
+
+	changed = g_array_new (FALSE, FALSE, sizeof (guint));
+	deleted = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	ck_assert (dmap_change_log_since (log, 3, changed, deleted));
+	ck_assert_int_eq (1, changed->len);
+	ck_assert_int_eq (10, g_array_index (changed, guint, 0));
+	ck_assert_int_eq (0, deleted->len);
+
+	g_array_set_size (changed, 0);
+
+	ck_assert (dmap_change_log_since (log, 2, changed, deleted));
+	ck_assert_int_eq (2, changed->len);
+	ck_assert_int_eq (1, deleted->len);
+	ck_assert_int_eq (12, g_array_index (deleted, guint, 0));
+
+	g_array_set_size (changed, 0);
+	g_array_set_size (deleted, 0);
+
+	ck_assert (dmap_change_log_since (log, 4, changed, deleted));
+	ck_assert_int_eq (0, changed->len);
+	ck_assert_int_eq (0, deleted->len);
+
+	/* Changes before the log began are unknown. */
+	ck_assert (!dmap_change_log_since (log, 0, changed, deleted));
+
+	g_array_free (changed, TRUE);
+	g_array_free (deleted, TRUE);
+	dmap_change_log_free (log);
+}
+END_TEST
+
+START_TEST(_change_log_bound_test)
+{
+	GArray *changed, *deleted;
+	DmapChangeLog *log;
+
+	log = dmap_change_log_new (1, 2);
+
+	dmap_change_log_record (log, 10, 1, FALSE);
+	dmap_change_log_record (log, 11, 2, FALSE);
+	dmap_change_log_record (log, 12, 3, FALSE);
+
+	changed = g_array_new (FALSE, FALSE, sizeof (guint));
+	deleted = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	/* Dropping 10 leaves revision 1 out of reach. */
+	ck_assert (!dmap_change_log_since (log, 1, changed, deleted));
+	ck_assert (dmap_change_log_since (log, 2, changed, deleted));
+	ck_assert_int_eq (2, changed->len);
+
+	g_array_free (changed, TRUE);
+	g_array_free (deleted, TRUE);
+	dmap_change_log_free (log);
+}
+END_TEST
+
+#include "dmap-change-log-suite.c"
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * Bounded log of library changes used by DmapShare to answer delta requests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DMAP_CHANGE_LOG_H
+#define _DMAP_CHANGE_LOG_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The latest change to each record ID, tagged with the revision in which
+ * it happened: either added or modified, or deleted. At most max_entries
+ * IDs are kept; dropping the oldest means deltas from revisions before it
+ * can no longer be answered and need a full listing instead.
+ */
+typedef struct DmapChangeLog DmapChangeLog;
+
+/* Changes before revision are unknown. A max_entries of 0 means
+ * unbounded. */
+DmapChangeLog *dmap_change_log_new (guint revision, guint max_entries);
+void     dmap_change_log_free (DmapChangeLog * log);
+
+void     dmap_change_log_record (DmapChangeLog * log,
+                                 guint id,
+                                 guint revision,
+                                 gboolean deleted);
+
+/* Appends to changed and deleted (arrays of guint) the IDs changed in or
+ * after revision. Returns FALSE, appending nothing, if the log no longer
+ * reaches back that far. */
+gboolean dmap_change_log_since (DmapChangeLog * log,
+                                guint revision,
+                                GArray * changed,
+                                GArray * deleted);
+
+G_END_DECLS
+#endif /* _DMAP_CHANGE_LOG_H */
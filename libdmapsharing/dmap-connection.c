@@ -28,6 +28,7 @@
 #include <zlib.h>
 #endif
 
+#include <glib/gstdio.h>
 #include <libsoup/soup.h>
 
 #include "dmap-md5.h"
@@ -41,6 +42,12 @@
 
 #define ITUNES_7_SERVER "iTunes/7"
 
+/* Playlist entry listings requested at once by default. */
+#define MAX_CONCURRENT_REQUESTS 8
+
+/* Threads shared by all connections for handling large responses. */
+#define RESPONSE_HANDLER_THREADS 4
+
 static gboolean _do_something (DmapConnection * connection);
 
 struct DmapConnectionPrivate
@@ -65,15 +72,26 @@ struct DmapConnectionPrivate
 	gint request_id;
 	gint database_id;
 
-	guint reading_playlist;
 	GSList *playlists;
+	GSList *next_playlist;		/* Next to request entries for */
+	guint playlists_pending;	/* Entry requests in flight */
+	guint playlists_read;
+	gboolean playlists_failed;
+	guint max_concurrent_requests;
+
+	gchar *cache_dir;
+	gchar *cache_path;	/* This database's directory in cache_dir */
+	gboolean cache_valid;	/* cache_path holds the current revision;
+				 * only used in the main loop */
+	gchar *server_info_hash;	/* Of the /server-info response */
 	GHashTable *item_id_to_uri;
 
 	DmapDb *db;
 	DmapRecordFactory *record_factory;
 
 	DmapConnectionState state;
-	gboolean use_response_handler_thread;
+	gint listings_pending;	/* Media and playlist listings in flight */
+	gint listings_failed;
 	float progress;
 
 	guint emit_progress_id;
@@ -91,6 +109,7 @@ static void
 dmap_connection_init (DmapConnection * connection)
 {
 	connection->priv = dmap_connection_get_instance_private(connection);
+	connection->priv->max_concurrent_requests = MAX_CONCURRENT_REQUESTS;
 }
 
 enum
@@ -109,6 +128,8 @@ enum
 	PROP_REVISION_NUMBER,
 	PROP_USERNAME,
 	PROP_PASSWORD,
+	PROP_MAX_CONCURRENT_REQUESTS,
+	PROP_CACHE_DIR,
 };
 
 enum
@@ -205,6 +226,9 @@ _finalize (GObject * object)
 	g_free (connection->priv->username);
 	g_free (connection->priv->password);
 	g_free (connection->priv->host);
+	g_free (connection->priv->cache_dir);
+	g_free (connection->priv->cache_path);
+	g_free (connection->priv->server_info_hash);
 
 	G_OBJECT_CLASS (dmap_connection_parent_class)->finalize (object);
 
@@ -269,6 +293,18 @@ _set_property (GObject * object, guint prop_id,
 		g_free(priv->password);
 		priv->password = g_value_dup_string (value);
 		break;
+	case PROP_MAX_CONCURRENT_REQUESTS:
+		priv->max_concurrent_requests = g_value_get_uint (value);
+		if (priv->session) {
+			g_object_set (priv->session,
+			              SOUP_SESSION_MAX_CONNS_PER_HOST,
+			              priv->max_concurrent_requests, NULL);
+		}
+		break;
+	case PROP_CACHE_DIR:
+		g_free (priv->cache_dir);
+		priv->cache_dir = g_value_dup_string (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -315,6 +351,12 @@ _get_property (GObject * object, guint prop_id,
 	case PROP_USERNAME:
 		g_value_set_string (value, priv->username);
 		break;
+	case PROP_MAX_CONCURRENT_REQUESTS:
+		g_value_set_uint (value, priv->max_concurrent_requests);
+		break;
+	case PROP_CACHE_DIR:
+		g_value_set_string (value, priv->cache_dir);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -433,6 +475,22 @@ dmap_connection_class_init (DmapConnectionClass * klass)
 							      NULL,
 							      G_PARAM_WRITABLE));
 
+	g_object_class_install_property (object_class,
+					 PROP_MAX_CONCURRENT_REQUESTS,
+					 g_param_spec_uint ("max-concurrent-requests",
+							    "maximum concurrent requests",
+							    "maximum playlist requests in flight",
+							    1, G_MAXUINT,
+							    MAX_CONCURRENT_REQUESTS,
+							    G_PARAM_READWRITE));
+
+	g_object_class_install_property (object_class, PROP_CACHE_DIR,
+					 g_param_spec_string ("cache-dir",
+							      "cache directory",
+							      "directory to keep listings in across connections, or NULL",
+							      NULL,
+							      G_PARAM_READWRITE));
+
 	_signals[AUTHENTICATE] = g_signal_new ("authenticate",
 					      G_TYPE_FROM_CLASS
 					      (object_class),
@@ -603,8 +661,160 @@ typedef struct {
 
 	DmapResponseHandler response_handler;
 	gpointer user_data;
+	gboolean use_thread;
+
+	gchar *cache_name;	/* Where the response is kept in the cache */
+	gchar *cached;		/* Response read back from the cache */
+	gsize cached_length;
+	gchar *path;		/* Fetched again if the cached response is bad */
 } DmapResponseData;
 
+#define CACHE_REVISION_FILE "revision"
+
+static void
+_cache_clear (const gchar * path)
+{
+	GDir *dir;
+	const gchar *name;
+
+	dir = g_dir_open (path, 0, NULL);
+	if (NULL == dir) {
+		goto done;
+	}
+
+	while (NULL != (name = g_dir_read_name (dir))) {
+		gchar *filename = g_build_filename (path, name, NULL);
+		g_unlink (filename);
+		g_free (filename);
+	}
+
+	g_dir_close (dir);
+
+done:
+	return;
+}
+
+/* Finds this database's directory in the cache and checks whether it
+ * holds the server's current revision. If not, it is emptied so that the
+ * responses about to be fetched can be kept there. Persistent IDs and
+ * revision numbers alone do not tell servers apart: libdmapsharing's own
+ * always report persistent ID 1 and start at revision 5. So the key also
+ * holds the server's address, its /server-info response and the
+ * database's item count. */
+static void
+_cache_open (DmapConnection * connection, gint64 persistent_id,
+             gint item_count)
+{
+	DmapConnectionPrivate *priv = connection->priv;
+	gchar *key = NULL;
+	gchar *hash = NULL;
+	gchar *filename = NULL;
+	gchar *contents = NULL;
+
+	g_free (priv->cache_path);
+	priv->cache_path = NULL;
+	priv->cache_valid = FALSE;
+
+	if (NULL == priv->cache_dir) {
+		goto done;
+	}
+
+	key = g_strdup_printf ("%s/%s/%s:%u/%s/%" G_GINT64_FORMAT "/%d",
+	                       G_OBJECT_TYPE_NAME (connection),
+	                       priv->name ? priv->name : "",
+	                       priv->host ? priv->host : "", priv->port,
+	                       priv->server_info_hash
+	                       ? priv->server_info_hash : "",
+	                       persistent_id, item_count);
+	hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+	priv->cache_path = g_build_filename (priv->cache_dir, hash, NULL);
+
+	filename = g_build_filename (priv->cache_path, CACHE_REVISION_FILE,
+	                             NULL);
+	if (g_file_get_contents (filename, &contents, NULL, NULL)
+	 && g_ascii_strtoll (contents, NULL, 10) == priv->revision_number) {
+		g_debug ("Cache holds revision %d", priv->revision_number);
+		priv->cache_valid = TRUE;
+		goto done;
+	}
+
+	_cache_clear (priv->cache_path);
+
+	if (0 != g_mkdir_with_parents (priv->cache_path, 0700)) {
+		g_warning ("Failed to create cache directory %s",
+		           priv->cache_path);
+		g_free (priv->cache_path);
+		priv->cache_path = NULL;
+	}
+
+done:
+	g_free (key);
+	g_free (hash);
+	g_free (filename);
+	g_free (contents);
+}
+
+/* Marks the cache as holding the current revision, once every response
+ * has been kept. */
+static void
+_cache_commit (DmapConnection * connection)
+{
+	DmapConnectionPrivate *priv = connection->priv;
+	gchar *filename = NULL;
+	gchar *contents = NULL;
+	GError *error = NULL;
+
+	if (NULL == priv->cache_path || priv->cache_valid) {
+		goto done;
+	}
+
+	filename = g_build_filename (priv->cache_path, CACHE_REVISION_FILE,
+	                             NULL);
+	contents = g_strdup_printf ("%d", priv->revision_number);
+	if (!g_file_set_contents (filename, contents, -1, &error)) {
+		g_warning ("Failed to write %s: %s", filename, error->message);
+		g_clear_error (&error);
+		goto done;
+	}
+
+	priv->cache_valid = TRUE;
+
+done:
+	g_free (filename);
+	g_free (contents);
+}
+
+/* Like cache_valid, only called in the main loop. */
+static void
+_cache_invalidate (DmapConnection * connection)
+{
+	gchar *filename;
+
+	filename = g_build_filename (connection->priv->cache_path,
+	                             CACHE_REVISION_FILE, NULL);
+	g_unlink (filename);
+	g_free (filename);
+
+	connection->priv->cache_valid = FALSE;
+}
+
+static void
+_cache_store (DmapConnection * connection, const gchar * name,
+              const guint8 * response, gsize response_length)
+{
+	gchar *filename;
+	GError *error = NULL;
+
+	filename = g_build_filename (connection->priv->cache_path, name, NULL);
+	if (!g_file_set_contents (filename, (const gchar *) response,
+	                          response_length, &error)) {
+		g_warning ("Failed to write %s: %s", filename, error->message);
+		g_clear_error (&error);
+	}
+
+	g_free (filename);
+}
+
 static gboolean
 _emit_progress_idle (DmapConnection * connection)
 {
@@ -798,6 +1008,12 @@ _actual_http_response_handler (DmapResponseData * data)
 					      data->message->reason_phrase);
 	}
 
+	if (data->cache_name && structure
+	    && SOUP_STATUS_IS_SUCCESSFUL (data->status)) {
+		_cache_store (data->connection, data->cache_name,
+		              response, response_length);
+	}
+
 	if (data->response_handler) {
 		(*(data->response_handler)) (data->connection, data->status,
 					     structure, data->user_data);
@@ -811,11 +1027,136 @@ _actual_http_response_handler (DmapResponseData * data)
 	g_free (message_path);
 	g_object_unref (G_OBJECT (data->connection));
 	g_object_unref (G_OBJECT (data->message));
+	g_free (data->cache_name);
 	g_free (data);
 
 	return NULL;
 }
 
+static gboolean _queue_get (DmapConnection * connection,
+                            const char *path,
+                            const char *cache_name,
+                            DmapResponseHandler handler,
+                            gpointer user_data, gboolean use_thread);
+
+static void
+_cached_response_data_free (DmapResponseData * data)
+{
+	g_object_unref (G_OBJECT (data->connection));
+	g_free (data->cache_name);
+	g_free (data->cached);
+	g_free (data->path);
+	g_free (data);
+}
+
+/* Runs in the main loop, which owns the session and the cache state,
+ * once a cached response has failed to parse. */
+static gboolean
+_cached_refetch (DmapResponseData * data)
+{
+	_cache_invalidate (data->connection);
+
+	if (!_queue_get (data->connection, data->path, data->cache_name,
+	                 data->response_handler, data->user_data,
+	                 data->use_thread)
+	 && data->response_handler) {
+		(*(data->response_handler)) (data->connection,
+		                             SOUP_STATUS_MALFORMED, NULL,
+		                             data->user_data);
+	}
+
+	_cached_response_data_free (data);
+
+	return FALSE;
+}
+
+/* Handles a response read back from the cache, as
+ * _actual_http_response_handler does one from the server. A response
+ * that no longer parses is fetched from the server instead. */
+static gboolean
+_cached_response_handler (DmapResponseData * data)
+{
+	GNode *structure;
+	GError *error = NULL;
+
+	structure = dmap_structure_parse ((const guint8 *) data->cached,
+	                                  data->cached_length, &error);
+	if (error != NULL) {
+		g_debug ("Error parsing cached %s: %s", data->cache_name,
+		         error->message);
+		g_clear_error (&error);
+		dmap_structure_destroy (structure);
+		g_idle_add ((GSourceFunc) _cached_refetch, data);
+		goto done;
+	}
+
+	data->status = SOUP_STATUS_OK;
+
+	if (data->response_handler) {
+		(*(data->response_handler)) (data->connection, data->status,
+					     structure, data->user_data);
+	}
+
+	dmap_structure_destroy (structure);
+	_cached_response_data_free (data);
+
+done:
+	return FALSE;
+}
+
+static void
+_response_pool_func (gpointer data, G_GNUC_UNUSED gpointer user_data)
+{
+	if (NULL == ((DmapResponseData *) data)->message) {
+		_cached_response_handler (data);
+	} else {
+		_actual_http_response_handler (data);
+	}
+}
+
+/* Hands data to a pool shared by every connection, so that a sync does
+ * not create a thread per response; progress and state changes still
+ * reach the main loop through idle sources. Returns FALSE if the pool is
+ * unavailable, in which case the caller handles data itself. */
+static gboolean
+_push_response (DmapResponseData * data)
+{
+	static gsize _response_pool_init = 0;
+	static GThreadPool *_response_pool = NULL;
+	gboolean ok = FALSE;
+	GError *error = NULL;
+
+	if (g_once_init_enter (&_response_pool_init)) {
+		_response_pool = g_thread_pool_new (_response_pool_func, NULL,
+		                                    RESPONSE_HANDLER_THREADS,
+		                                    FALSE, &error);
+		if (NULL == _response_pool) {
+			g_warning ("Failed to create response thread pool: %s",
+			           error->message);
+			g_clear_error (&error);
+		}
+
+		g_once_init_leave (&_response_pool_init, 1);
+	}
+
+	if (NULL == _response_pool) {
+		goto done;
+	}
+
+	/* GLib queues data even when it fails to start another thread; one
+	 * of the pool's existing threads will pick it up. */
+	if (!g_thread_pool_push (_response_pool, data, &error)) {
+		g_warning ("Failed to start response thread: %s",
+		           error->message);
+		g_clear_error (&error);
+	}
+
+	ok = TRUE;
+
+done:
+	return ok;
+}
+
 static void
 _http_response_handler (G_GNUC_UNUSED SoupSession * session,
                         SoupMessage * message, DmapResponseData * data)
@@ -824,6 +1165,7 @@ _http_response_handler (G_GNUC_UNUSED SoupSession * session,
 
 	if (message->status_code == SOUP_STATUS_CANCELLED) {
 		g_debug ("Message cancelled");
+		g_free (data->cache_name);
 		g_free (data);
 		return;
 	}
@@ -843,22 +1185,20 @@ _http_response_handler (G_GNUC_UNUSED SoupSession * session,
 
 	/* to avoid blocking the UI, handle big responses in a separate thread */
 	if (SOUP_STATUS_IS_SUCCESSFUL (data->status)
-	    && data->connection->priv->use_response_handler_thread) {
-		g_debug ("creating thread to handle daap response");
-		GThread *thread = g_thread_new (NULL, (GThreadFunc) _actual_http_response_handler, data);
-		if (NULL == thread) {
-			g_warning ("failed to create new thread");
-		}
+	    && data->use_thread
+	    && _push_response (data)) {
+		g_debug ("queued daap response for handler thread");
 	} else {
 		_actual_http_response_handler (data);
 	}
 }
 
 static gboolean
-_http_get (DmapConnection * connection,
-           const char *path,
-           DmapResponseHandler handler,
-           gpointer user_data, gboolean use_thread)
+_queue_get (DmapConnection * connection,
+            const char *path,
+            const char *cache_name,
+            DmapResponseHandler handler,
+            gpointer user_data, gboolean use_thread)
 {
 	gboolean ok = FALSE;
 	DmapConnectionPrivate *priv = connection->priv;
@@ -872,11 +1212,11 @@ _http_get (DmapConnection * connection,
 		goto done;
 	}
 
-	priv->use_response_handler_thread = use_thread;
-
 	data = g_new0 (DmapResponseData, 1);
 	data->response_handler = handler;
 	data->user_data = user_data;
+	data->use_thread = use_thread;
+	data->cache_name = g_strdup (cache_name);
 
 	g_object_ref (G_OBJECT (connection));
 	data->connection = connection;
@@ -893,6 +1233,72 @@ done:
 	return ok;
 }
 
+static gboolean
+_http_get (DmapConnection * connection,
+           const char *path,
+           DmapResponseHandler handler,
+           gpointer user_data, gboolean use_thread)
+{
+	return _queue_get (connection, path, NULL, handler, user_data,
+	                   use_thread);
+}
+
+/* Like _http_get, but answers from the cache when it holds the current
+ * revision, and otherwise keeps the response there as cache_name. */
+static gboolean
+_cached_get (DmapConnection * connection,
+             const char *path,
+             const char *cache_name,
+             DmapResponseHandler handler,
+             gpointer user_data, gboolean use_thread)
+{
+	gboolean ok = FALSE;
+	DmapConnectionPrivate *priv = connection->priv;
+	DmapResponseData *data;
+	gchar *filename = NULL;
+	gchar *contents = NULL;
+	gsize length;
+
+	if (NULL == priv->cache_path) {
+		ok = _http_get (connection, path, handler, user_data,
+		                use_thread);
+		goto done;
+	}
+
+	filename = g_build_filename (priv->cache_path, cache_name, NULL);
+	if (!priv->cache_valid
+	 || !g_file_get_contents (filename, &contents, &length, NULL)) {
+		ok = _queue_get (connection, path, cache_name, handler,
+		                 user_data, use_thread);
+		goto done;
+	}
+
+	g_debug ("Reading %s from the cache", path);
+
+	data = g_new0 (DmapResponseData, 1);
+	data->response_handler = handler;
+	data->user_data = user_data;
+	data->use_thread = use_thread;
+	data->cache_name = g_strdup (cache_name);
+	data->cached = contents;
+	data->cached_length = length;
+	data->path = g_strdup (path);
+
+	g_object_ref (G_OBJECT (connection));
+	data->connection = connection;
+
+	/* Handlers expect to run after _http_get returns. */
+	if (!use_thread || !_push_response (data)) {
+		g_idle_add ((GSourceFunc) _cached_response_handler, data);
+	}
+
+	ok = TRUE;
+
+done:
+	g_free (filename);
+	return ok;
+}
+
 gboolean
 dmap_connection_get (DmapConnection * self,
 		     const gchar * path,
@@ -914,19 +1320,24 @@ _state_done (DmapConnection * connection, gboolean result)
 		priv->result = FALSE;
 	} else {
 		switch (priv->state) {
+		case DMAP_GET_MEDIA:
+			/* the playlists were read along with the media */
 		case DMAP_GET_PLAYLISTS:
 			if (priv->playlists == NULL) {
+				_cache_commit (connection);
 				priv->state = DMAP_DONE;
 			} else {
 				priv->state = DMAP_GET_PLAYLIST_ENTRIES;
+				priv->next_playlist = priv->playlists;
+				priv->playlists_pending = 0;
+				priv->playlists_read = 0;
+				priv->playlists_failed = FALSE;
 			}
 			break;
 		case DMAP_GET_PLAYLIST_ENTRIES:
-			/* keep reading playlists until we've got them all */
-			if (++priv->reading_playlist >=
-			    g_slist_length (priv->playlists)) {
-				priv->state = DMAP_DONE;
-			}
+			/* only called once every playlist has been read */
+			_cache_commit (connection);
+			priv->state = DMAP_DONE;
 			break;
 
 		case DMAP_LOGOUT:
@@ -964,6 +1375,21 @@ _state_done (DmapConnection * connection, gboolean result)
 		g_idle_add ((GSourceFunc) _do_something, connection);
 }
 
+static gchar *
+_structure_hash (GNode * structure)
+{
+	gchar *data;
+	gchar *hash;
+	guint length;
+
+	data = dmap_structure_serialize (structure, &length);
+	hash = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+	                                    (const guchar *) data, length);
+	g_free (data);
+
+	return hash;
+}
+
 static void
 _handle_server_info (DmapConnection * connection, guint status,
                      GNode * structure, G_GNUC_UNUSED gpointer user_data)
@@ -986,6 +1412,11 @@ _handle_server_info (DmapConnection * connection, guint status,
 	}
 
 	priv->dmap_version = g_value_get_double (&(item->content));
+
+	/* Tells this server instance apart in the cache. */
+	g_free (priv->server_info_hash);
+	priv->server_info_hash = _structure_hash (structure);
+
 	ok = TRUE;
 
 done:
@@ -1071,6 +1502,7 @@ _handle_database_info (DmapConnection * connection, guint status,
 	DmapStructureItem *item = NULL;
 	GNode *listing_node;
 	gint n_databases = 0;
+	gint64 persistent_id;
 
 	/* get a list of databases, there should be only 1 */
 
@@ -1104,6 +1536,15 @@ _handle_database_info (DmapConnection * connection, guint status,
 
 	priv->database_id = g_value_get_int (&(item->content));
 
+	item = dmap_structure_find_item (listing_node->children,
+					 DMAP_CC_MPER);
+	persistent_id = item ? g_value_get_int64 (&(item->content)) : 0;
+
+	item = dmap_structure_find_item (listing_node->children,
+					 DMAP_CC_MIMC);
+	_cache_open (connection, persistent_id,
+	             item ? g_value_get_int (&(item->content)) : 0);
+
 	ok = TRUE;
 
 done:
@@ -1111,6 +1552,49 @@ done:
 	return;
 }
 
+/* The media and playlist listings only depend on the database ID, so they
+ * are requested together; whichever handler finishes last moves the
+ * connection on. The media listing is handled in a thread, hence the
+ * atomics. */
+static void
+_listing_done (DmapConnection * connection, gboolean ok)
+{
+	DmapConnectionPrivate *priv = connection->priv;
+
+	if (!ok) {
+		g_atomic_int_set (&priv->listings_failed, TRUE);
+	}
+
+	if (g_atomic_int_dec_and_test (&priv->listings_pending)) {
+		_state_done (connection,
+		             !g_atomic_int_get (&priv->listings_failed));
+	}
+}
+
+/* Adds and then releases the records in batch. Only the first record that
+ * could not be added is reported, so a failed batch emits one ERROR. */
+static void
+_add_batch (DmapConnection * connection, GPtrArray * batch)
+{
+	GError *error = NULL;
+
+	if (0 == batch->len) {
+		goto done;
+	}
+
+	dmap_db_add_batch (connection->priv->db,
+	                   (DmapRecord **) batch->pdata, batch->len, &error);
+	if (NULL != error) {
+		g_signal_emit (connection, _signals[ERROR], 0, error);
+		g_error_free (error);
+	}
+
+	g_ptr_array_set_size (batch, 0);
+
+done:
+	return;
+}
+
 static void
 _handle_song_listing (DmapConnection * connection, guint status,
                       GNode * structure, G_GNUC_UNUSED gpointer user_data)
@@ -1123,6 +1607,7 @@ _handle_song_listing (DmapConnection * connection, guint status,
 	gint i;
 	GNode *n;
 	gint commit_batch;
+	GPtrArray *batch = NULL;
 
 	/* get the songs */
 
@@ -1172,6 +1657,8 @@ _handle_song_listing (DmapConnection * connection, guint status,
 	priv->emit_progress_id =
 		g_idle_add ((GSourceFunc) _emit_progress_idle, connection);
 
+	batch = g_ptr_array_new_with_free_func (g_object_unref);
+
 	for (i = 0, n = listing_node->children; n; i++, n = n->next) {
 		gint item_id = 0;
 		DmapRecord *record =
@@ -1180,7 +1667,6 @@ _handle_song_listing (DmapConnection * connection, guint status,
 			 &item_id);
 
 		if (record) {
-			GError *error = NULL;
 			gchar *uri = NULL;
 			gchar *format = NULL;
 
@@ -1207,22 +1693,19 @@ _handle_song_listing (DmapConnection * connection, guint status,
 			/*} */
 
 			g_object_set (record, "location", uri, NULL);
-			dmap_db_add (connection->priv->db, record, &error);
-			if (NULL != error) {
-				g_signal_emit (connection, _signals[ERROR], 0, error);
-			}
-			g_object_unref (record);
+			g_ptr_array_add (batch, record);
+			/* item_id_to_uri takes uri */
 			g_hash_table_insert (connection->priv->item_id_to_uri,
-					     GINT_TO_POINTER (item_id),
-					     g_strdup (uri));
-			g_free (uri);
+					     GINT_TO_POINTER (item_id), uri);
 			g_free (format);
 		} else {
 			g_debug ("cannot create record for daap track");
 		}
 
-		if (i % commit_batch == 0) {
-			priv->progress = ((float) i / (float) returned_count);
+		if (batch->len >= (guint) commit_batch || NULL == n->next) {
+			_add_batch (connection, batch);
+
+			priv->progress = ((float) (i + 1) / (float) returned_count);
 			if (priv->emit_progress_id != 0) {
 				g_source_remove (connection->
 						 priv->emit_progress_id);
@@ -1236,7 +1719,11 @@ _handle_song_listing (DmapConnection * connection, guint status,
 	ok = TRUE;
 
 done:
-	_state_done (connection, ok);
+	if (batch) {
+		g_ptr_array_unref (batch);
+	}
+
+	_listing_done (connection, ok);
 	return;
 }
 
@@ -1318,17 +1805,16 @@ _handle_playlists (DmapConnection * connection, guint status,
 	ok = TRUE;
 
 done:
-	_state_done (connection, ok);
+	_listing_done (connection, ok);
 	return;
 }
 
-static void
-_handle_playlist_entries (DmapConnection * connection, guint status,
-                          GNode * structure, G_GNUC_UNUSED gpointer user_data)
+static gboolean
+_read_playlist_entries (DmapConnection * connection, DmapPlaylist * playlist,
+                        guint status, GNode * structure)
 {
 	gboolean ok = FALSE;
 	DmapConnectionPrivate *priv = connection->priv;
-	DmapPlaylist *playlist;
 	GNode *listing_node;
 	GNode *node;
 	gint i;
@@ -1338,11 +1824,6 @@ _handle_playlist_entries (DmapConnection * connection, guint status,
 		goto done;
 	}
 
-	playlist =
-		(DmapPlaylist *) g_slist_nth_data (priv->playlists,
-						   priv->reading_playlist);
-	g_assert (playlist);
-
 	listing_node = dmap_structure_find_node (structure, DMAP_CC_MLCL);
 	if (listing_node == NULL) {
 		g_debug ("Could not find dmap.listing item in /databases/%d/containers/%d/items", priv->database_id, playlist->id);
@@ -1382,8 +1863,62 @@ _handle_playlist_entries (DmapConnection * connection, guint status,
 	ok = TRUE;
 
 done:
-	_state_done (connection, ok);
-	return;
+	return ok;
+}
+
+static void _request_playlist_entries (DmapConnection * connection);
+
+typedef struct {
+	DmapConnection *connection;
+	gboolean ok;
+} _PlaylistEntriesRead;
+
+/* Runs in the main loop once a playlist's entries have been read. */
+static gboolean
+_playlist_entries_read (_PlaylistEntriesRead * read)
+{
+	DmapConnection *connection = read->connection;
+	DmapConnectionPrivate *priv = connection->priv;
+
+	g_assert (priv->playlists_pending > 0);
+	priv->playlists_pending--;
+
+	if (!read->ok) {
+		priv->playlists_failed = TRUE;
+	}
+
+	priv->playlists_read++;
+	priv->progress = (float) priv->playlists_read
+	               / g_slist_length (priv->playlists);
+	if (priv->emit_progress_id != 0) {
+		g_source_remove (priv->emit_progress_id);
+	}
+	priv->emit_progress_id =
+		g_idle_add ((GSourceFunc) _emit_progress_idle, connection);
+
+	_request_playlist_entries (connection);
+
+	g_object_unref (connection);
+	g_free (read);
+
+	return FALSE;
+}
+
+/* Runs in the response pool, as a large playlist would otherwise block
+ * the main loop. Only the playlist itself is written here; the requests
+ * in flight are counted in the main loop. */
+static void
+_handle_playlist_entries (DmapConnection * connection, guint status,
+                          GNode * structure, gpointer user_data)
+{
+	_PlaylistEntriesRead *read;
+
+	read = g_new0 (_PlaylistEntriesRead, 1);
+	read->connection = g_object_ref (connection);
+	read->ok = _read_playlist_entries (connection, user_data, status,
+	                                   structure);
+
+	g_idle_add ((GSourceFunc) _playlist_entries_read, read);
 }
 
 static void
@@ -1396,6 +1931,50 @@ _handle_logout (DmapConnection * connection, G_GNUC_UNUSED guint status,
 	_state_done (connection, TRUE);
 }
 
+/* Keeps up to max_concurrent_requests entry listings in flight. Each
+ * response fills in its own playlist, so the playlists keep their order
+ * however the responses arrive. Listings are parsed in the response pool
+ * but counted in the main loop, which keeps this bookkeeping
+ * single-threaded. */
+static void
+_request_playlist_entries (DmapConnection * connection)
+{
+	DmapConnectionPrivate *priv = connection->priv;
+
+	while (!priv->playlists_failed
+	    && priv->next_playlist != NULL
+	    && priv->playlists_pending < priv->max_concurrent_requests) {
+		DmapPlaylist *playlist = priv->next_playlist->data;
+		char *path;
+		char *cache_name;
+
+		priv->next_playlist = priv->next_playlist->next;
+
+		path = g_strdup_printf
+			("/databases/%d/containers/%d/items?session-id=%u&revision-number=%d&meta=dmap.itemid",
+			 priv->database_id, playlist->id,
+			 priv->session_id, priv->revision_number);
+		cache_name = g_strdup_printf ("containers-%d", playlist->id);
+		if (_cached_get (connection, path, cache_name,
+		                 (DmapResponseHandler) _handle_playlist_entries,
+		                 playlist, TRUE)) {
+			priv->playlists_pending++;
+		} else {
+			g_debug ("Could not get entries for DMAP playlist %d",
+			         playlist->id);
+			priv->playlists_failed = TRUE;
+		}
+		g_free (path);
+		g_free (cache_name);
+	}
+
+	/* Wait for outstanding responses, even after a failure, so that none
+	 * arrives once the connection has moved on. */
+	if (priv->playlists_pending == 0) {
+		_state_done (connection, !priv->playlists_failed);
+	}
+}
+
 static void
 _finish (DmapConnection * connection)
 {
@@ -1474,6 +2053,10 @@ _do_something (DmapConnection * connection)
 		break;
 
 	case DMAP_GET_MEDIA:
+	case DMAP_GET_PLAYLISTS:
+		priv->listings_pending = 2;
+		priv->listings_failed = FALSE;
+
 		g_debug ("Getting DMAP song listing");
 		meta = DMAP_CONNECTION_GET_CLASS
 			(connection)->get_query_metadata (connection);
@@ -1481,55 +2064,33 @@ _do_something (DmapConnection * connection)
 			("/databases/%i/items?session-id=%u&revision-number=%i"
 			 "&meta=%s", priv->database_id, priv->session_id,
 			 priv->revision_number, meta);
-		if (!_http_get
-		    (connection, path,
+		if (!_cached_get
+		    (connection, path, "items",
 		     (DmapResponseHandler) _handle_song_listing, NULL, TRUE)) {
 			g_debug ("Could not get DMAP song listing");
-			_state_done (connection, FALSE);
+			_listing_done (connection, FALSE);
 		}
 		g_free (path);
 		g_free (meta);
-		break;
 
-	case DMAP_GET_PLAYLISTS:
+		/* The playlist listing is small; handle it in the main loop. */
 		g_debug ("Getting DMAP playlists");
 		path = g_strdup_printf
 			("/databases/%d/containers?session-id=%u&revision-number=%d",
 			 priv->database_id, priv->session_id,
 			 priv->revision_number);
-		if (!_http_get
-		    (connection, path,
-		     (DmapResponseHandler) _handle_playlists, NULL, TRUE)) {
+		if (!_cached_get
+		    (connection, path, "containers",
+		     (DmapResponseHandler) _handle_playlists, NULL, FALSE)) {
 			g_debug ("Could not get DMAP playlists");
-			_state_done (connection, FALSE);
+			_listing_done (connection, FALSE);
 		}
 		g_free (path);
 		break;
 
 	case DMAP_GET_PLAYLIST_ENTRIES:
-		{
-			DmapPlaylist *playlist =
-				(DmapPlaylist *)
-				g_slist_nth_data (priv->playlists,
-						  priv->reading_playlist);
-
-			g_assert (playlist);
-			g_debug ("Reading DMAP playlist %d entries",
-				 priv->reading_playlist);
-			path = g_strdup_printf
-				("/databases/%d/containers/%d/items?session-id=%u&revision-number=%d&meta=dmap.itemid",
-				 priv->database_id, playlist->id,
-				 priv->session_id, priv->revision_number);
-			if (!_http_get
-			    (connection, path,
-			     (DmapResponseHandler) _handle_playlist_entries,
-			     NULL, TRUE)) {
-				g_debug ("Could not get entries for DMAP playlist %d", priv->reading_playlist);
-				_state_done (connection,
-							    FALSE);
-			}
-			g_free (path);
-		}
+		g_debug ("Reading DMAP playlist entries");
+		_request_playlist_entries (connection);
 		break;
 
 	case DMAP_LOGOUT:
@@ -1651,7 +2212,10 @@ dmap_connection_authenticate_message (DmapConnection * connection, SoupSession *
 void
 dmap_connection_setup (DmapConnection * connection)
 {
-	connection->priv->session = soup_session_new ();
+	connection->priv->session = soup_session_new_with_options (
+		SOUP_SESSION_MAX_CONNS_PER_HOST,
+		connection->priv->max_concurrent_requests,
+		NULL);
 
 	g_signal_connect (connection->priv->session, "authenticate", G_CALLBACK(_authenticate_cb), connection);
 
@@ -1902,6 +2466,450 @@ _ACTUAL_HTTP_RESPONSE_HANDLER_TEST("minm\x00\x00\x00\x99Hello, world!",
                                     DMAP_STATUS_INVALID_CONTENT_CODE_SIZE);
 END_TEST
 
+START_TEST(_cache_test)
+{
+	gchar *dir;
+	gchar *items;
+	DmapConnection *connection;
+
+	dir = g_dir_make_tmp ("libdmapsharing-test-XXXXXX", NULL);
+	ck_assert (NULL != dir);
+
+	connection = g_object_new (DMAP_TYPE_AV_CONNECTION,
+	                           "name", "test",
+	                           "cache-dir", dir,
+	                           NULL);
+	connection->priv->revision_number = 2;
+
+	_cache_open (connection, 1, 1);
+	ck_assert (NULL != connection->priv->cache_path);
+	ck_assert (!connection->priv->cache_valid);
+
+	_cache_store (connection, "items", (const guint8 *) "x", 1);
+	_cache_commit (connection);
+
+	_cache_open (connection, 1, 1);
+	ck_assert (connection->priv->cache_valid);
+
+	/* A cache of another revision is emptied. */
+	connection->priv->revision_number = 3;
+	_cache_open (connection, 1, 1);
+	ck_assert (!connection->priv->cache_valid);
+
+	items = g_build_filename (connection->priv->cache_path, "items", NULL);
+	ck_assert (!g_file_test (items, G_FILE_TEST_EXISTS));
+
+	g_rmdir (connection->priv->cache_path);
+	g_rmdir (dir);
+
+	g_free (items);
+	g_free (dir);
+	g_object_unref (connection);
+}
+END_TEST
+
+static void
+_cache_structure_test (DmapConnection * connection, const gchar * name,
+                       GNode * structure)
+{
+	gchar *data;
+	guint length;
+
+	data = dmap_structure_serialize (structure, &length);
+	_cache_store (connection, name, (const guint8 *) data, length);
+
+	g_free (data);
+	dmap_structure_destroy (structure);
+}
+
+/* Returns a connection with n playlists whose entry listings are in a
+ * current cache, so they are read without a server. Playlist i holds item
+ * i, except failed, whose listing is malformed. */
+static DmapConnection *
+_playlists_connection_test (const gchar * dir, gint n, gint failed)
+{
+	gint i;
+	DmapConnection *connection;
+	DmapConnectionPrivate *priv;
+
+	connection = g_object_new (DMAP_TYPE_AV_CONNECTION,
+	                           "name", "test",
+	                           "cache-dir", dir,
+	                           NULL);
+	priv = connection->priv;
+	priv->revision_number = 1;
+
+	_cache_open (connection, 1, 1);
+	ck_assert (NULL != priv->cache_path);
+	priv->cache_valid = TRUE;
+
+	priv->item_id_to_uri =
+		g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+				       (GDestroyNotify) g_free);
+
+	for (i = n; i > 0; i--) {
+		gchar *name;
+		GNode *root, *mlcl, *mlit;
+		DmapPlaylist *playlist;
+
+		playlist = g_new0 (DmapPlaylist, 1);
+		playlist->id = i;
+		playlist->name = g_strdup_printf ("playlist-%d", i);
+		priv->playlists = g_slist_prepend (priv->playlists, playlist);
+
+		g_hash_table_insert (priv->item_id_to_uri, GINT_TO_POINTER (i),
+		                     g_strdup_printf ("uri-%d", i));
+
+		root = dmap_structure_add (NULL, DMAP_CC_APSO);
+		dmap_structure_add (root, DMAP_CC_MSTT, (gint32) SOUP_STATUS_OK);
+		if (i != failed) {
+			mlcl = dmap_structure_add (root, DMAP_CC_MLCL);
+			mlit = dmap_structure_add (mlcl, DMAP_CC_MLIT);
+			dmap_structure_add (mlit, DMAP_CC_MIID, (gint32) i);
+		}
+
+		name = g_strdup_printf ("containers-%d", i);
+		_cache_structure_test (connection, name, root);
+		g_free (name);
+	}
+
+	priv->state = DMAP_GET_PLAYLIST_ENTRIES;
+	priv->next_playlist = priv->playlists;
+
+	return connection;
+}
+
+static void
+_playlists_connection_free_test (DmapConnection * connection, gchar * dir)
+{
+	_cache_clear (connection->priv->cache_path);
+	g_rmdir (connection->priv->cache_path);
+	g_rmdir (dir);
+
+	g_free (dir);
+	g_object_unref (connection);
+}
+
+START_TEST(_request_playlist_entries_limit_test)
+{
+	gchar *dir;
+	GSList *iter;
+	DmapConnection *connection;
+	DmapConnectionPrivate *priv;
+
+	dir = g_dir_make_tmp ("libdmapsharing-test-XXXXXX", NULL);
+	ck_assert (NULL != dir);
+
+	connection = _playlists_connection_test (dir, 20, 0);
+	priv = connection->priv;
+	priv->max_concurrent_requests = 3;
+
+	_request_playlist_entries (connection);
+	ck_assert_int_eq (3, priv->playlists_pending);
+
+	while (DMAP_GET_PLAYLIST_ENTRIES == priv->state) {
+		ck_assert (priv->playlists_pending <= 3);
+		g_main_context_iteration (NULL, TRUE);
+	}
+
+	ck_assert_int_eq (DMAP_DONE, priv->state);
+	ck_assert_int_eq (0, priv->playlists_pending);
+	ck_assert_int_eq (20, priv->playlists_read);
+	ck_assert (!priv->playlists_failed);
+
+	/* Each response filled in its own playlist. */
+	for (iter = priv->playlists; iter; iter = iter->next) {
+		DmapPlaylist *playlist = iter->data;
+		gchar *uri = g_strdup_printf ("uri-%d", playlist->id);
+
+		ck_assert_int_eq (1, g_list_length (playlist->uris));
+		ck_assert_str_eq (uri, playlist->uris->data);
+
+		g_free (uri);
+	}
+
+	_playlists_connection_free_test (connection, dir);
+}
+END_TEST
+
+START_TEST(_request_playlist_entries_failure_test)
+{
+	gchar *dir;
+	guint requested;
+	DmapConnection *connection;
+	DmapConnectionPrivate *priv;
+
+	dir = g_dir_make_tmp ("libdmapsharing-test-XXXXXX", NULL);
+	ck_assert (NULL != dir);
+
+	connection = _playlists_connection_test (dir, 20, 1);
+	priv = connection->priv;
+	priv->max_concurrent_requests = 3;
+	priv->result = TRUE;
+
+	_request_playlist_entries (connection);
+
+	/* The connection only moves on once every request has drained. */
+	while (DMAP_GET_PLAYLIST_ENTRIES == priv->state) {
+		g_main_context_iteration (NULL, TRUE);
+	}
+
+	ck_assert_int_eq (DMAP_DONE, priv->state);
+	ck_assert (!priv->result);
+	ck_assert (priv->playlists_failed);
+	ck_assert_int_eq (0, priv->playlists_pending);
+
+	requested = NULL == priv->next_playlist
+	          ? g_slist_length (priv->playlists)
+	          : (guint) g_slist_position (priv->playlists,
+	                                      priv->next_playlist);
+	ck_assert_int_eq (requested, priv->playlists_read);
+
+	_playlists_connection_free_test (connection, dir);
+}
+END_TEST
+
+static gpointer
+_listing_ok_thread_test (DmapConnection * connection)
+{
+	_listing_done (connection, TRUE);
+
+	return NULL;
+}
+
+static gpointer
+_listing_failed_thread_test (DmapConnection * connection)
+{
+	_listing_done (connection, FALSE);
+
+	return NULL;
+}
+
+/* Finishes the two listings at once in a thread and the main thread, as
+ * the media listing in the response pool and the playlists may do. */
+static DmapConnection *
+_listings_race_test (gboolean thread_ok)
+{
+	GThread *thread;
+	DmapPlaylist *playlist;
+	DmapConnection *connection;
+
+	connection = g_object_new (DMAP_TYPE_AV_CONNECTION, NULL);
+
+	playlist = g_new0 (DmapPlaylist, 1);
+	playlist->name = g_strdup ("playlist");
+	connection->priv->playlists = g_slist_prepend (NULL, playlist);
+
+	connection->priv->state = DMAP_GET_MEDIA;
+	connection->priv->listings_pending = 2;
+	connection->priv->listings_failed = FALSE;
+	connection->priv->result = TRUE;
+
+	thread = g_thread_new ("listing", thread_ok
+	                                ? (GThreadFunc) _listing_ok_thread_test
+	                                : (GThreadFunc) _listing_failed_thread_test,
+	                       connection);
+	_listing_done (connection, TRUE);
+	g_thread_join (thread);
+
+	ck_assert_int_eq (0, connection->priv->listings_pending);
+
+	return connection;
+}
+
+START_TEST(_listing_done_test)
+{
+	gint i;
+
+	for (i = 0; i < 100; i++) {
+		DmapConnection *connection;
+
+		/* Moving on twice would skip the playlist entries. */
+		connection = _listings_race_test (TRUE);
+		ck_assert_int_eq (DMAP_GET_PLAYLIST_ENTRIES,
+		                  connection->priv->state);
+		ck_assert (connection->priv->result);
+		g_object_unref (connection);
+
+		connection = _listings_race_test (FALSE);
+		ck_assert_int_eq (DMAP_DONE, connection->priv->state);
+		ck_assert (!connection->priv->result);
+		g_object_unref (connection);
+	}
+}
+END_TEST
+
+static gint _pushed_status = 0;
+static GThread *_pushed_thread = NULL;
+
+static void
+_pushed_handler_test (G_GNUC_UNUSED DmapConnection * connection,
+                      guint status, GNode * structure,
+                      G_GNUC_UNUSED gpointer user_data)
+{
+	_pushed_thread = g_thread_self ();
+	g_atomic_int_set (&_pushed_status,
+	                  SOUP_STATUS_IS_SUCCESSFUL (status) && NULL != structure
+	                  ? 1 : -1);
+}
+
+START_TEST(_push_response_test)
+{
+	GNode *root;
+	guint length;
+	DmapResponseData *data;
+	DmapConnection *connection;
+
+	connection = g_object_new (DMAP_TYPE_AV_CONNECTION, NULL);
+
+	root = dmap_structure_add (NULL, DMAP_CC_APSO);
+	dmap_structure_add (root, DMAP_CC_MSTT, (gint32) SOUP_STATUS_OK);
+
+	data = g_new0 (DmapResponseData, 1);
+	data->connection = g_object_ref (connection);
+	data->response_handler = _pushed_handler_test;
+	data->cache_name = g_strdup ("test");
+	data->cached = dmap_structure_serialize (root, &length);
+	data->cached_length = length;
+
+	dmap_structure_destroy (root);
+
+	ck_assert (_push_response (data));
+
+	while (0 == g_atomic_int_get (&_pushed_status)) {
+		g_usleep (1000);
+	}
+
+	ck_assert_int_eq (1, _pushed_status);
+	ck_assert (g_thread_self () != _pushed_thread);
+
+	g_object_unref (connection);
+}
+END_TEST
+
+static gchar *
+_cache_path_test (const gchar * dir, guint port, const gchar * server_info,
+                  gint item_count)
+{
+	gchar *path;
+	DmapConnection *connection;
+
+	connection = g_object_new (DMAP_TYPE_AV_CONNECTION,
+	                           "name", "test",
+	                           "host", "127.0.0.1",
+	                           "port", port,
+	                           "cache-dir", dir,
+	                           NULL);
+	connection->priv->server_info_hash = g_strdup (server_info);
+
+	_cache_open (connection, 1, item_count);
+	path = g_strdup (connection->priv->cache_path);
+	ck_assert (NULL != path);
+
+	g_object_unref (connection);
+
+	return path;
+}
+
+START_TEST(_cache_key_test)
+{
+	gchar *dir;
+	gchar *paths[4];
+	guint i, j;
+
+	dir = g_dir_make_tmp ("libdmapsharing-test-XXXXXX", NULL);
+	ck_assert (NULL != dir);
+
+	/* Same name, persistent ID and revision; different servers. */
+	paths[0] = _cache_path_test (dir, 3689, "a", 10);
+	paths[1] = _cache_path_test (dir, 3690, "a", 10);
+	paths[2] = _cache_path_test (dir, 3689, "b", 10);
+	paths[3] = _cache_path_test (dir, 3689, "a", 11);
+
+	for (i = 0; i < G_N_ELEMENTS (paths); i++) {
+		for (j = i + 1; j < G_N_ELEMENTS (paths); j++) {
+			ck_assert_str_ne (paths[i], paths[j]);
+		}
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (paths); i++) {
+		g_rmdir (paths[i]);
+		g_free (paths[i]);
+	}
+
+	/* The same server finds its own directory again. */
+	paths[0] = _cache_path_test (dir, 3689, "a", 10);
+	paths[1] = _cache_path_test (dir, 3689, "a", 10);
+	ck_assert_str_eq (paths[0], paths[1]);
+	g_rmdir (paths[0]);
+	g_free (paths[0]);
+	g_free (paths[1]);
+
+	g_rmdir (dir);
+	g_free (dir);
+}
+END_TEST
+
+static guint _refetch_status = SOUP_STATUS_NONE;
+
+static void
+_refetch_handler_test (G_GNUC_UNUSED DmapConnection * connection,
+                       guint status, G_GNUC_UNUSED GNode * structure,
+                       G_GNUC_UNUSED gpointer user_data)
+{
+	_refetch_status = status;
+}
+
+START_TEST(_cached_refetch_test)
+{
+	gchar *dir;
+	gchar *revision;
+	DmapConnection *connection;
+
+	dir = g_dir_make_tmp ("libdmapsharing-test-XXXXXX", NULL);
+	ck_assert (NULL != dir);
+
+	/* Nothing listens on port 1, so a fetch fails at once. */
+	connection = g_object_new (DMAP_TYPE_AV_CONNECTION,
+	                           "name", "test",
+	                           "host", "127.0.0.1",
+	                           "port", 1,
+	                           "cache-dir", dir,
+	                           NULL);
+	dmap_connection_setup (connection);
+	connection->priv->revision_number = 1;
+
+	_cache_open (connection, 1, 1);
+	_cache_store (connection, "items", (const guint8 *) "xxxx", 4);
+	_cache_commit (connection);
+	ck_assert (connection->priv->cache_valid);
+
+	_refetch_status = SOUP_STATUS_NONE;
+	ck_assert (_cached_get (connection, "/databases/1/items", "items",
+	                        _refetch_handler_test, NULL, FALSE));
+
+	while (SOUP_STATUS_NONE == _refetch_status) {
+		g_main_context_iteration (NULL, TRUE);
+	}
+
+	/* The server was asked, rather than the cached copy reported. */
+	ck_assert (SOUP_STATUS_IS_TRANSPORT_ERROR (_refetch_status));
+	ck_assert (!connection->priv->cache_valid);
+
+	revision = g_build_filename (connection->priv->cache_path,
+	                             CACHE_REVISION_FILE, NULL);
+	ck_assert (!g_file_test (revision, G_FILE_TEST_EXISTS));
+
+	_cache_clear (connection->priv->cache_path);
+	g_rmdir (connection->priv->cache_path);
+	g_rmdir (dir);
+
+	g_free (revision);
+	g_free (dir);
+	g_object_unref (connection);
+}
+END_TEST
+
 #include "dmap-connection-suite.c"
 
 #endif
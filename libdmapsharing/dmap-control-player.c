@@ -120,3 +120,37 @@ dmap_control_player_cue_play (DmapControlPlayer * player, GList * records, guint
 {
 	DMAP_CONTROL_PLAYER_GET_INTERFACE (player)->cue_play (player, records, index);
 }
+
+void
+dmap_control_player_cue_play_ids (DmapControlPlayer * player,
+                                  DmapDb * db,
+                                  const guint * ids,
+                                  guint n_ids,
+                                  guint index)
+{
+	guint i;
+	GList *records = NULL;
+	DmapRecord *record;
+	DmapControlPlayerInterface *iface =
+		DMAP_CONTROL_PLAYER_GET_INTERFACE (player);
+
+	if (NULL != iface->cue_play_ids) {
+		iface->cue_play_ids (player, db, ids, n_ids, index);
+		goto done;
+	}
+
+	/* Players without cue_play_ids take every record up front. */
+	for (i = n_ids; i > 0; i--) {
+		record = dmap_db_lookup_by_id (db, ids[i - 1]);
+		if (NULL != record) {
+			records = g_list_prepend (records, record);
+		}
+	}
+
+	iface->cue_play (player, records, index);
+
+	g_list_free_full (records, g_object_unref);
+
+done:
+	return;
+}
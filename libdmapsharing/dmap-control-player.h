@@ -21,6 +21,7 @@
 #include <glib-object.h>
 
 #include "dmap-av-record.h"
+#include "dmap-db.h"
 
 G_BEGIN_DECLS
 /**
@@ -84,6 +85,8 @@ struct _DmapControlPlayerInterface
 
 	void (*cue_clear) (DmapControlPlayer * player);
 	void (*cue_play) (DmapControlPlayer * player, GList * records, guint index);
+	void (*cue_play_ids) (DmapControlPlayer * player, DmapDb * db,
+	                      const guint * ids, guint n_ids, guint index);
 };
 
 GType dmap_control_player_get_type (void);
@@ -143,5 +146,25 @@ void dmap_control_player_cue_clear (DmapControlPlayer * player);
  */
 void dmap_control_player_cue_play (DmapControlPlayer * player, GList * records, guint index);
 
+/**
+ * dmap_control_player_cue_play_ids:
+ * @player: a player
+ * @db: the database @ids refer to
+ * @ids: (array length=n_ids): record identifiers, in play order
+ * @n_ids: the number of identifiers in @ids
+ * @index: an index into @ids
+ *
+ * Like dmap_control_player_cue_play(), but the player looks records up in
+ * @db only as it needs them, so a large queue starts without first
+ * resolving every record. @ids is only valid during the call. If the player
+ * does not implement cue_play_ids, the records are resolved here and passed
+ * to cue_play.
+ */
+void dmap_control_player_cue_play_ids (DmapControlPlayer * player,
+                                       DmapDb * db,
+                                       const guint * ids,
+                                       guint n_ids,
+                                       guint index);
+
 G_END_DECLS
 #endif /* _DMAP_CONTROL_PLAYER_H_ */
@@ -26,10 +26,7 @@
 
 #include <glib.h>
 #include <glib-object.h>
-
-#ifdef HAVE_GDKPIXBUF
-#include <gdk-pixbuf/gdk-pixbuf.h>
-#endif /* HAVE_GDKPIXBUF */
+#include <glib/gstdio.h>
 
 #include <libsoup/soup.h>
 #include <libsoup/soup-address.h>
@@ -46,6 +43,8 @@
 #include <libdmapsharing/dmap-control-share.h>
 #include <libdmapsharing/dmap-control-connection.h>
 #include <libdmapsharing/dmap-control-player.h>
+#include <libdmapsharing/dmap-artwork-cache.h>
+#include <libdmapsharing/dmap-private-utils.h>
 
 void dmap_control_share_ctrl_int (DmapShare * share,
 			  SoupServer * server,
@@ -60,6 +59,8 @@ void dmap_control_share_login (DmapShare * share,
 #define DACP_TYPE_OF_SERVICE "_touch-able._tcp"
 #define DACP_PORT 3689
 
+#define ARTWORK_CACHE_SIZE (4 * 1024 * 1024)	/* Bytes of encoded artwork */
+
 struct DmapControlSharePrivate
 {
 	DmapMdnsBrowser *mdns_browser;
@@ -69,9 +70,18 @@ struct DmapControlSharePrivate
 
 	gint current_revision;
 
-	GSList *update_queue;
+	/* Parked /1/playstatusupdate requests, as a set of SoupMessage. */
+	GHashTable *update_queue;
+
+	/* Serialized CMST, shared by every message it answers. */
+	SoupBuffer *playstatus;
+	gint playstatus_revision;
 
 	DmapControlPlayer *player;
+
+	DmapAvShare *av_share;	/* Told what is cued, if set */
+
+	DmapArtworkCache *artwork_cache;
 };
 
 /*
@@ -87,7 +97,8 @@ typedef struct {
 enum {
 	PROP_0,
 	PROP_LIBRARY_NAME,
-	PROP_PLAYER
+	PROP_PLAYER,
+	PROP_AV_SHARE
 };
 
 enum {
@@ -174,6 +185,10 @@ _set_property (GObject * object,
 		}
 		share->priv->player = DMAP_CONTROL_PLAYER (g_value_dup_object (value));
 		break;
+	case PROP_AV_SHARE:
+		g_clear_object (&share->priv->av_share);
+		share->priv->av_share = g_value_dup_object (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -193,6 +208,9 @@ _get_property (GObject * object,
 	case PROP_PLAYER:
 		g_value_set_object (value, G_OBJECT (share->priv->player));
 		break;
+	case PROP_AV_SHARE:
+		g_value_set_object (value, share->priv->av_share);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -206,12 +224,20 @@ _dispose (GObject * object)
 
 	g_clear_object(&share->priv->mdns_browser);
 	g_clear_object(&share->priv->player);
+	g_clear_object(&share->priv->av_share);
 
 	if (NULL != share->priv->update_queue) {
-		g_slist_free_full (share->priv->update_queue, g_object_unref);
+		g_hash_table_foreach (share->priv->update_queue,
+		                      (GHFunc) g_object_unref, NULL);
+		g_hash_table_destroy (share->priv->update_queue);
 		share->priv->update_queue = NULL;
 	}
 
+	if (NULL != share->priv->playstatus) {
+		soup_buffer_free (share->priv->playstatus);
+		share->priv->playstatus = NULL;
+	}
+
 	if (NULL != share->priv->remotes) {
 		g_hash_table_destroy (share->priv->remotes);
 		share->priv->remotes = NULL;
@@ -227,6 +253,8 @@ _finalize (GObject * object)
 
 	g_free (share->priv->library_name);
 
+	dmap_artwork_cache_free (share->priv->artwork_cache);
+
 	G_OBJECT_CLASS (dmap_control_share_parent_class)->finalize (object);
 }
 
@@ -269,6 +297,14 @@ dmap_control_share_class_init (DmapControlShareClass * klass)
 							      |
 							      G_PARAM_CONSTRUCT_ONLY));
 
+	g_object_class_install_property (object_class,
+					 PROP_AV_SHARE,
+					 g_param_spec_object ("av-share",
+							      "AV share",
+							      "DAAP share to which cued tracks are passed as a prefetch hint",
+							      DMAP_TYPE_AV_SHARE,
+							      G_PARAM_READWRITE));
+
 	/**
 	 * DmapControlShare::remote-found
 	 * @share: the #DmapControlShare that received the signal.
@@ -372,6 +408,11 @@ dmap_control_share_init (DmapControlShare * share)
 
 	share->priv->current_revision = 2;
 
+	share->priv->update_queue = g_hash_table_new (g_direct_hash,
+	                                              g_direct_equal);
+
+	share->priv->artwork_cache = dmap_artwork_cache_new (ARTWORK_CACHE_SIZE);
+
 	share->priv->remotes = g_hash_table_new_full ((GHashFunc) g_str_hash,
 						      (GEqualFunc)
 						      g_str_equal,
@@ -498,15 +539,17 @@ done:
 	return ok;
 }
 
-static void
-_fill_playstatusupdate (DmapControlShare * share, SoupMessage * message)
+static SoupBuffer *
+_build_playstatusupdate (DmapControlShare * share)
 {
+	gchar *resp;
+	guint length;
 	GNode *cmst;
 	DmapAvRecord *record;
 	DmapControlPlayState play_state;
 	DmapControlRepeatState repeat_state;
 	gboolean shuffle_state;
-	guint playing_time;
+	gulong playing_time;
 
 	g_object_get (share->priv->player,
 		      "play-state", &play_state,
@@ -552,10 +595,10 @@ _fill_playstatusupdate (DmapControlShare * share, SoupMessage * message)
 		dmap_structure_add (cmst, DMAP_CC_CANG, "");
 		dmap_structure_add (cmst, DMAP_CC_ASAI, 0);
 		//dmap_structure_add (cmst, DMAP_CC_AEMK, 1);
-		g_debug ("Playing time: %u, Track time: %u", playing_time,
+		g_debug ("Playing time: %lu, Track time: %u", playing_time,
 			 track_time);
 		dmap_structure_add (cmst, DMAP_CC_CANT,
-				    track_time - playing_time);
+				    (guint) (track_time - playing_time));
 		dmap_structure_add (cmst, DMAP_CC_CAST, track_time);
 
 		g_free (title);
@@ -565,30 +608,57 @@ _fill_playstatusupdate (DmapControlShare * share, SoupMessage * message)
 		g_object_unref (record);
 	}
 
-	dmap_share_message_set_from_dmap_structure (DMAP_SHARE (share),
-						     message, cmst);
+	resp = dmap_structure_serialize (cmst, &length);
 	dmap_structure_destroy (cmst);
+
+	return soup_buffer_new (SOUP_MEMORY_TAKE, resp, length);
+}
+
+/* Returns the serialized status for the current revision, built at most
+ * once per revision unless fresh is set. Owned by share. */
+static SoupBuffer *
+_get_playstatusupdate (DmapControlShare * share, gboolean fresh)
+{
+	if (fresh
+	 || NULL == share->priv->playstatus
+	 || share->priv->playstatus_revision != share->priv->current_revision) {
+		if (NULL != share->priv->playstatus) {
+			soup_buffer_free (share->priv->playstatus);
+		}
+
+		share->priv->playstatus = _build_playstatusupdate (share);
+		share->priv->playstatus_revision = share->priv->current_revision;
+	}
+
+	return share->priv->playstatus;
+}
+
+static void
+_fill_playstatusupdate (DmapControlShare * share,
+                        SoupMessage * message,
+                        gboolean fresh)
+{
+	dmap_share_message_set_from_buffer (DMAP_SHARE (share), message,
+	                                    _get_playstatusupdate (share, fresh));
 }
 
 static void
 _send_playstatusupdate (DmapControlShare * share)
 {
-	GSList *list;
+	GHashTableIter iter;
+	gpointer message;
 	SoupServer *server = NULL;
 
 	g_object_get (share, "server", &server, NULL);
 	if (server) {
-		for (list = share->priv->update_queue; list;
-		     list = list->next) {
-			_fill_playstatusupdate (share,
-			                       (SoupMessage*) list->data);
-			soup_server_unpause_message (server,
-			                             (SoupMessage*) list->data);
+		g_hash_table_iter_init (&iter, share->priv->update_queue);
+		while (g_hash_table_iter_next (&iter, &message, NULL)) {
+			_fill_playstatusupdate (share, message, FALSE);
+			soup_server_unpause_message (server, message);
 		}
 		g_object_unref (server);
 	}
-	g_slist_free (share->priv->update_queue);
-	share->priv->update_queue = NULL;
+	g_hash_table_remove_all (share->priv->update_queue);
 }
 
 void
@@ -601,11 +671,192 @@ dmap_control_share_player_updated (DmapControlShare * share)
 static void
 _status_update_message_finished (SoupMessage * message, DmapControlShare * share)
 {
-	share->priv->update_queue =
-		g_slist_remove (share->priv->update_queue, message);
+	if (NULL != share->priv->update_queue) {
+		g_hash_table_remove (share->priv->update_queue, message);
+	}
 	g_object_unref (message);
 }
 
+static void
+_set_artwork_response (SoupMessage * message, GBytes * bytes)
+{
+	SoupBuffer *buffer;
+
+	/* The cache entry backs the response; no copy. */
+	buffer = soup_buffer_new_with_owner (g_bytes_get_data (bytes, NULL),
+	                                     g_bytes_get_size (bytes),
+	                                     g_bytes_ref (bytes),
+	                                     (GDestroyNotify) g_bytes_unref);
+
+	soup_message_headers_set_content_type (message->response_headers,
+	                                       "image/png", NULL);
+	soup_message_body_append_buffer (message->response_body, buffer);
+	soup_buffer_free (buffer);
+
+	soup_message_set_status (message, SOUP_STATUS_OK);
+}
+
+typedef struct {
+	SoupServer *server;
+	SoupMessage *message;
+} ArtworkRequest;
+
+static void
+_artwork_rendered (G_GNUC_UNUSED GObject * source_object,
+                   GAsyncResult * result,
+                   gpointer user_data)
+{
+	GBytes *bytes;
+	GError *error = NULL;
+	ArtworkRequest *request = user_data;
+
+	bytes = dmap_artwork_cache_render_finish (NULL, result, &error);
+	if (NULL == bytes) {
+		g_debug ("Error rendering artwork: %s", error->message);
+		soup_message_set_status (request->message,
+		                         SOUP_STATUS_INTERNAL_SERVER_ERROR);
+		g_error_free (error);
+	} else {
+		_set_artwork_response (request->message, bytes);
+		g_bytes_unref (bytes);
+	}
+
+	soup_server_unpause_message (request->server, request->message);
+
+	g_object_unref (request->message);
+	g_object_unref (request->server);
+	g_free (request);
+}
+
+static void
+_send_artwork (DmapControlShare * share,
+               SoupServer * server,
+               SoupMessage * message,
+               const gchar * filename,
+               guint width,
+               guint height)
+{
+	GBytes *bytes;
+	GStatBuf buf;
+	gchar *identity;
+	gboolean not_modified;
+	ArtworkRequest *request;
+
+	/* The URL stays the same as tracks change, so clients revalidate
+	 * each time; unchanged artwork costs a 304. */
+	if (0 == g_stat (filename, &buf)) {
+		identity = g_strdup_printf ("%s\n%ux%u", filename, width, height);
+		not_modified = dmap_private_utils_message_not_modified (message,
+		                                                        identity,
+		                                                        (guint64) buf.st_mtime,
+		                                                        0);
+		g_free (identity);
+
+		if (not_modified) {
+			goto done;
+		}
+	}
+
+	bytes = dmap_artwork_cache_lookup (share->priv->artwork_cache,
+	                                   filename, width, height);
+	if (NULL != bytes) {
+		_set_artwork_response (message, bytes);
+		g_bytes_unref (bytes);
+		goto done;
+	}
+
+	/* Decode and scale off the main loop. */
+	request = g_new0 (ArtworkRequest, 1);
+	request->server = g_object_ref (server);
+	request->message = g_object_ref (message);
+
+	soup_server_pause_message (server, message);
+	dmap_artwork_cache_render_async (share->priv->artwork_cache,
+	                                 filename, width, height,
+	                                 _artwork_rendered, request);
+
+done:
+	return;
+}
+
+static void
+_append_id (guint id,
+            G_GNUC_UNUSED DmapRecord * record,
+            GArray * ids)
+{
+	g_array_append_val (ids, id);
+}
+
+/* Returns the identifiers of the records matching filter_def, without
+ * holding on to the records themselves. */
+static GArray *
+_cue_ids (DmapDb * db, GSList * filter_def)
+{
+	GArray *ids;
+	GHashTable *records;
+	GHashTableIter iter;
+	gpointer id;
+
+	if (NULL == filter_def) {
+		ids = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+		                         dmap_db_count (db));
+		dmap_db_foreach (db, (DmapIdRecordFunc) _append_id, ids);
+		goto done;
+	}
+
+	records = dmap_db_apply_filter (db, filter_def);
+
+	ids = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+	                         g_hash_table_size (records));
+
+	g_hash_table_iter_init (&iter, records);
+	while (g_hash_table_iter_next (&iter, &id, NULL)) {
+		guint value = GPOINTER_TO_UINT (id);
+		g_array_append_val (ids, value);
+	}
+
+	g_hash_table_unref (records);
+
+done:
+	return ids;
+}
+
+static gint
+_cmp_ids_by_album (const guint * a, const guint * b, DmapDb * db)
+{
+	return dmap_av_record_cmp_by_album (GUINT_TO_POINTER (*a),
+	                                    GUINT_TO_POINTER (*b),
+	                                    db);
+}
+
+/* Tells the AV share about the tracks cued after the one now playing. */
+static void
+_prefetch_cued (DmapControlShare * share,
+                DmapDb * db,
+                const guint * ids,
+                guint n_ids,
+                guint start)
+{
+	guint i, count = 0;
+	GList *records = NULL;
+	DmapRecord *record;
+
+	g_object_get (share->priv->av_share, "transcode-prefetch", &count, NULL);
+
+	for (i = start; i < n_ids && i < start + count; i++) {
+		record = dmap_db_lookup_by_id (db, ids[i]);
+		if (NULL != record) {
+			records = g_list_prepend (records, record);
+		}
+	}
+
+	records = g_list_reverse (records);
+
+	dmap_av_share_prefetch (share->priv->av_share, records);
+
+	g_list_free_full (records, g_object_unref);
+}
+
 static void
 _debug_param (gpointer key, gpointer val, G_GNUC_UNUSED gpointer user_data)
 {
@@ -805,16 +1056,17 @@ dmap_control_share_ctrl_int (DmapShare * share,
 
 		if (revision_number >= dmap_control_share->priv->current_revision) {
 			g_object_ref (message);
-			dmap_control_share->priv->update_queue =
-				g_slist_prepend (dmap_control_share->
-						 priv->update_queue, message);
+			g_hash_table_add (dmap_control_share->priv->update_queue,
+			                  message);
 			g_signal_connect_object (message, "finished",
 						 G_CALLBACK
 						 (_status_update_message_finished),
 						 dmap_control_share, 0);
 			soup_server_pause_message (server, message);
 		} else {
-			_fill_playstatusupdate (dmap_control_share, message);
+			/* Playing time moves on within a revision. */
+			_fill_playstatusupdate (dmap_control_share, message,
+			                        TRUE);
 		}
 	} else if (g_ascii_strcasecmp ("/1/playpause", rest_of_path) == 0) {
 		dmap_control_player_play_pause (dmap_control_share->priv->player);
@@ -833,8 +1085,6 @@ dmap_control_share_ctrl_int (DmapShare * share,
 		guint width = 320;
 		guint height = 320;
 		gchar *artwork_filename;
-		gchar *buffer;
-		gsize buffer_len;
 
 		if (g_hash_table_lookup (query, "mw")) {
 			width = atoi (g_hash_table_lookup (query, "mw"));
@@ -852,44 +1102,9 @@ dmap_control_share_ctrl_int (DmapShare * share,
 						 SOUP_STATUS_NOT_FOUND);
 			goto done;
 		}
-#ifdef HAVE_GDKPIXBUF
-		GdkPixbuf *artwork =
-			gdk_pixbuf_new_from_file_at_scale (artwork_filename,
-							   width, height,
-							   TRUE, NULL);
-
-		if (!artwork) {
-			g_debug ("Error loading image file");
-			g_free (artwork_filename);
-			soup_message_set_status (message,
-						 SOUP_STATUS_INTERNAL_SERVER_ERROR);
-			goto done;
-		}
-		if (!gdk_pixbuf_save_to_buffer
-		    (artwork, &buffer, &buffer_len, "png", NULL, NULL)) {
-			g_debug ("Error saving artwork to PNG");
-			g_object_unref (artwork);
-			g_free (artwork_filename);
-			soup_message_set_status (message,
-						 SOUP_STATUS_INTERNAL_SERVER_ERROR);
-			goto done;
-		}
-		g_object_unref (artwork);
-#else
-		if (!g_file_get_contents
-		    (artwork_filename, &buffer, &buffer_len, NULL)) {
-			g_debug ("Error getting artwork data");
-			g_free (artwork_filename);
-			soup_message_set_status (message,
-						 SOUP_STATUS_INTERNAL_SERVER_ERROR);
-			goto done;
-		}
-#endif
+		_send_artwork (dmap_control_share, server, message,
+		               artwork_filename, width, height);
 		g_free (artwork_filename);
-		soup_message_set_status (message, SOUP_STATUS_OK);
-		soup_message_set_response (message, "image/png",
-					   SOUP_MEMORY_TAKE, buffer,
-					   buffer_len);
 	} else if (g_ascii_strcasecmp ("/1/cue", rest_of_path) == 0) {
 		gchar *command;
 
@@ -908,8 +1123,7 @@ dmap_control_share_ctrl_int (DmapShare * share,
 			GNode *cacr;
 			gchar *record_query;
 			gchar *sort_by;
-			GHashTable *records;
-			GList *sorted_records;
+			GArray *ids;
 			GSList *filter_def;
 			DmapDb *db;
 			gint index =
@@ -918,25 +1132,31 @@ dmap_control_share_ctrl_int (DmapShare * share,
 			g_object_get (share, "db", &db, NULL);
 			record_query = g_hash_table_lookup (query, "query");
 			filter_def = dmap_share_build_filter (record_query);
-			records = dmap_db_apply_filter (db, filter_def);
-			sorted_records = g_hash_table_get_values (records);
+			ids = _cue_ids (db, filter_def);
 			sort_by = g_hash_table_lookup (query, "sort");
 			if (g_strcmp0 (sort_by, "album") == 0) {
-				sorted_records =
-					g_list_sort_with_data (sorted_records,
-							       (GCompareDataFunc)
-							       dmap_av_record_cmp_by_album,
-							       db);
+				g_array_sort_with_data (ids,
+				                        (GCompareDataFunc)
+				                        _cmp_ids_by_album,
+				                        db);
 			} else if (sort_by != NULL) {
 				g_warning ("Unknown sort column: %s",
 					   sort_by);
 			}
 
-			dmap_control_player_cue_play (dmap_control_share->priv->player,
-					      sorted_records, index);
+			dmap_control_player_cue_play_ids (dmap_control_share->priv->player,
+			                                  db,
+			                                  (guint *) ids->data,
+			                                  ids->len,
+			                                  index);
+
+			if (NULL != dmap_control_share->priv->av_share && index >= 0) {
+				_prefetch_cued (dmap_control_share, db,
+				                (guint *) ids->data, ids->len,
+				                index + 1);
+			}
 
-			g_list_free (sorted_records);
-			g_hash_table_unref (records);
+			g_array_free (ids, TRUE);
 			dmap_share_free_filter (filter_def);
 
 			cacr = dmap_structure_add (NULL, DMAP_CC_CACR);
@@ -1106,3 +1326,181 @@ done:
 	g_free (name);
 	g_free (path);
 }
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+#include <libdmapsharing/test-dmap-db.h>
+#include <libdmapsharing/test-dmap-container-db.h>
+#include <libdmapsharing/test-dmap-container-record.h>
+
+typedef struct
+{
+	GObject parent;
+	DmapControlPlayState play_state;
+} _TestPlayer;
+
+typedef struct
+{
+	GObjectClass parent;
+} _TestPlayerClass;
+
+enum {
+	PROP_TEST_0,
+	PROP_TEST_PLAYING_TIME,
+	PROP_TEST_SHUFFLE_STATE,
+	PROP_TEST_REPEAT_STATE,
+	PROP_TEST_PLAY_STATE,
+	PROP_TEST_VOLUME
+};
+
+static GType _test_player_get_type (void);
+static void _test_player_iface_init (DmapControlPlayerInterface * iface);
+
+G_DEFINE_TYPE_WITH_CODE (_TestPlayer, _test_player, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (DMAP_TYPE_CONTROL_PLAYER,
+                                                _test_player_iface_init));
+
+static void
+_test_player_set_property (GObject * object, guint prop_id,
+                           const GValue * value,
+                           G_GNUC_UNUSED GParamSpec * pspec)
+{
+	if (PROP_TEST_PLAY_STATE == prop_id) {
+		((_TestPlayer *) object)->play_state = g_value_get_enum (value);
+	}
+}
+
+static void
+_test_player_get_property (GObject * object, guint prop_id,
+                           GValue * value, GParamSpec * pspec)
+{
+	switch (prop_id) {
+	case PROP_TEST_PLAYING_TIME:
+	case PROP_TEST_VOLUME:
+		g_value_set_ulong (value, 0);
+		break;
+	case PROP_TEST_SHUFFLE_STATE:
+		g_value_set_boolean (value, FALSE);
+		break;
+	case PROP_TEST_REPEAT_STATE:
+		g_value_set_enum (value, DMAP_CONTROL_REPEAT_NONE);
+		break;
+	case PROP_TEST_PLAY_STATE:
+		g_value_set_enum (value, ((_TestPlayer *) object)->play_state);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static DmapAvRecord *
+_test_player_now_playing_record (G_GNUC_UNUSED DmapControlPlayer * player)
+{
+	return NULL;
+}
+
+static void
+_test_player_iface_init (DmapControlPlayerInterface * iface)
+{
+	iface->now_playing_record = _test_player_now_playing_record;
+}
+
+static void
+_test_player_class_init (_TestPlayerClass * klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+	object_class->set_property = _test_player_set_property;
+	object_class->get_property = _test_player_get_property;
+
+	g_object_class_override_property (object_class, PROP_TEST_PLAYING_TIME, "playing-time");
+	g_object_class_override_property (object_class, PROP_TEST_SHUFFLE_STATE, "shuffle-state");
+	g_object_class_override_property (object_class, PROP_TEST_REPEAT_STATE, "repeat-state");
+	g_object_class_override_property (object_class, PROP_TEST_PLAY_STATE, "play-state");
+	g_object_class_override_property (object_class, PROP_TEST_VOLUME, "volume");
+}
+
+static void
+_test_player_init (_TestPlayer * player)
+{
+	player->play_state = DMAP_CONTROL_PLAY_STOPPED;
+}
+
+static DmapControlShare *
+_build_share_test (DmapControlPlayer *player)
+{
+	DmapDb *db;
+	DmapContainerRecord *container_record;
+	DmapContainerDb *container_db;
+	DmapControlShare *share;
+
+	db = DMAP_DB (test_dmap_db_new ());
+	container_record = DMAP_CONTAINER_RECORD (test_dmap_container_record_new ());
+	container_db = DMAP_CONTAINER_DB (test_dmap_container_db_new (container_record));
+
+	share = dmap_control_share_new ("test", player, db, container_db);
+
+	g_object_unref (db);
+	g_object_unref (container_record);
+	g_object_unref (container_db);
+
+	return share;
+}
+
+static gboolean
+_buffer_equal (SoupBuffer *buffer, GBytes *bytes)
+{
+	return buffer->length == g_bytes_get_size (bytes)
+	    && 0 == memcmp (buffer->data, g_bytes_get_data (bytes, NULL),
+	                    buffer->length);
+}
+
+START_TEST(_playstatusupdate_cache_test)
+{
+	GBytes *before;
+	SoupBuffer *buffer, *fresh;
+	DmapControlPlayer *player;
+	DmapControlShare *share;
+
+	player = DMAP_CONTROL_PLAYER (g_object_new (_test_player_get_type (), NULL));
+	share = _build_share_test (player);
+
+	buffer = _get_playstatusupdate (share, FALSE);
+	before = g_bytes_new (buffer->data, buffer->length);
+
+	/* Within a revision, the status is not rebuilt, even if it would
+	 * differ; remotes are told of changes by the next revision. */
+	g_object_set (player, "play-state", DMAP_CONTROL_PLAY_PLAYING, NULL);
+	buffer = _get_playstatusupdate (share, FALSE);
+	ck_assert (_buffer_equal (buffer, before));
+	ck_assert_int_eq (share->priv->playstatus_revision,
+	                  share->priv->current_revision);
+
+	/* A new revision rebuilds it once. */
+	dmap_control_share_player_updated (share);
+	ck_assert_int_ne (share->priv->playstatus_revision,
+	                  share->priv->current_revision);
+
+	buffer = _get_playstatusupdate (share, FALSE);
+	ck_assert (!_buffer_equal (buffer, before));
+	ck_assert_int_eq (share->priv->playstatus_revision,
+	                  share->priv->current_revision);
+
+	fresh = _build_playstatusupdate (share);
+	ck_assert (buffer->length == fresh->length);
+	ck_assert (0 == memcmp (buffer->data, fresh->data, fresh->length));
+	soup_buffer_free (fresh);
+
+	ck_assert (buffer == _get_playstatusupdate (share, FALSE));
+
+	g_bytes_unref (before);
+	g_object_unref (share);
+	g_object_unref (player);
+}
+END_TEST
+
+#include "dmap-control-share-suite.c"
+
+#endif
@@ -18,6 +18,8 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include "config.h"
+
 #include <stdlib.h>
 #include <string.h>
 #include <libdmapsharing/dmap-db.h>
@@ -61,6 +63,37 @@ dmap_db_add (DmapDb *db, DmapRecord *record, GError **error)
 	return DMAP_DB_GET_INTERFACE (db)->add (db, record, error);
 }
 
+guint
+dmap_db_add_batch (DmapDb *db, DmapRecord **records, guint n_records,
+                   GError **error)
+{
+	guint i;
+	guint added = 0;
+	GError *record_error = NULL;
+	DmapDbInterface *iface = DMAP_DB_GET_INTERFACE (db);
+
+	if (NULL != iface->add_batch) {
+		added = iface->add_batch (db, records, n_records, error);
+		goto done;
+	}
+
+	for (i = 0; i < n_records; i++) {
+		if (DMAP_DB_ID_BAD != iface->add (db, records[i], &record_error)) {
+			added++;
+		}
+
+		if (NULL != record_error) {
+			g_propagate_error (error, record_error);
+			record_error = NULL;
+			/* Only the first error is reported. */
+			error = NULL;
+		}
+	}
+
+done:
+	return added;
+}
+
 guint
 dmap_db_add_with_id (DmapDb *db, DmapRecord *record, guint id, GError **error)
 {
@@ -259,3 +292,76 @@ dmap_db_apply_filter (DmapDb * db, GSList * filter_def)
 
 	return data.ht;
 }
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+#include <libdmapsharing/test-dmap-av-record.h>
+#include <libdmapsharing/test-dmap-db.h>
+
+START_TEST(_add_batch_fallback_test)
+{
+	guint i, added;
+	GError *error = NULL;
+	DmapRecord *records[4];
+	TestDmapDb *db;
+
+	db = test_dmap_db_new ();
+	test_dmap_db_set_capacity (db, 2);
+
+	for (i = 0; i < G_N_ELEMENTS (records); i++) {
+		records[i] = DMAP_RECORD (test_dmap_av_record_new ());
+	}
+
+	/* TestDmapDb has no add_batch, so each record goes to add. */
+	added = dmap_db_add_batch (DMAP_DB (db), records,
+	                           G_N_ELEMENTS (records), &error);
+	ck_assert_int_eq (2, added);
+	ck_assert_int_eq (2, dmap_db_count (DMAP_DB (db)));
+
+	/* Both rejections were seen; only the first is reported. */
+	ck_assert (g_error_matches (error, DMAP_ERROR, DMAP_STATUS_FAILED));
+	ck_assert_str_eq ("Database full; rejected record 1", error->message);
+	g_clear_error (&error);
+
+	/* The caller may not care which record failed. */
+	added = dmap_db_add_batch (DMAP_DB (db), records,
+	                           G_N_ELEMENTS (records), NULL);
+	ck_assert_int_eq (0, added);
+
+	for (i = 0; i < G_N_ELEMENTS (records); i++) {
+		g_object_unref (records[i]);
+	}
+	g_object_unref (db);
+}
+END_TEST
+
+START_TEST(_add_batch_all_added_test)
+{
+	guint i, added;
+	GError *error = NULL;
+	DmapRecord *records[3];
+	TestDmapDb *db;
+
+	db = test_dmap_db_new ();
+
+	for (i = 0; i < G_N_ELEMENTS (records); i++) {
+		records[i] = DMAP_RECORD (test_dmap_av_record_new ());
+	}
+
+	added = dmap_db_add_batch (DMAP_DB (db), records,
+	                           G_N_ELEMENTS (records), &error);
+	ck_assert_int_eq (3, added);
+	ck_assert_int_eq (3, dmap_db_count (DMAP_DB (db)));
+	ck_assert (NULL == error);
+
+	for (i = 0; i < G_N_ELEMENTS (records); i++) {
+		g_object_unref (records[i]);
+	}
+	g_object_unref (db);
+}
+END_TEST
+
+#include "dmap-db-suite.c"
+
+#endif
@@ -97,6 +97,8 @@ struct _DmapDbInterface
 				  const gchar * location);
 	void (*foreach) (const DmapDb * db, DmapIdRecordFunc func, gpointer data);
 	gint64 (*count) (const DmapDb * db);
+	guint (*add_batch) (DmapDb * db, DmapRecord ** records,
+	                    guint n_records, GError **error);
 };
 
 typedef struct DmapDbFilterDefinition
@@ -124,6 +126,30 @@ GType dmap_db_get_type (void);
  */
 guint dmap_db_add (DmapDb *db, DmapRecord *record, GError **error);
 
+/**
+ * dmap_db_add_batch:
+ * @db: A media database.
+ * @records: (array length=n_records): Database records.
+ * @n_records: The number of records in @records.
+ * @error: return location for a GError, or NULL.
+ *
+ * Add several records to the database at once, so that an implementation
+ * backed by a real database can insert them in one transaction. Records
+ * which cannot be added are skipped, and @error is set for the first of
+ * them. If the database does not implement add_batch, each record is
+ * passed to add in turn.
+ *
+ * #DmapConnection adds the records it reads in batches, so it emits one
+ * #DmapConnection::error signal for each batch that fails, rather than one
+ * for each record that could not be added.
+ *
+ * Returns: The number of records added.
+ *
+ * See also the notes for dmap_db_add regarding reference counting.
+ */
+guint dmap_db_add_batch (DmapDb *db, DmapRecord **records, guint n_records,
+                         GError **error);
+
 /**
  * dmap_db_add_with_id:
  * @db: A media database.
@@ -44,6 +44,8 @@
 #include <libdmapsharing/dmap-share-private.h>
 #include <libdmapsharing/dmap-private-utils.h>
 #include <libdmapsharing/dmap-structure.h>
+#include <libdmapsharing/dmap-mapped-file-cache.h>
+#include <libdmapsharing/dmap-artwork-cache.h>
 
 static guint _get_desired_port (DmapShare * share);
 static const char *_get_type_of_service (DmapShare * share);
@@ -52,12 +54,65 @@ static void _message_add_standard_headers (DmapShare * share, SoupMessage * mess
 
 #define DPAP_TYPE_OF_SERVICE "_dpap._tcp"
 #define DPAP_PORT 8770
+#define MAPPED_FILE_CACHE_SIZE (256 * 1024 * 1024)	/* Address space */
+#define THUMBNAIL_SIZE 240		/* Bounding box, in pixels */
+#define THUMBNAIL_CACHE_SIZE (16 * 1024 * 1024)
 
 struct DmapImageSharePrivate
 {
-	gchar unused;
+	/* Hi-res images, mapped once however many clients view them. */
+	DmapMappedFileCache *mapped_files;
+
+	/* Thumbnails for records that have none; NULL without gdk-pixbuf. */
+	DmapArtworkCache *thumbnails;
+	gchar *thumbnail_cache_dir;
+
+	/* Path to _PinnedThumbnail, held while a listing is being sent. */
+	GHashTable *pinned_thumbnails;
+
+	/* Misses of listings that did not wait for them, rendered in the
+	 * background so later listings find them in the cache. */
+	GQueue *warm_queue;		/* Paths not yet handed to the cache */
+	GHashTable *warming;		/* Paths queued or rendering */
+	guint warm_running;
+	guint warm_max;
 };
 
+enum {
+	PROP_0,
+	PROP_THUMBNAIL_CACHE_DIR
+};
+
+typedef struct {
+	GBytes *bytes;
+	guint pins;
+} _PinnedThumbnail;
+
+/* A thumbnail listing waiting for its thumbnails to be rendered. */
+typedef struct {
+	guint refs;		/* Held by the message and each render */
+	DmapImageShare *share;
+	SoupServer *server;
+	SoupMessage *message;
+	gchar *path;
+	GHashTable *query;
+	SoupClientContext *context;
+	guint pending;		/* Renders outstanding */
+	gboolean render;	/* Else list only thumbnails already rendered */
+	gboolean finished;
+	GPtrArray *pinned;	/* Paths pinned for this listing */
+} _ThumbnailRequest;
+
+typedef struct {
+	_ThumbnailRequest *request;
+	gchar *path;
+} _ThumbnailRender;
+
+typedef struct {
+	GWeakRef share;		/* Does not keep the share rendering */
+	gchar *path;
+} _ThumbnailWarm;
+
 typedef enum {
 	ITEM_ID = 0,
 	ITEM_NAME,
@@ -103,11 +158,6 @@ static struct DmapMetaDataMap _meta_data_map[] = {
 
 #define DPAP_ITEM_KIND_PHOTO 3	/* This is the constant that dpap-sharp uses. */
 
-/* Mmap'ed full image file. Global so that it may be free'ed in a different
- * function call that the one that set it up.
- */
-static GMappedFile *_mapped_file = NULL;
-
 G_DEFINE_TYPE_WITH_PRIVATE (DmapImageShare,
                             dmap_image_share,
                             DMAP_TYPE_SHARE);
@@ -118,13 +168,11 @@ _get_meta_data_map (G_GNUC_UNUSED DmapShare * share)
 	return _meta_data_map;
 }
 
-static GMappedFile *
-_file_to_mmap (const char *location)
+static char *
+_location_to_path (const char *location)
 {
 	GFile *file;
-	GMappedFile *mapped_file = NULL;
-	char *path = NULL;
-	GError *error = NULL;
+	char *path;
 
 	file = g_file_new_for_uri (location);
 	/* NOTE: this is broken if original filename contains "%20" etc. This
@@ -132,22 +180,100 @@ _file_to_mmap (const char *location)
 	 * the filename really may have used "%20" (not " ").
 	 */
 	path = g_file_get_path (file);
+	g_object_unref (file);
+
+	return path;
+}
+
+static GBytes *
+_file_to_mmap (DmapImageShare * share, const char *location)
+{
+	GBytes *bytes = NULL;
+	char *path = NULL;
+	GError *error = NULL;
+
+	path = _location_to_path (location);
 	if (path == NULL) {
-		g_warning ("Couldn't mmap %s: couldn't get path", path);
-		g_object_unref (file);
+		g_warning ("Couldn't mmap %s: couldn't get path", location);
 		goto done;
 	}
-	g_object_unref (file);
 
-	mapped_file = g_mapped_file_new (path, FALSE, &error);
-	if (mapped_file == NULL) {
+	bytes = dmap_mapped_file_cache_get (share->priv->mapped_files, path,
+	                                    &error);
+	if (bytes == NULL) {
 		g_warning ("Unable to map file %s: %s", path, error->message);
+		g_error_free (error);
 	}
 
 done:
 	g_free (path);
 
-	return mapped_file;
+	return bytes;
+}
+
+static void
+_pin_thumbnail (DmapImageShare * share, const gchar * path, GBytes * bytes)
+{
+	_PinnedThumbnail *pinned;
+
+	pinned = g_hash_table_lookup (share->priv->pinned_thumbnails, path);
+	if (NULL == pinned) {
+		pinned = g_new0 (_PinnedThumbnail, 1);
+		pinned->bytes = g_bytes_ref (bytes);
+		g_hash_table_insert (share->priv->pinned_thumbnails,
+		                     g_strdup (path), pinned);
+	}
+
+	pinned->pins++;
+}
+
+static void
+_unpin_thumbnail (DmapImageShare * share, const gchar * path)
+{
+	_PinnedThumbnail *pinned;
+
+	pinned = g_hash_table_lookup (share->priv->pinned_thumbnails, path);
+	if (NULL != pinned && 0 == --pinned->pins) {
+		g_hash_table_remove (share->priv->pinned_thumbnails, path);
+	}
+}
+
+static void
+_pinned_thumbnail_free (_PinnedThumbnail * pinned)
+{
+	g_bytes_unref (pinned->bytes);
+	g_free (pinned);
+}
+
+/* Returns the generated thumbnail of record, if a listing pinned one. */
+static GBytes *
+_lookup_thumbnail (DmapImageShare * share, DmapRecord * record)
+{
+	gchar *location = NULL;
+	gchar *path = NULL;
+	_PinnedThumbnail *pinned;
+	GBytes *bytes = NULL;
+
+	g_object_get (record, "location", &location, NULL);
+	if (NULL == location) {
+		goto done;
+	}
+
+	path = _location_to_path (location);
+	if (NULL == path) {
+		goto done;
+	}
+
+	pinned = g_hash_table_lookup (share->priv->pinned_thumbnails, path);
+	if (NULL != pinned) {
+		bytes = g_bytes_ref (pinned->bytes);
+	}
+
+done:
+	g_free (location);
+	g_free (path);
+
+	return bytes;
 }
 
 static void
@@ -283,43 +409,47 @@ _add_entry_to_mlcl (guint id, DmapRecord * record, gpointer _mb)
 	}
 
 	if (dmap_share_client_requested (mb->bits, PHOTO_FILEDATA)) {
-		size_t size = 0;
-		char *data = NULL;
+		/* The payload references the thumbnail or mapped file, which
+		 * live until the MLIT is sent; see _write_next_mlit(). */
+		GBytes *data = NULL;
 		GArray *thumbnail = NULL;
 
 		if (dmap_share_client_requested (mb->bits, PHOTO_THUMB)) {
 			g_object_get (record, "thumbnail", &thumbnail, NULL);
 			if (thumbnail) {
-				data = thumbnail->data;
-				size = thumbnail->len;
+				data = g_bytes_new_with_free_func (thumbnail->data,
+				                                   thumbnail->len,
+				                                   (GDestroyNotify) g_array_unref,
+				                                   thumbnail);
 			} else {
-				data = NULL;
-				size = 0;
+				data = _lookup_thumbnail (DMAP_IMAGE_SHARE (mb->share),
+				                          record);
 			}
 		} else {
 			/* Should be PHOTO_HIRES */
 			char *location = NULL;
 
 			g_object_get (record, "location", &location, NULL);
-			if (_mapped_file) {
-				/* Free any previously mapped image */
-				g_mapped_file_unref (_mapped_file);
-				_mapped_file = NULL;
-			}
 
-			_mapped_file = _file_to_mmap (location);
-			if (_mapped_file == NULL) {
+			data = _file_to_mmap (DMAP_IMAGE_SHARE (mb->share),
+			                      location);
+			if (data == NULL) {
 				g_warning ("Error opening %s", location);
-				data = NULL;
-				size = 0;
-			} else {
-				data = (char *)
-					g_mapped_file_get_contents (_mapped_file);
-				size = g_mapped_file_get_length (_mapped_file);
 			}
 			g_free (location);
 		}
-		dmap_structure_add (mlit, DMAP_CC_PFDT, data, size);
+
+		if (NULL == data) {
+			data = g_bytes_new (NULL, 0);
+		}
+
+		if (NULL == dmap_structure_add_bytes (mlit, DMAP_CC_PFDT, data)) {
+			/* Too large to describe; send the entry without it. */
+			g_bytes_unref (data);
+			data = g_bytes_new (NULL, 0);
+			dmap_structure_add_bytes (mlit, DMAP_CC_PFDT, data);
+		}
+		g_bytes_unref (data);
 	}
 }
 
@@ -369,8 +499,7 @@ _send_chunked_file (SoupServer * server, SoupMessage * message,
 	soup_message_headers_set_content_length (message->response_headers,
 						 filesize);
 
-	soup_message_headers_append (message->response_headers, "Connection",
-				     "Close");
+	/* Length known: the connection stays open for the next photo. */
 	soup_message_headers_append (message->response_headers,
 				     "Content-Type",
 				     "application/x-dmap-tagged");
@@ -399,6 +528,8 @@ _databases_items_xxx (DmapShare * share,
 	guint id;
 	guint64 filesize;
 	DmapImageRecord *record;
+	gchar *location = NULL;
+	gchar *identity = NULL;
 
 	rest_of_path = strchr (path + 1, '/');
 	id_str = rest_of_path + 9;
@@ -406,15 +537,425 @@ _databases_items_xxx (DmapShare * share,
 
 	g_object_get (share, "db", &db, NULL);
 	record = DMAP_IMAGE_RECORD (dmap_db_lookup_by_id (db, id));
-	g_object_get (record, "large-filesize", &filesize, NULL);
+	g_object_get (record, "large-filesize", &filesize,
+	                      "location", &location, NULL);
 
 	DMAP_SHARE_GET_CLASS (share)->message_add_standard_headers
 		(share, msg);
+
+	/* Re-opening an unchanged photo costs a 304. */
+	if (NULL != location) {
+		identity = g_strdup_printf ("%u\n%s\n%" G_GUINT64_FORMAT, id,
+		                            location, filesize);
+		if (dmap_private_utils_message_not_modified (msg, identity,
+		                                             dmap_private_utils_uri_mtime (location),
+		                                             DMAP_SHARE_ITEM_MAX_AGE)) {
+			goto done;
+		}
+	}
+
 	soup_message_set_status (msg, SOUP_STATUS_OK);
 
 	_send_chunked_file (server, msg, record, filesize);
 
+done:
 	g_object_unref (record);
+	g_free (location);
+	g_free (identity);
+}
+
+/* Returns TRUE if a request lists thumbnail data for database items. */
+static gboolean
+_wants_thumbnails (const char *path, GHashTable * query)
+{
+	const gchar *meta;
+	gchar **attrs;
+	guint i;
+	gboolean thumb = FALSE, filedata = FALSE;
+
+	/* iPhoto fetches thumbnails for the items it shows by ID. */
+	if (!g_str_has_suffix (path, "/databases/1/items")) {
+		goto done;
+	}
+
+	meta = g_hash_table_lookup (query, "meta");
+	if (NULL == meta) {
+		goto done;
+	}
+
+	attrs = g_strsplit (meta, ",", -1);
+	for (i = 0; attrs[i]; i++) {
+		thumb |= 0 == strcmp (attrs[i], "dpap.thumb");
+		filedata |= 0 == strcmp (attrs[i], "dpap.filedata");
+	}
+	g_strfreev (attrs);
+
+done:
+	return thumb && filedata;
+}
+
+static void
+_thumbnail_request_unref (_ThumbnailRequest * request)
+{
+	guint i;
+
+	if (0 != --request->refs) {
+		return;
+	}
+
+	for (i = 0; i < request->pinned->len; i++) {
+		_unpin_thumbnail (request->share,
+		                  g_ptr_array_index (request->pinned, i));
+	}
+	g_ptr_array_free (request->pinned, TRUE);
+
+	g_object_unref (request->share);
+	g_object_unref (request->message);
+	g_hash_table_unref (request->query);
+	g_free (request->path);
+	g_free (request);
+}
+
+static void
+_thumbnail_request_proceed (_ThumbnailRequest * request)
+{
+	DMAP_SHARE_CLASS (dmap_image_share_parent_class)->databases
+		(DMAP_SHARE (request->share),
+		 request->server,
+		 request->message,
+		 request->path,
+		 request->query,
+		 request->context);
+}
+
+static void
+_thumbnail_request_finished (G_GNUC_UNUSED SoupMessage * message,
+                             _ThumbnailRequest * request)
+{
+	/* Sent, or the client went away; the context is no longer valid. */
+	request->finished = TRUE;
+	_thumbnail_request_unref (request);
+}
+
+static void
+_thumbnail_rendered (G_GNUC_UNUSED GObject * source_object,
+                     GAsyncResult * result,
+                     gpointer user_data)
+{
+	GBytes *bytes;
+	GError *error = NULL;
+	_ThumbnailRender *render = user_data;
+	_ThumbnailRequest *request = render->request;
+	DmapImageShare *share = request->share;
+
+	bytes = dmap_artwork_cache_render_finish (share->priv->thumbnails,
+	                                          result, &error);
+	if (NULL == bytes) {
+		g_debug ("Cannot create thumbnail of %s: %s", render->path,
+		         error->message);
+		g_error_free (error);
+	} else if (!request->finished) {
+		_pin_thumbnail (share, render->path, bytes);
+		g_ptr_array_add (request->pinned, render->path);
+		render->path = NULL;
+	}
+
+	if (NULL != bytes) {
+		g_bytes_unref (bytes);
+	}
+
+	if (0 == --request->pending && !request->finished) {
+		_thumbnail_request_proceed (request);
+		soup_server_unpause_message (request->server,
+		                             request->message);
+	}
+
+	_thumbnail_request_unref (request);
+	g_free (render->path);
+	g_free (render);
+}
+
+static void _thumbnail_warm_next (DmapImageShare * share);
+
+static void
+_thumbnail_warmed (G_GNUC_UNUSED GObject * source_object,
+                   GAsyncResult * result,
+                   gpointer user_data)
+{
+	GBytes *bytes;
+	GError *error = NULL;
+	_ThumbnailWarm *warm = user_data;
+	DmapImageShare *share;
+
+	share = g_weak_ref_get (&warm->share);
+
+	bytes = dmap_artwork_cache_render_finish (NULL, result, &error);
+	if (NULL == bytes) {
+		g_debug ("Cannot create thumbnail of %s: %s", warm->path,
+		         error->message);
+		g_error_free (error);
+	} else {
+		/* Now in the cache. */
+		g_bytes_unref (bytes);
+	}
+
+	if (NULL != share) {
+		g_hash_table_remove (share->priv->warming, warm->path);
+		share->priv->warm_running--;
+		_thumbnail_warm_next (share);
+		g_object_unref (share);
+	}
+
+	g_weak_ref_clear (&warm->share);
+	g_free (warm->path);
+	g_free (warm);
+}
+
+/* Hands the cache no more background renders than it runs at once, so
+ * renders a listing waits on are not queued behind them. */
+static void
+_thumbnail_warm_next (DmapImageShare * share)
+{
+	gchar *path;
+	_ThumbnailWarm *warm;
+
+	while (share->priv->warm_running < share->priv->warm_max) {
+		path = g_queue_pop_head (share->priv->warm_queue);
+		if (NULL == path) {
+			break;
+		}
+
+		warm = g_new0 (_ThumbnailWarm, 1);
+		g_weak_ref_init (&warm->share, share);
+		warm->path = path;
+
+		share->priv->warm_running++;
+
+		dmap_artwork_cache_render_async (share->priv->thumbnails,
+		                                 warm->path,
+		                                 THUMBNAIL_SIZE, THUMBNAIL_SIZE,
+		                                 _thumbnail_warmed, warm);
+	}
+}
+
+/* Renders the thumbnail at path in the background, once however many
+ * listings miss it meanwhile. */
+static void
+_thumbnail_warm (DmapImageShare * share, const gchar * path)
+{
+	if (g_hash_table_contains (share->priv->warming, path)) {
+		goto done;
+	}
+
+	g_hash_table_add (share->priv->warming, g_strdup (path));
+	g_queue_push_tail (share->priv->warm_queue, g_strdup (path));
+
+	_thumbnail_warm_next (share);
+
+done:
+	return;
+}
+
+/* Pins the thumbnail of record, rendering it first on a miss. */
+static void
+_thumbnail_want (G_GNUC_UNUSED guint id,
+                 DmapRecord * record,
+                 _ThumbnailRequest * request)
+{
+	GArray *thumbnail = NULL;
+	gchar *location = NULL;
+	gchar *path = NULL;
+	GBytes *bytes;
+	_ThumbnailRender *render;
+	DmapImageShare *share = request->share;
+
+	g_object_get (record, "thumbnail", &thumbnail, NULL);
+	if (NULL != thumbnail) {
+		/* Provided by the application. */
+		g_array_unref (thumbnail);
+		goto done;
+	}
+
+	g_object_get (record, "location", &location, NULL);
+	if (NULL == location) {
+		goto done;
+	}
+
+	path = _location_to_path (location);
+	if (NULL == path) {
+		goto done;
+	}
+
+	bytes = dmap_artwork_cache_lookup (share->priv->thumbnails, path,
+	                                   THUMBNAIL_SIZE, THUMBNAIL_SIZE);
+	if (NULL != bytes) {
+		_pin_thumbnail (share, path, bytes);
+		g_ptr_array_add (request->pinned, path);
+		path = NULL;
+		g_bytes_unref (bytes);
+		goto done;
+	}
+
+	if (!request->render) {
+		_thumbnail_warm (share, path);
+		goto done;
+	}
+
+	render = g_new0 (_ThumbnailRender, 1);
+	render->request = request;
+	render->path = path;
+	path = NULL;
+
+	request->refs++;
+	request->pending++;
+
+	dmap_artwork_cache_render_async (share->priv->thumbnails, render->path,
+	                                 THUMBNAIL_SIZE, THUMBNAIL_SIZE,
+	                                 _thumbnail_rendered, render);
+
+done:
+	g_free (location);
+	g_free (path);
+}
+
+static void
+_thumbnail_want_adapter (gpointer id,
+                         DmapRecord * record,
+                         _ThumbnailRequest * request)
+{
+	_thumbnail_want (GPOINTER_TO_UINT (id), record, request);
+}
+
+static void
+_databases (DmapShare * share,
+            SoupServer * server,
+            SoupMessage * message,
+            const char *path,
+            GHashTable * query,
+            SoupClientContext * context)
+{
+	DmapImageShare *image_share = DMAP_IMAGE_SHARE (share);
+	_ThumbnailRequest *request;
+	gchar *record_query;
+	DmapDb *db = NULL;
+
+	if (NULL == image_share->priv->thumbnails
+	 || !_wants_thumbnails (path, query)
+	 || !dmap_share_session_id_validate (share, context, query, NULL)) {
+		DMAP_SHARE_CLASS (dmap_image_share_parent_class)->databases
+			(share, server, message, path, query, context);
+		goto done;
+	}
+
+	record_query = g_hash_table_lookup (query, "query");
+
+	/* Keep the thumbnails this listing holds until it is sent, so its
+	 * size cannot change. Wait on misses only for a listing of chosen
+	 * items; a listing of the whole database would wait on every photo,
+	 * so it is sent at once with the thumbnails already rendered, and
+	 * its misses are rendered in the background for later listings. */
+	request = g_new0 (_ThumbnailRequest, 1);
+	request->refs = 1;
+	request->share = g_object_ref (image_share);
+	request->server = server;
+	request->message = g_object_ref (message);
+	request->path = g_strdup (path);
+	request->query = g_hash_table_ref (query);
+	request->context = context;
+	request->pinned = g_ptr_array_new_with_free_func (g_free);
+	request->render = NULL != record_query;
+
+	g_signal_connect (message, "finished",
+	                  G_CALLBACK (_thumbnail_request_finished), request);
+
+	g_object_get (share, "db", &db, NULL);
+
+	if (record_query) {
+		GSList *filter_def;
+		GHashTable *records;
+
+		filter_def = dmap_share_build_filter (record_query);
+		records = dmap_db_apply_filter (db, filter_def);
+		g_hash_table_foreach (records, (GHFunc) _thumbnail_want_adapter,
+		                      request);
+		g_hash_table_destroy (records);
+		dmap_share_free_filter (filter_def);
+	} else {
+		dmap_db_foreach (db, (DmapIdRecordFunc) _thumbnail_want,
+		                 request);
+	}
+
+	g_object_unref (db);
+
+	if (0 == request->pending) {
+		_thumbnail_request_proceed (request);
+	} else {
+		g_debug ("Rendering %u thumbnails", request->pending);
+		soup_server_pause_message (server, message);
+	}
+
+done:
+	return;
+}
+
+static void
+_set_property (GObject * object,
+               guint prop_id,
+               const GValue * value,
+               GParamSpec * pspec)
+{
+	DmapImageShare *share = DMAP_IMAGE_SHARE (object);
+
+	switch (prop_id) {
+	case PROP_THUMBNAIL_CACHE_DIR:
+		g_free (share->priv->thumbnail_cache_dir);
+		share->priv->thumbnail_cache_dir = g_value_dup_string (value);
+		if (NULL != share->priv->thumbnails) {
+			dmap_artwork_cache_set_dir (share->priv->thumbnails,
+			                            share->priv->thumbnail_cache_dir);
+		}
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+_get_property (GObject * object,
+               guint prop_id,
+               GValue * value,
+               GParamSpec * pspec)
+{
+	DmapImageShare *share = DMAP_IMAGE_SHARE (object);
+
+	switch (prop_id) {
+	case PROP_THUMBNAIL_CACHE_DIR:
+		g_value_set_string (value, share->priv->thumbnail_cache_dir);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+_finalize (GObject * object)
+{
+	DmapImageShare *share = DMAP_IMAGE_SHARE (object);
+
+	dmap_mapped_file_cache_free (share->priv->mapped_files);
+
+	/* Listings hold a reference to share, so none is pinned. */
+	g_hash_table_destroy (share->priv->pinned_thumbnails);
+
+	/* Background renders under way find the share gone and stop. */
+	g_queue_free_full (share->priv->warm_queue, g_free);
+	g_hash_table_destroy (share->priv->warming);
+	dmap_artwork_cache_free (share->priv->thumbnails);
+	g_free (share->priv->thumbnail_cache_dir);
+
+	G_OBJECT_CLASS (dmap_image_share_parent_class)->finalize (object);
 }
 
 static void
@@ -423,6 +964,10 @@ dmap_image_share_class_init (DmapImageShareClass * klass)
 	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 	DmapShareClass *parent_class = DMAP_SHARE_CLASS (object_class);
 
+	object_class->get_property = _get_property;
+	object_class->set_property = _set_property;
+	object_class->finalize = _finalize;
+
 	parent_class->get_desired_port = _get_desired_port;
 	parent_class->get_type_of_service = _get_type_of_service;
 	parent_class->message_add_standard_headers = _message_add_standard_headers;
@@ -431,6 +976,15 @@ dmap_image_share_class_init (DmapImageShareClass * klass)
 	parent_class->databases_browse_xxx = _databases_browse_xxx;
 	parent_class->databases_items_xxx = _databases_items_xxx;
 	parent_class->server_info = _server_info;
+	parent_class->databases = _databases;
+
+	g_object_class_install_property (object_class,
+					 PROP_THUMBNAIL_CACHE_DIR,
+					 g_param_spec_string ("thumbnail-cache-dir",
+							      "Thumbnail cache directory",
+							      "Directory in which to keep generated thumbnails, or NULL",
+							      NULL,
+							      G_PARAM_READWRITE));
 }
 
 static void
@@ -438,6 +992,22 @@ dmap_image_share_init (DmapImageShare * share)
 {
 	/* FIXME: do I need to manually call parent _init? */
 	share->priv = dmap_image_share_get_instance_private(share);
+	share->priv->mapped_files =
+		dmap_mapped_file_cache_new (MAPPED_FILE_CACHE_SIZE);
+
+	share->priv->pinned_thumbnails =
+		g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+		                       (GDestroyNotify) _pinned_thumbnail_free);
+
+	share->priv->warm_queue = g_queue_new ();
+	share->priv->warming =
+		g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	share->priv->warm_max = MAX (1, g_get_num_processors ());
+#ifdef HAVE_GDKPIXBUF
+	share->priv->thumbnails =
+		dmap_artwork_cache_new (THUMBNAIL_CACHE_SIZE);
+	dmap_artwork_cache_set_format (share->priv->thumbnails, "jpeg");
+#endif /* HAVE_GDKPIXBUF */
 }
 
 /* FIXME: trancode_mimetype currently not used for DPAP, only DAAP. 
@@ -0,0 +1,296 @@
+/*
+ * Cache of memory-mapped image files used by DmapImageShare
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+
+#include "dmap-mapped-file-cache.h"
+
+struct DmapMappedFileCache
+{
+	GMutex lock;
+	gsize max_size;		/* Bytes; 0 means unbounded */
+	gsize size;
+	GQueue *entries;	/* _MappedEntry, most recently used first */
+	GHashTable *index;	/* Path to link in entries */
+};
+
+typedef struct
+{
+	gchar *path;
+	gint64 mtime;
+	GBytes *bytes;
+} _MappedEntry;
+
+static void
+_entry_free (_MappedEntry * entry)
+{
+	g_free (entry->path);
+	g_bytes_unref (entry->bytes);
+	g_free (entry);
+}
+
+static void
+_remove_link (DmapMappedFileCache * cache, GList * link)
+{
+	_MappedEntry *entry = link->data;
+
+	cache->size -= g_bytes_get_size (entry->bytes);
+	g_hash_table_remove (cache->index, entry->path);
+	g_queue_delete_link (cache->entries, link);
+	_entry_free (entry);
+}
+
+/* Called with lock held. */
+static void
+_insert (DmapMappedFileCache * cache,
+         const gchar * path,
+         gint64 mtime,
+         GBytes * bytes)
+{
+	GList *link;
+	_MappedEntry *entry;
+
+	entry = g_new0 (_MappedEntry, 1);
+	entry->path = g_strdup (path);
+	entry->mtime = mtime;
+	entry->bytes = g_bytes_ref (bytes);
+
+	g_queue_push_head (cache->entries, entry);
+	g_hash_table_insert (cache->index, entry->path, cache->entries->head);
+	cache->size += g_bytes_get_size (bytes);
+
+	/* Never evict the entry just added. */
+	while (0 != cache->max_size && cache->size > cache->max_size
+	    && (link = g_queue_peek_tail_link (cache->entries)) != cache->entries->head) {
+		g_debug ("Unmapping %s", ((_MappedEntry *) link->data)->path);
+		_remove_link (cache, link);
+	}
+}
+
+/* Called with lock held. */
+static GBytes *
+_lookup (DmapMappedFileCache * cache,
+         const gchar * path,
+         gint64 mtime,
+         gsize size)
+{
+	GList *link;
+	_MappedEntry *entry;
+	GBytes *bytes = NULL;
+
+	link = g_hash_table_lookup (cache->index, path);
+	if (NULL == link) {
+		goto done;
+	}
+
+	entry = link->data;
+
+	/* The file changed since it was mapped. */
+	if (entry->mtime != mtime || g_bytes_get_size (entry->bytes) != size) {
+		_remove_link (cache, link);
+		goto done;
+	}
+
+	g_queue_unlink (cache->entries, link);
+	g_queue_push_head_link (cache->entries, link);
+
+	bytes = g_bytes_ref (entry->bytes);
+
+done:
+	return bytes;
+}
+
+DmapMappedFileCache *
+dmap_mapped_file_cache_new (gsize max_size)
+{
+	DmapMappedFileCache *cache;
+
+	cache = g_new0 (DmapMappedFileCache, 1);
+	g_mutex_init (&cache->lock);
+	cache->max_size = max_size;
+	cache->entries = g_queue_new ();
+	cache->index = g_hash_table_new (g_str_hash, g_str_equal);
+
+	return cache;
+}
+
+void
+dmap_mapped_file_cache_free (DmapMappedFileCache * cache)
+{
+	if (NULL == cache) {
+		return;
+	}
+
+	/* Mappings still referenced by callers outlive the cache. */
+	g_hash_table_destroy (cache->index);
+	g_queue_free_full (cache->entries, (GDestroyNotify) _entry_free);
+	g_mutex_clear (&cache->lock);
+	g_free (cache);
+}
+
+GBytes *
+dmap_mapped_file_cache_get (DmapMappedFileCache * cache,
+                            const gchar * path,
+                            GError ** error)
+{
+	GStatBuf buf;
+	GMappedFile *mapped_file;
+	GBytes *bytes = NULL;
+
+	if (0 != g_stat (path, &buf)) {
+		int errsv = errno;
+
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+		             "Cannot stat %s: %s", path, g_strerror (errsv));
+		goto done;
+	}
+
+	g_mutex_lock (&cache->lock);
+	bytes = _lookup (cache, path, (gint64) buf.st_mtime,
+	                 (gsize) buf.st_size);
+	g_mutex_unlock (&cache->lock);
+
+	if (NULL != bytes) {
+		goto done;
+	}
+
+	/* Map outside the lock; if another thread raced us, keep the
+	 * first mapping inserted. */
+	mapped_file = g_mapped_file_new (path, FALSE, error);
+	if (NULL == mapped_file) {
+		goto done;
+	}
+
+	bytes = g_mapped_file_get_bytes (mapped_file);
+	g_mapped_file_unref (mapped_file);
+
+	g_mutex_lock (&cache->lock);
+	{
+		GBytes *raced = _lookup (cache, path, (gint64) buf.st_mtime,
+		                         g_bytes_get_size (bytes));
+
+		if (NULL != raced) {
+			g_bytes_unref (bytes);
+			bytes = raced;
+		} else {
+			_insert (cache, path, (gint64) buf.st_mtime, bytes);
+		}
+	}
+	g_mutex_unlock (&cache->lock);
+
+done:
+	return bytes;
+}
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+#include <string.h>
+#include <unistd.h>
+
+static gchar *
+_file_test (const gchar * contents)
+{
+	gint fd;
+	gchar *path = NULL;
+
+	fd = g_file_open_tmp ("dmap-mapped-XXXXXX", &path, NULL);
+	ck_assert (fd >= 0);
+	close (fd);
+
+	ck_assert (g_file_set_contents (path, contents, -1, NULL));
+
+	return path;
+}
+
+START_TEST(_mapped_file_cache_shared_test)
+{
+	gchar *path;
+	GBytes *bytes1, *bytes2;
+	DmapMappedFileCache *cache;
+
+	path = _file_test ("0123456789");
+	cache = dmap_mapped_file_cache_new (0);
+
+	bytes1 = dmap_mapped_file_cache_get (cache, path, NULL);
+	bytes2 = dmap_mapped_file_cache_get (cache, path, NULL);
+	ck_assert (NULL != bytes1);
+
+	/* Mapped once. */
+	ck_assert (bytes1 == bytes2);
+	ck_assert_int_eq (10, g_bytes_get_size (bytes1));
+
+	g_bytes_unref (bytes1);
+	g_bytes_unref (bytes2);
+	dmap_mapped_file_cache_free (cache);
+	g_unlink (path);
+	g_free (path);
+}
+END_TEST
+
+START_TEST(_mapped_file_cache_evict_test)
+{
+	gchar *path1, *path2;
+	GBytes *bytes1, *bytes2;
+	DmapMappedFileCache *cache;
+
+	path1 = _file_test ("0123456789");
+	path2 = _file_test ("abcdefghij");
+	cache = dmap_mapped_file_cache_new (15);
+
+	bytes1 = dmap_mapped_file_cache_get (cache, path1, NULL);
+	bytes2 = dmap_mapped_file_cache_get (cache, path2, NULL);
+
+	/* path1 was dropped, but its reference stays readable. */
+	ck_assert_int_eq (1, g_queue_get_length (cache->entries));
+	ck_assert (0 == memcmp ("0123456789",
+	                        g_bytes_get_data (bytes1, NULL), 10));
+
+	g_bytes_unref (bytes1);
+	g_bytes_unref (bytes2);
+	dmap_mapped_file_cache_free (cache);
+	g_unlink (path1);
+	g_unlink (path2);
+	g_free (path1);
+	g_free (path2);
+}
+END_TEST
+
+START_TEST(_mapped_file_cache_missing_test)
+{
+	GError *error = NULL;
+	DmapMappedFileCache *cache;
+
+	cache = dmap_mapped_file_cache_new (0);
+
+	ck_assert (NULL == dmap_mapped_file_cache_get (cache,
+	                                               "/nonexistent/dmap",
+	                                               &error));
+	ck_assert (NULL != error);
+
+	g_error_free (error);
+	dmap_mapped_file_cache_free (cache);
+}
+END_TEST
+
+#include "dmap-mapped-file-cache-suite.c"
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * Cache of memory-mapped image files used by DmapImageShare
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DMAP_MAPPED_FILE_CACHE_H
+#define _DMAP_MAPPED_FILE_CACHE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Read-only mappings of files, keyed by path and checked against the
+ * file's modification time and size on each use. The total mapped size
+ * is kept below a maximum by dropping the least recently used mappings;
+ * one still referenced by a caller stays mapped until released. Safe to
+ * use from several threads.
+ */
+typedef struct DmapMappedFileCache DmapMappedFileCache;
+
+/* A max_size of 0 means unbounded. */
+DmapMappedFileCache *dmap_mapped_file_cache_new (gsize max_size);
+void    dmap_mapped_file_cache_free (DmapMappedFileCache * cache);
+
+/* Returns a new reference to the contents of path, or NULL with error
+ * set. */
+GBytes *dmap_mapped_file_cache_get (DmapMappedFileCache * cache,
+                                    const gchar * path,
+                                    GError ** error);
+
+G_END_DECLS
+#endif /* _DMAP_MAPPED_FILE_CACHE_H */
@@ -18,10 +18,21 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include "config.h"
+
 #include <string.h>
 
 #include "dmap-private-utils.h"
 
+static gboolean
+_retry_chunk (ChunkData * cd)
+{
+	cd->retry_id = 0;
+	dmap_private_utils_write_next_chunk (cd->retry_message, cd);
+
+	return FALSE;
+}
+
 void
 dmap_private_utils_write_next_chunk (SoupMessage * message, ChunkData * cd)
 {
@@ -33,32 +44,466 @@ dmap_private_utils_write_next_chunk (SoupMessage * message, ChunkData * cd)
 	read_size = g_input_stream_read (cd->stream,
 					 chunk,
 					 DMAP_SHARE_CHUNK_SIZE, NULL, &error);
+	if (read_size < 0
+	 && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+		g_debug ("No data yet; retrying in %d ms.",
+		         DMAP_SHARE_CHUNK_RETRY_MS);
+		g_error_free (error);
+		g_free (chunk);
+
+		soup_server_pause_message (cd->server, message);
+		cd->retry_message = message;
+		cd->retry_id = g_timeout_add (DMAP_SHARE_CHUNK_RETRY_MS,
+		                              (GSourceFunc) _retry_chunk, cd);
+		goto done;
+	}
+
 	if (read_size > 0) {
+		if (NULL != cd->tee
+		 && !g_output_stream_write_all (cd->tee, chunk, read_size,
+		                                NULL, NULL, &error)) {
+			g_warning ("Error writing copy of stream: %s",
+			           error->message);
+			g_clear_error (&error);
+			g_output_stream_close (cd->tee, NULL, NULL);
+			g_object_unref (cd->tee);
+			cd->tee = NULL;
+		}
 		soup_message_body_append (message->response_body,
 					  SOUP_MEMORY_TAKE, chunk, read_size);
+		cd->written += read_size;
 		g_debug ("Read/wrote %"G_GSSIZE_FORMAT" bytes.", read_size);
 	} else {
 		if (error != NULL) {
 			g_warning ("Error reading from input stream: %s",
 				   error->message);
 			g_error_free (error);
+		} else {
+			cd->eof = TRUE;
 		}
+
+		/* A keep-alive client would wait forever for the rest of a
+		 * short body; closing the connection ends it. */
+		if (!cd->eof
+		 || (soup_message_headers_get_encoding (message->response_headers) == SOUP_ENCODING_CONTENT_LENGTH
+		  && cd->written < soup_message_headers_get_content_length (message->response_headers))) {
+			soup_message_headers_replace (message->response_headers,
+			                              "Connection", "close");
+		}
+
 		g_free (chunk);
 		g_debug ("Wrote 0 bytes, sending message complete.");
 		soup_message_body_complete (message->response_body);
 	}
 	soup_server_unpause_message (cd->server, message);
+
+done:
+	return;
 }
 
 void
 dmap_private_utils_chunked_message_finished (G_GNUC_UNUSED SoupMessage * message, ChunkData * cd)
 {
 	g_debug ("Finished sending chunked file.");
+
+	if (0 != cd->retry_id) {
+		g_source_remove (cd->retry_id);
+	}
+
 	g_input_stream_close (cd->stream, NULL, NULL);
 
 	if (cd->original_stream) {
 		g_input_stream_close (cd->original_stream, NULL, NULL);
 	}
 
+	if (cd->tee) {
+		g_output_stream_close (cd->tee, NULL, NULL);
+		g_object_unref (cd->tee);
+	}
+
 	g_free (cd);
 }
+
+gboolean
+dmap_private_utils_offset_to_time (goffset offset,
+                                   gsize header_size,
+                                   guint byte_rate,
+                                   guint64 * time)
+{
+	guint64 data;
+	gboolean ok = FALSE;
+
+	g_assert (byte_rate > 0);
+
+	if (offset < 0 || (0 != header_size && (guint64) offset < header_size)) {
+		goto done;
+	}
+
+	/* Split to avoid overflowing offset * G_NSEC_PER_SEC. */
+	data = offset - header_size;
+	*time = data / byte_rate * G_GUINT64_CONSTANT (1000000000)
+	      + data % byte_rate * G_GUINT64_CONSTANT (1000000000) / byte_rate;
+
+	ok = TRUE;
+
+done:
+	return ok;
+}
+
+void
+dmap_private_utils_ring_buffer_init (DmapRingBuffer * ring, gsize capacity)
+{
+	g_assert (capacity > 0);
+
+	ring->data = g_malloc (capacity);
+	ring->capacity = capacity;
+	ring->head = 0;
+	ring->len = 0;
+}
+
+void
+dmap_private_utils_ring_buffer_clear (DmapRingBuffer * ring)
+{
+	g_free (ring->data);
+	ring->data = NULL;
+	ring->capacity = 0;
+	ring->head = 0;
+	ring->len = 0;
+}
+
+gsize
+dmap_private_utils_ring_buffer_write (DmapRingBuffer * ring,
+                                      const guint8 * src,
+                                      gsize count)
+{
+	gsize tail, run;
+
+	count = MIN (count, ring->capacity - ring->len);
+	if (0 == count) {
+		goto done;
+	}
+
+	tail = (ring->head + ring->len) % ring->capacity;
+	run = MIN (count, ring->capacity - tail);
+
+	memcpy (ring->data + tail, src, run);
+	memcpy (ring->data, src + run, count - run);
+
+	ring->len += count;
+
+done:
+	return count;
+}
+
+gsize
+dmap_private_utils_ring_buffer_read (DmapRingBuffer * ring,
+                                     guint8 * dst,
+                                     gsize count)
+{
+	gsize run;
+
+	count = MIN (count, ring->len);
+	if (0 == count) {
+		goto done;
+	}
+
+	run = MIN (count, ring->capacity - ring->head);
+
+	memcpy (dst, ring->data + ring->head, run);
+	memcpy (dst + run, ring->data, count - run);
+
+	ring->head = (ring->head + count) % ring->capacity;
+	ring->len -= count;
+
+	if (0 == ring->len) {
+		/* Keep subsequent writes contiguous when possible. */
+		ring->head = 0;
+	}
+
+done:
+	return count;
+}
+
+guint64
+dmap_private_utils_uri_mtime (const gchar * location)
+{
+	guint64 mtime = 0;
+	GFile *file;
+	GFileInfo *info;
+
+	file = g_file_new_for_uri (location);
+	info = g_file_query_info (file,
+	                          G_FILE_ATTRIBUTE_TIME_MODIFIED,
+	                          G_FILE_QUERY_INFO_NONE,
+	                          NULL,
+	                          NULL);
+	if (NULL != info) {
+		mtime = g_file_info_get_attribute_uint64 (info,
+		                                          G_FILE_ATTRIBUTE_TIME_MODIFIED);
+		g_object_unref (info);
+	}
+
+	g_object_unref (file);
+
+	return mtime;
+}
+
+static gboolean
+_etag_matches (const gchar * header, const gchar * etag)
+{
+	guint i;
+	gchar **tags;
+	gboolean match = FALSE;
+
+	tags = g_strsplit (header, ",", -1);
+	for (i = 0; tags[i] && !match; i++) {
+		const gchar *tag = g_strstrip (tags[i]);
+
+		/* Weak comparison, as for GET. */
+		if (g_str_has_prefix (tag, "W/")) {
+			tag += 2;
+		}
+
+		match = 0 == strcmp (tag, "*") || 0 == strcmp (tag, etag);
+	}
+	g_strfreev (tags);
+
+	return match;
+}
+
+gboolean
+dmap_private_utils_message_not_modified (SoupMessage * message,
+                                         const gchar * identity,
+                                         guint64 mtime,
+                                         guint max_age)
+{
+	gchar *material, *hash, *etag, *cache_control;
+	const gchar *header;
+	gboolean not_modified = FALSE;
+
+	material = g_strdup_printf ("%s\n%" G_GUINT64_FORMAT, identity, mtime);
+	hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, material, -1);
+	etag = g_strdup_printf ("\"%s\"", hash);
+
+	soup_message_headers_replace (message->response_headers, "ETag", etag);
+
+	if (0 != mtime) {
+		SoupDate *date = soup_date_new_from_time_t ((time_t) mtime);
+		gchar *last_modified = soup_date_to_string (date, SOUP_DATE_HTTP);
+
+		soup_message_headers_replace (message->response_headers,
+		                              "Last-Modified", last_modified);
+
+		g_free (last_modified);
+		soup_date_free (date);
+	}
+
+	if (0 == max_age) {
+		cache_control = g_strdup ("private, no-cache");
+	} else {
+		cache_control = g_strdup_printf ("private, max-age=%u", max_age);
+	}
+	soup_message_headers_replace (message->response_headers,
+	                              "Cache-Control", cache_control);
+
+	/* If-None-Match, when present, overrides If-Modified-Since. */
+	header = soup_message_headers_get_list (message->request_headers,
+	                                        "If-None-Match");
+	if (NULL != header) {
+		not_modified = _etag_matches (header, etag);
+	} else if (0 != mtime) {
+		header = soup_message_headers_get_one (message->request_headers,
+		                                       "If-Modified-Since");
+		if (NULL != header) {
+			SoupDate *date = soup_date_new_from_string (header);
+
+			if (NULL != date) {
+				not_modified = mtime <= (guint64) soup_date_to_time_t (date);
+				soup_date_free (date);
+			}
+		}
+	}
+
+	if (not_modified) {
+		soup_message_set_status (message, SOUP_STATUS_NOT_MODIFIED);
+	}
+
+	g_free (material);
+	g_free (hash);
+	g_free (etag);
+	g_free (cache_control);
+
+	return not_modified;
+}
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+
+START_TEST(_ring_buffer_wrap_test)
+{
+	DmapRingBuffer ring;
+	guint8 out[8] = { 0 };
+
+	dmap_private_utils_ring_buffer_init (&ring, 8);
+
+	ck_assert_int_eq (6, dmap_private_utils_ring_buffer_write (&ring, (guint8 *) "abcdef", 6));
+	ck_assert_int_eq (4, dmap_private_utils_ring_buffer_read (&ring, out, 4));
+	ck_assert (0 == memcmp (out, "abcd", 4));
+
+	/* Crosses the end of the backing store. */
+	ck_assert_int_eq (6, dmap_private_utils_ring_buffer_write (&ring, (guint8 *) "ghijkl", 6));
+	ck_assert_int_eq (8, ring.len);
+
+	/* Full: nothing more fits. */
+	ck_assert_int_eq (0, dmap_private_utils_ring_buffer_write (&ring, (guint8 *) "m", 1));
+
+	ck_assert_int_eq (8, dmap_private_utils_ring_buffer_read (&ring, out, sizeof out));
+	ck_assert (0 == memcmp (out, "efghijkl", 8));
+	ck_assert_int_eq (0, dmap_private_utils_ring_buffer_read (&ring, out, sizeof out));
+
+	dmap_private_utils_ring_buffer_clear (&ring);
+}
+END_TEST
+
+START_TEST(_ring_buffer_short_write_test)
+{
+	DmapRingBuffer ring;
+
+	dmap_private_utils_ring_buffer_init (&ring, 4);
+
+	ck_assert_int_eq (4, dmap_private_utils_ring_buffer_write (&ring, (guint8 *) "abcdef", 6));
+	ck_assert_int_eq (4, ring.len);
+
+	dmap_private_utils_ring_buffer_clear (&ring);
+}
+END_TEST
+
+/* Writing more than is read leaves data in the ring, so blocks that do
+ * not divide the capacity cross its end at varying offsets. */
+START_TEST(_ring_buffer_stream_test)
+{
+	gsize i, j, n;
+	guint8 in[7], out[5];
+	guint8 next_in = 0, next_out = 0;
+	guint write_wraps = 0, read_wraps = 0;
+	DmapRingBuffer ring;
+
+	dmap_private_utils_ring_buffer_init (&ring, 16);
+
+	for (i = 0; i < 64; i++) {
+		for (j = 0; j < sizeof in; j++) {
+			in[j] = next_in + j;
+		}
+
+		/* Short once the ring fills up. */
+		n = dmap_private_utils_ring_buffer_write (&ring, in, sizeof in);
+		ck_assert (n > 0);
+		next_in += n;
+		if (ring.head + ring.len > ring.capacity) {
+			write_wraps++;
+		}
+
+		if (ring.head + MIN (sizeof out, ring.len) > ring.capacity) {
+			read_wraps++;
+		}
+		n = dmap_private_utils_ring_buffer_read (&ring, out, sizeof out);
+		ck_assert_int_eq (sizeof out, n);
+		for (j = 0; j < n; j++) {
+			ck_assert_int_eq (next_out, out[j]);
+			next_out++;
+		}
+	}
+
+	ck_assert (ring.len > 0);
+	while (0 != (n = dmap_private_utils_ring_buffer_read (&ring, out, sizeof out))) {
+		for (j = 0; j < n; j++) {
+			ck_assert_int_eq (next_out, out[j]);
+			next_out++;
+		}
+	}
+
+	ck_assert_int_eq (next_in, next_out);
+	ck_assert_int_eq (0, ring.len);
+	ck_assert (write_wraps > 0);
+	ck_assert (read_wraps > 0);
+
+	dmap_private_utils_ring_buffer_clear (&ring);
+}
+END_TEST
+
+START_TEST(_offset_to_time_test)
+{
+	guint64 time;
+	const guint byte_rate = 44100 * 2 * 2;
+
+	/* MP3: 128 kbit/s, no header. */
+	ck_assert (dmap_private_utils_offset_to_time (0, 0, 16000, &time));
+	ck_assert (0 == time);
+	ck_assert (dmap_private_utils_offset_to_time (16000 * 90, 0, 16000, &time));
+	ck_assert (90 * G_GUINT64_CONSTANT (1000000000) == time);
+
+	/* WAV: the 44-byte header precedes the samples. */
+	ck_assert (!dmap_private_utils_offset_to_time (20, 44, byte_rate, &time));
+	ck_assert (dmap_private_utils_offset_to_time (44, 44, byte_rate, &time));
+	ck_assert (0 == time);
+	ck_assert (dmap_private_utils_offset_to_time (44 + byte_rate / 2, 44,
+	                                              byte_rate, &time));
+	ck_assert (500000000 == time);
+
+	/* Four hours of CD audio does not overflow. */
+	ck_assert (dmap_private_utils_offset_to_time (44 + (goffset) byte_rate * 4 * 3600,
+	                                              44, byte_rate, &time));
+	ck_assert (4 * 3600 * G_GUINT64_CONSTANT (1000000000) == time);
+}
+END_TEST
+
+START_TEST(_message_not_modified_test)
+{
+	SoupMessage *message;
+	gchar *etag;
+
+	message = soup_message_new (SOUP_METHOD_GET, "http://localhost/");
+
+	ck_assert (!dmap_private_utils_message_not_modified (message, "a", 0, 0));
+	etag = g_strdup (soup_message_headers_get_one (message->response_headers,
+	                                               "ETag"));
+	ck_assert (NULL != etag);
+
+	soup_message_headers_append (message->request_headers,
+	                             "If-None-Match", etag);
+	ck_assert (dmap_private_utils_message_not_modified (message, "a", 0, 0));
+	ck_assert_int_eq (SOUP_STATUS_NOT_MODIFIED, message->status_code);
+
+	/* A changed entity no longer matches. */
+	ck_assert (!dmap_private_utils_message_not_modified (message, "a", 1, 0));
+
+	g_free (etag);
+	g_object_unref (message);
+}
+END_TEST
+
+START_TEST(_message_not_modified_since_test)
+{
+	SoupMessage *message;
+
+	message = soup_message_new (SOUP_METHOD_GET, "http://localhost/");
+	soup_message_headers_append (message->request_headers,
+	                             "If-Modified-Since",
+	                             "Sun, 06 Nov 1994 08:49:37 GMT");
+
+	ck_assert (dmap_private_utils_message_not_modified (message, "a",
+	                                                    784111777, 60));
+	ck_assert (!dmap_private_utils_message_not_modified (message, "a",
+	                                                     784111778, 60));
+	ck_assert_str_eq ("private, max-age=60",
+	                  soup_message_headers_get_one (message->response_headers,
+	                                                "Cache-Control"));
+
+	g_object_unref (message);
+}
+END_TEST
+
+#include "dmap-private-utils-suite.c"
+
+#endif
@@ -28,6 +28,8 @@
 G_BEGIN_DECLS
 
 #define DMAP_SHARE_CHUNK_SIZE 16384
+#define DMAP_SHARE_ITEM_MAX_AGE 3600	/* Seconds clients may reuse an item */
+#define DMAP_SHARE_CHUNK_RETRY_MS 50	/* Wait before reading a stalled stream */
 
 #if DMAP_HAVE_UNALIGNED_ACCESS
 #define _DMAP_GET(__data, __size, __end) \
@@ -63,10 +65,55 @@ G_BEGIN_DECLS
 	SoupServer *server;
 	GInputStream *stream;
 	GInputStream *original_stream;
+	GOutputStream *tee;	/* If not NULL, receives a copy of each chunk */
+	gboolean eof;		/* Entire stream was read */
+	goffset written;	/* Bytes of the body appended so far */
+	SoupMessage *retry_message;
+	guint retry_id;		/* Pending retry of a read that would block */
 } ChunkData;
 
+/* Fixed-capacity byte FIFO; reads and writes are memcpy's of at most two
+ * contiguous runs. Not thread-safe: callers provide their own locking. */
+typedef struct DmapRingBuffer
+{
+	guint8 *data;
+	gsize capacity;
+	gsize head;	/* Offset of first unread byte */
+	gsize len;	/* Number of unread bytes */
+} DmapRingBuffer;
+
+/* Appends the next chunk of cd->stream to message. A stream that has no
+ * data yet may fail with G_IO_ERROR_WOULD_BLOCK; the message then stays
+ * paused and the read is retried from a timeout, so the main loop is never
+ * blocked waiting for it. */
 void   dmap_private_utils_write_next_chunk (SoupMessage * message, ChunkData * cd);
 void   dmap_private_utils_chunked_message_finished (SoupMessage * message, ChunkData * cd);
 
+/* Returns the modification time of the file at location, or 0. */
+guint64 dmap_private_utils_uri_mtime (const gchar * location);
+
+/* Adds ETag, derived from identity and mtime, Last-Modified (unless mtime
+ * is 0) and Cache-Control (no-cache if max_age is 0) to the response.
+ * Returns TRUE, with the status set to 304, if the request's validators
+ * show the client's copy is current. */
+gboolean dmap_private_utils_message_not_modified (SoupMessage * message,
+                                                  const gchar * identity,
+                                                  guint64 mtime,
+                                                  guint max_age);
+
+/* Maps offset, a byte offset into an encoded stream whose first
+ * header_size bytes are untimed and whose remaining bytes arrive at
+ * byte_rate per second, to stream time in nanoseconds. Returns FALSE for
+ * an offset inside a non-empty header. */
+gboolean dmap_private_utils_offset_to_time (goffset offset,
+                                            gsize header_size,
+                                            guint byte_rate,
+                                            guint64 * time);
+
+void   dmap_private_utils_ring_buffer_init (DmapRingBuffer * ring, gsize capacity);
+void   dmap_private_utils_ring_buffer_clear (DmapRingBuffer * ring);
+gsize  dmap_private_utils_ring_buffer_write (DmapRingBuffer * ring, const guint8 * src, gsize count);
+gsize  dmap_private_utils_ring_buffer_read (DmapRingBuffer * ring, guint8 * dst, gsize count);
+
 G_END_DECLS
 #endif
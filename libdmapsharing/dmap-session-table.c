@@ -0,0 +1,331 @@
+/*
+ * Bounded table of client sessions used by DmapShare
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "dmap-session-table.h"
+
+struct DmapSessionTable
+{
+	guint max_sessions;
+	gint64 idle_timeout;	/* Microseconds; 0 means never */
+	GQueue *lru;		/* _Session, most recently used first */
+	GHashTable *sessions;	/* ID to link in lru */
+};
+
+typedef struct
+{
+	guint32 id;
+	guint8 address[DMAP_SESSION_ADDRESS_MAX];
+	gsize address_len;
+	gint64 last_used;	/* Monotonic time */
+} _Session;
+
+static gboolean
+_expired (DmapSessionTable * table, _Session * session, gint64 now)
+{
+	return 0 != table->idle_timeout
+	    && now - session->last_used > table->idle_timeout;
+}
+
+static void
+_remove_link (DmapSessionTable * table, GList * link)
+{
+	_Session *session = link->data;
+
+	g_hash_table_remove (table->sessions, GUINT_TO_POINTER (session->id));
+	g_queue_delete_link (table->lru, link);
+	g_free (session);
+}
+
+/* Expired sessions gather at the tail, as it holds the least recently
+ * used. Evicts from the tail too until there is room for one more. */
+static void
+_sweep (DmapSessionTable * table, gint64 now)
+{
+	GList *link;
+
+	while (NULL != (link = g_queue_peek_tail_link (table->lru))) {
+		_Session *session = link->data;
+
+		if (_expired (table, session, now)) {
+			g_debug ("Session %u expired", session->id);
+		} else if (0 != table->max_sessions
+		        && g_queue_get_length (table->lru) >= table->max_sessions) {
+			g_debug ("Evicting least recently used session %u",
+			         session->id);
+		} else {
+			break;
+		}
+
+		_remove_link (table, link);
+	}
+}
+
+static guint32
+_create (DmapSessionTable * table,
+         const guint8 * address,
+         gsize address_len,
+         gint64 now)
+{
+	guint32 id;
+	_Session *session;
+
+	g_assert (address_len <= DMAP_SESSION_ADDRESS_MAX);
+
+	_sweep (table, now);
+
+	do {
+		/* Create a unique session ID; 0 is never valid. */
+		id = g_random_int ();
+	} while (0 == id
+	      || NULL != g_hash_table_lookup (table->sessions,
+	                                      GUINT_TO_POINTER (id)));
+
+	g_debug ("Generated session id %u", id);
+
+	session = g_new0 (_Session, 1);
+	session->id = id;
+	memcpy (session->address, address, address_len);
+	session->address_len = address_len;
+	session->last_used = now;
+
+	g_queue_push_head (table->lru, session);
+	g_hash_table_insert (table->sessions, GUINT_TO_POINTER (id),
+	                     table->lru->head);
+
+	return id;
+}
+
+static gboolean
+_validate (DmapSessionTable * table,
+           guint32 id,
+           const guint8 * address,
+           gsize address_len,
+           gint64 now)
+{
+	GList *link;
+	_Session *session;
+	gboolean ok = FALSE;
+
+	link = g_hash_table_lookup (table->sessions, GUINT_TO_POINTER (id));
+	if (NULL == link) {
+		g_warning ("Validation failed: Unable to lookup session id %u",
+		           id);
+		goto done;
+	}
+
+	session = link->data;
+
+	if (_expired (table, session, now)) {
+		g_warning ("Validation failed: Session id %u expired", id);
+		_remove_link (table, link);
+		goto done;
+	}
+
+	if (address_len != session->address_len
+	 || 0 != memcmp (address, session->address, address_len)) {
+		g_warning ("Validation failed: Remote address does not match stored address");
+		goto done;
+	}
+
+	session->last_used = now;
+	g_queue_unlink (table->lru, link);
+	g_queue_push_head_link (table->lru, link);
+
+	ok = TRUE;
+
+done:
+	return ok;
+}
+
+DmapSessionTable *
+dmap_session_table_new (guint max_sessions, guint idle_timeout)
+{
+	DmapSessionTable *table;
+
+	table = g_new0 (DmapSessionTable, 1);
+	table->lru = g_queue_new ();
+	table->sessions = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	dmap_session_table_set_max_sessions (table, max_sessions);
+	dmap_session_table_set_idle_timeout (table, idle_timeout);
+
+	return table;
+}
+
+void
+dmap_session_table_free (DmapSessionTable * table)
+{
+	if (NULL == table) {
+		return;
+	}
+
+	g_hash_table_destroy (table->sessions);
+	g_queue_free_full (table->lru, g_free);
+	g_free (table);
+}
+
+void
+dmap_session_table_set_max_sessions (DmapSessionTable * table,
+                                     guint max_sessions)
+{
+	table->max_sessions = max_sessions;
+}
+
+void
+dmap_session_table_set_idle_timeout (DmapSessionTable * table,
+                                     guint idle_timeout)
+{
+	table->idle_timeout = (gint64) idle_timeout * G_USEC_PER_SEC;
+}
+
+guint32
+dmap_session_table_create (DmapSessionTable * table,
+                           const guint8 * address,
+                           gsize address_len)
+{
+	return _create (table, address, address_len, g_get_monotonic_time ());
+}
+
+gboolean
+dmap_session_table_validate (DmapSessionTable * table,
+                             guint32 id,
+                             const guint8 * address,
+                             gsize address_len)
+{
+	return _validate (table, id, address, address_len,
+	                  g_get_monotonic_time ());
+}
+
+void
+dmap_session_table_remove (DmapSessionTable * table, guint32 id)
+{
+	GList *link;
+
+	link = g_hash_table_lookup (table->sessions, GUINT_TO_POINTER (id));
+	if (NULL != link) {
+		_remove_link (table, link);
+	}
+}
+
+void
+dmap_session_table_remove_all (DmapSessionTable * table)
+{
+	g_hash_table_remove_all (table->sessions);
+	g_queue_free_full (table->lru, g_free);
+	table->lru = g_queue_new ();
+}
+
+guint
+dmap_session_table_count (DmapSessionTable * table)
+{
+	return g_queue_get_length (table->lru);
+}
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+
+static const guint8 _address_a[] = { 192, 168, 1, 1 };
+static const guint8 _address_b[] = { 192, 168, 1, 2 };
+
+START_TEST(_session_table_validate_test)
+{
+	guint32 id;
+	DmapSessionTable *table;
+
+	table = dmap_session_table_new (0, 0);
+
+	id = dmap_session_table_create (table, _address_a, sizeof _address_a);
+	ck_assert_int_eq (1, dmap_session_table_count (table));
+
+	ck_assert (dmap_session_table_validate (table, id, _address_a,
+	                                        sizeof _address_a));
+	ck_assert (!dmap_session_table_validate (table, id, _address_b,
+	                                         sizeof _address_b));
+	ck_assert (!dmap_session_table_validate (table, id + 1, _address_a,
+	                                         sizeof _address_a));
+
+	dmap_session_table_remove (table, id);
+	ck_assert_int_eq (0, dmap_session_table_count (table));
+	ck_assert (!dmap_session_table_validate (table, id, _address_a,
+	                                         sizeof _address_a));
+
+	dmap_session_table_free (table);
+}
+END_TEST
+
+START_TEST(_session_table_lru_test)
+{
+	guint32 id1, id2, id3;
+	DmapSessionTable *table;
+
+	table = dmap_session_table_new (2, 0);
+
+	id1 = _create (table, _address_a, sizeof _address_a, 1);
+	id2 = _create (table, _address_a, sizeof _address_a, 2);
+
+	/* Using id1 leaves id2 the least recently used. */
+	ck_assert (_validate (table, id1, _address_a, sizeof _address_a, 3));
+
+	id3 = _create (table, _address_a, sizeof _address_a, 4);
+	ck_assert_int_eq (2, dmap_session_table_count (table));
+
+	ck_assert (_validate (table, id1, _address_a, sizeof _address_a, 5));
+	ck_assert (!_validate (table, id2, _address_a, sizeof _address_a, 5));
+	ck_assert (_validate (table, id3, _address_a, sizeof _address_a, 5));
+
+	dmap_session_table_free (table);
+}
+END_TEST
+
+START_TEST(_session_table_expire_test)
+{
+	guint32 id1, id2;
+	gint64 timeout = 10 * G_USEC_PER_SEC;
+	DmapSessionTable *table;
+
+	table = dmap_session_table_new (0, 10);
+
+	id1 = _create (table, _address_a, sizeof _address_a, 0);
+	id2 = _create (table, _address_b, sizeof _address_b, 0);
+
+	ck_assert (_validate (table, id2, _address_b, sizeof _address_b,
+	                      timeout));
+
+	/* id1 idle too long; removed on use. */
+	ck_assert (!_validate (table, id1, _address_a, sizeof _address_a,
+	                       timeout + 1));
+	ck_assert_int_eq (1, dmap_session_table_count (table));
+
+	/* id2 swept when another session is created. */
+	_create (table, _address_a, sizeof _address_a, 2 * timeout + 1);
+	ck_assert_int_eq (1, dmap_session_table_count (table));
+	ck_assert (!_validate (table, id2, _address_b, sizeof _address_b,
+	                       2 * timeout + 1));
+
+	dmap_session_table_free (table);
+}
+END_TEST
+
+#include "dmap-session-table-suite.c"
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * Bounded table of client sessions used by DmapShare
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DMAP_SESSION_TABLE_H
+#define _DMAP_SESSION_TABLE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Longest address stored: an IPv6 address in network byte order. */
+#define DMAP_SESSION_ADDRESS_MAX 16
+
+/* Session IDs, each bound to the binary address of the client that logged
+ * in. A session unused for longer than the idle timeout expires. When the
+ * table is full, creating a session evicts the least recently used one.
+ * All operations are O(1), apart from the occasional sweep of expired
+ * sessions, which is amortized over the creations that caused them.
+ */
+typedef struct DmapSessionTable DmapSessionTable;
+
+/* A max_sessions or idle_timeout (seconds) of 0 means unbounded. */
+DmapSessionTable *dmap_session_table_new (guint max_sessions,
+                                          guint idle_timeout);
+void     dmap_session_table_free (DmapSessionTable * table);
+
+void     dmap_session_table_set_max_sessions (DmapSessionTable * table,
+                                              guint max_sessions);
+void     dmap_session_table_set_idle_timeout (DmapSessionTable * table,
+                                              guint idle_timeout);
+
+guint32  dmap_session_table_create (DmapSessionTable * table,
+                                    const guint8 * address,
+                                    gsize address_len);
+
+/* Returns TRUE, and marks the session used, if id is a live session
+ * created from address. */
+gboolean dmap_session_table_validate (DmapSessionTable * table,
+                                      guint32 id,
+                                      const guint8 * address,
+                                      gsize address_len);
+
+void     dmap_session_table_remove (DmapSessionTable * table, guint32 id);
+void     dmap_session_table_remove_all (DmapSessionTable * table);
+
+guint    dmap_session_table_count (DmapSessionTable * table);
+
+G_END_DECLS
+#endif /* _DMAP_SESSION_TABLE_H */
@@ -51,6 +51,12 @@ void dmap_share_message_set_from_dmap_structure (DmapShare * share,
 						  SoupMessage * message,
 						  GNode * structure);
 
+/* Like dmap_share_message_set_from_dmap_structure, but for a structure
+ * already serialized, perhaps once for many messages. */
+void dmap_share_message_set_from_buffer (DmapShare * share,
+					  SoupMessage * message,
+					  SoupBuffer * buffer);
+
 GSList *dmap_share_build_filter (gchar * filterstr);
 
 void dmap_share_login (DmapShare * share,
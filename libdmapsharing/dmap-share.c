@@ -32,6 +32,8 @@
 #include <libdmapsharing/dmap.h>
 #include <libdmapsharing/dmap-share-private.h>
 #include <libdmapsharing/dmap-structure.h>
+#include <libdmapsharing/dmap-session-table.h>
+#include <libdmapsharing/dmap-change-log.h>
 
 #define TYPE_OF_SERVICE "_daap._tcp"
 #define STANDARD_DAAP_PORT 3689
@@ -39,6 +41,11 @@
 #define DMAP_VERSION 2.0
 #define DAAP_VERSION 3.0
 #define DMAP_TIMEOUT 1800
+#define DEFAULT_MAX_SESSIONS 256
+#define UPDATE_COALESCE_MS 250		/* Revision bumps answered together */
+#define UPDATE_TIMEOUT 300		/* Seconds an /update may wait */
+#define UPDATE_MAX_WAITING 64		/* Parked /update requests */
+#define CHANGE_LOG_SIZE 4096		/* Record IDs kept for deltas */
 
 enum
 {
@@ -51,7 +58,10 @@ enum
 	PROP_DB,
 	PROP_CONTAINER_DB,
 	PROP_TRANSCODE_MIMETYPE,
-	PROP_TXT_RECORDS
+	PROP_TXT_RECORDS,
+	PROP_MAX_SESSIONS,
+	PROP_SESSION_TIMEOUT,
+	PROP_SESSION_COUNT
 };
 
 enum
@@ -98,7 +108,19 @@ struct DmapSharePrivate
 	/* TXT-RECORDS published by mDNS */
 	gchar **txt_records;
 
-	GHashTable *session_ids;
+	DmapSessionTable *sessions;
+	guint max_sessions;
+	guint session_timeout;
+
+	/* Parked /update requests, oldest first, and an index by message. */
+	GQueue *update_waiting;
+	GHashTable *update_index;
+	guint update_source;		/* Pending coalesced notification */
+	SoupBuffer *update_mupd;	/* Serialized MUPD for update_revision */
+	guint update_revision;
+
+	/* Created once the application reports its first change. */
+	DmapChangeLog *changes;
 };
 
 typedef void (*ShareBitwiseDestroyFunc) (void *);
@@ -118,6 +140,13 @@ struct share_bitwise_t
 	DmapRecord *(*lookup_by_id) (void *db, guint id);
 
 	void (*destroy) (void *);
+
+	/* Adds the MLIT for one entry; add_entry_to_mlcl unless listing
+	 * containers. */
+	DmapIdRecordFunc add_entry;
+
+	/* Chunks of the last MLIT not yet written. */
+	guint pending;
 };
 
 static void dmap_share_init (DmapShare * share);
@@ -228,7 +257,8 @@ static void
 _session_id_remove (DmapShare * share,
                     guint32 id)
 {
-	g_hash_table_remove (share->priv->session_ids, GUINT_TO_POINTER (id));
+	dmap_session_table_remove (share->priv->sessions, id);
+	g_object_notify (G_OBJECT (share), "session-count");
 }
 
 static void
@@ -297,6 +327,142 @@ done:
 	return ok;
 }
 
+/* Returns the MUPD for the current revision, serialized once and shared
+ * by every response. Owned by share. */
+static SoupBuffer *
+_get_update_mupd (DmapShare * share)
+{
+	/* MUPD update response
+	 *      MSTT status
+	 *      MUSR server revision
+	 */
+	GNode *mupd;
+	gchar *data;
+	guint length;
+
+	if (NULL != share->priv->update_mupd
+	 && share->priv->update_revision == _get_revision_number (share)) {
+		goto done;
+	}
+
+	if (NULL != share->priv->update_mupd) {
+		soup_buffer_free (share->priv->update_mupd);
+	}
+
+	mupd = dmap_structure_add (NULL, DMAP_CC_MUPD);
+	dmap_structure_add (mupd, DMAP_CC_MSTT, (gint32) SOUP_STATUS_OK);
+	dmap_structure_add (mupd, DMAP_CC_MUSR,
+			    (gint32) _get_revision_number (share));
+
+	data = dmap_structure_serialize (mupd, &length);
+	dmap_structure_destroy (mupd);
+
+	share->priv->update_mupd = soup_buffer_new (SOUP_MEMORY_TAKE,
+	                                            data, length);
+	share->priv->update_revision = _get_revision_number (share);
+
+done:
+	return share->priv->update_mupd;
+}
+
+typedef struct {
+	DmapShare *share;
+	SoupMessage *message;
+	guint timeout;
+} UpdateWaiter;
+
+static void _update_finished_cb (SoupMessage * message, UpdateWaiter * waiter);
+
+/* Forgets waiter; if answer, first replies with the current revision. */
+static void
+_update_waiter_free (UpdateWaiter * waiter, gboolean answer)
+{
+	DmapShare *share = waiter->share;
+	GList *link;
+
+	link = g_hash_table_lookup (share->priv->update_index, waiter->message);
+	g_hash_table_remove (share->priv->update_index, waiter->message);
+	g_queue_delete_link (share->priv->update_waiting, link);
+
+	if (0 != waiter->timeout) {
+		g_source_remove (waiter->timeout);
+	}
+	g_signal_handlers_disconnect_by_func (waiter->message,
+	                                      _update_finished_cb,
+	                                      waiter);
+
+	if (answer) {
+		dmap_share_message_set_from_buffer (share, waiter->message,
+		                                    _get_update_mupd (share));
+		soup_server_unpause_message (share->priv->server,
+		                             waiter->message);
+	}
+
+	g_object_unref (waiter->message);
+	g_free (waiter);
+}
+
+static void
+_update_finished_cb (G_GNUC_UNUSED SoupMessage * message,
+                     UpdateWaiter * waiter)
+{
+	/* Client went away while waiting. */
+	_update_waiter_free (waiter, FALSE);
+}
+
+static gboolean
+_update_timeout_cb (UpdateWaiter * waiter)
+{
+	/* Answer with the unchanged revision; the client asks again. */
+	waiter->timeout = 0;
+	_update_waiter_free (waiter, TRUE);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+_update_answer_all (DmapShare * share, gboolean answer)
+{
+	UpdateWaiter *waiter;
+
+	while (NULL != (waiter = g_queue_peek_head (share->priv->update_waiting))) {
+		_update_waiter_free (waiter, answer);
+	}
+}
+
+static gboolean
+_update_notify_cb (DmapShare * share)
+{
+	share->priv->update_source = 0;
+
+	g_debug ("Notifying %u waiting clients of revision %u",
+	         g_queue_get_length (share->priv->update_waiting),
+	         _get_revision_number (share));
+
+	_update_answer_all (share, TRUE);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+_set_revision_number (DmapShare * share, guint revision_number)
+{
+	if (revision_number == share->priv->revision_number) {
+		return;
+	}
+
+	share->priv->revision_number = revision_number;
+
+	/* Several bumps in quick succession wake waiting clients once. */
+	if (0 == share->priv->update_source
+	 && !g_queue_is_empty (share->priv->update_waiting)) {
+		share->priv->update_source =
+			g_timeout_add (UPDATE_COALESCE_MS,
+			               (GSourceFunc) _update_notify_cb,
+			               share);
+	}
+}
+
 static void
 _update (DmapShare * share,
          SoupServer * server,
@@ -306,35 +472,41 @@ _update (DmapShare * share,
 {
 	guint revision_number;
 	gboolean res;
+	UpdateWaiter *waiter;
 
 	g_debug ("Path is %s.", path);
 
 	res = _get_revision_number_from_query (query, &revision_number);
 
 	if (res && revision_number != _get_revision_number (share)) {
-		/* MUPD update response
-		 *      MSTT status
-		 *      MUSR server revision
-		 */
-		GNode *mupd;
-
-		mupd = dmap_structure_add (NULL, DMAP_CC_MUPD);
-		dmap_structure_add (mupd, DMAP_CC_MSTT,
-				    (gint32) SOUP_STATUS_OK);
-		dmap_structure_add (mupd, DMAP_CC_MUSR,
-				    (gint32)
-				    _get_revision_number (share));
+		dmap_share_message_set_from_buffer (share, message,
+		                                    _get_update_mupd (share));
+		goto done;
+	}
 
-		dmap_share_message_set_from_dmap_structure (share, message,
-							     mupd);
-		dmap_structure_destroy (mupd);
-	} else {
-		/* FIXME: This seems like a bug. It just leaks the
-		 * message (and socket) without ever replying.
-		 */
-		g_object_ref (message);
-		soup_server_pause_message (server, message);
+	/* Long poll: reply once the revision changes or on timeout. */
+	if (g_queue_get_length (share->priv->update_waiting) >= UPDATE_MAX_WAITING) {
+		_update_waiter_free (g_queue_peek_head (share->priv->update_waiting),
+		                     TRUE);
 	}
+
+	waiter = g_new0 (UpdateWaiter, 1);
+	waiter->share = share;
+	waiter->message = g_object_ref (message);
+	waiter->timeout = g_timeout_add_seconds (UPDATE_TIMEOUT,
+	                                         (GSourceFunc) _update_timeout_cb,
+	                                         waiter);
+
+	g_queue_push_tail (share->priv->update_waiting, waiter);
+	g_hash_table_insert (share->priv->update_index, message,
+	                     share->priv->update_waiting->tail);
+
+	g_signal_connect (message, "finished",
+	                  G_CALLBACK (_update_finished_cb), waiter);
+	soup_server_pause_message (server, message);
+
+done:
+	return;
 }
 
 static void
@@ -415,12 +587,18 @@ _write_dmap_preamble (SoupMessage * message, GNode * node)
 static void
 _write_next_mlit (SoupMessage * message, struct share_bitwise_t *share_bitwise)
 {
+	/* Queue the next MLIT only once the previous one has gone out. */
+	if (share_bitwise->pending > 1) {
+		share_bitwise->pending--;
+		return;
+	}
+	share_bitwise->pending = 0;
+
 	if (share_bitwise->id_list == NULL) {
 		g_debug ("No more ID's, sending message complete.");
 		soup_message_body_complete (message->response_body);
 	} else {
-		gchar *data = NULL;
-		guint length;
+		GSList *chunks, *iter;
 		DmapRecord *record;
 		struct DmapMlclBits mb = { NULL, 0, NULL };
 
@@ -433,13 +611,26 @@ _write_next_mlit (SoupMessage * message, struct share_bitwise_t *share_bitwise)
 		mb.mlcl = dmap_structure_add (NULL, DMAP_CC_MLCL);
 		mb.share = share_bitwise->mb.share;
 
-		DMAP_SHARE_GET_CLASS (share_bitwise->mb.share)->
-			add_entry_to_mlcl (GPOINTER_TO_UINT(share_bitwise->id_list->data), record, &mb);
-		data = dmap_structure_serialize (g_node_first_child (mb.mlcl),
-						 &length);
+		share_bitwise->add_entry (GPOINTER_TO_UINT (share_bitwise->id_list->data),
+		                          record, &mb);
+		/* Payloads such as DPAP file data are sent without a copy. */
+		chunks = dmap_structure_serialize_chunks (g_node_first_child (mb.mlcl));
+		for (iter = chunks; iter; iter = iter->next) {
+			GBytes *bytes = iter->data;
+			SoupBuffer *buffer;
+
+			buffer = soup_buffer_new_with_owner (g_bytes_get_data (bytes, NULL),
+			                                     g_bytes_get_size (bytes),
+			                                     g_bytes_ref (bytes),
+			                                     (GDestroyNotify) g_bytes_unref);
+			soup_message_body_append_buffer (message->response_body,
+			                                 buffer);
+			soup_buffer_free (buffer);
+
+			share_bitwise->pending++;
+		}
+		g_slist_free_full (chunks, (GDestroyNotify) g_bytes_unref);
 
-		soup_message_body_append (message->response_body,
-					  SOUP_MEMORY_TAKE, data, length);
 		g_debug ("Sending ID %u.",
 			 GPOINTER_TO_UINT (share_bitwise->id_list->data));
 		dmap_structure_destroy (mb.mlcl);
@@ -504,16 +695,15 @@ _accumulate_mlcl_size_and_ids (guint id,
                                DmapRecord * record,
                                struct share_bitwise_t *share_bitwise)
 {
-	share_bitwise->id_list = g_slist_append (share_bitwise->id_list, GUINT_TO_POINTER(id));
+	/* Prepend, then reverse once all are in; see _send_mlcl_streamed. */
+	share_bitwise->id_list = g_slist_prepend (share_bitwise->id_list, GUINT_TO_POINTER(id));
 
 	/* Make copy and set mlcl to NULL so real MLCL does not get changed */
 	struct DmapMlclBits mb_copy = share_bitwise->mb;
 
 	mb_copy.mlcl = dmap_structure_add (NULL, DMAP_CC_MLCL);;
 
-	DMAP_SHARE_GET_CLASS (share_bitwise->mb.share)->add_entry_to_mlcl (id,
-	                                                                   record,
-	                                                                  &mb_copy);
+	share_bitwise->add_entry (id, record, &mb_copy);
 	share_bitwise->size += dmap_structure_get_size (mb_copy.mlcl);
 
 	/* Minus eight because we do not want to add size of MLCL CC field + size field n times,
@@ -543,9 +733,93 @@ _chunked_message_finished (G_GNUC_UNUSED SoupMessage * message,
 	if (share_bitwise->destroy) {
 		share_bitwise->destroy (share_bitwise->db);
 	}
+	g_slist_free (share_bitwise->id_list);
 	g_free (share_bitwise);
 }
 
+static struct share_bitwise_t *
+_share_bitwise_new (DmapShare * share,
+                    struct DmapMlclBits mb,
+                    void *db,
+                    ShareBitwiseLookupByIdFunc lookup_by_id,
+                    ShareBitwiseDestroyFunc destroy)
+{
+	struct share_bitwise_t *share_bitwise;
+
+	share_bitwise = g_new0 (struct share_bitwise_t, 1);
+
+	share_bitwise->share = share;
+	share_bitwise->mb = mb;
+	share_bitwise->id_list = NULL;
+	share_bitwise->size = 0;
+	share_bitwise->db = db;
+	share_bitwise->lookup_by_id = lookup_by_id;
+	share_bitwise->destroy = destroy;
+	share_bitwise->add_entry = DMAP_SHARE_GET_CLASS (share)->add_entry_to_mlcl;
+
+	return share_bitwise;
+}
+
+/* Sends root, a response whose listing is mlcl, followed by one MLIT for
+ * each ID that _accumulate_mlcl_size_and_ids gathered into share_bitwise.
+ * Only one MLIT is in memory at a time. Takes ownership of root and
+ * share_bitwise. */
+static void
+_send_mlcl_streamed (DmapShare * share,
+                     SoupMessage * message,
+                     GNode * root,
+                     GNode * mlcl,
+                     struct share_bitwise_t *share_bitwise)
+{
+	share_bitwise->id_list = g_slist_reverse (share_bitwise->id_list);
+
+	/* Size fudged to cover the MLITs still to come. */
+	dmap_structure_increase_by_predicted_size (root,
+						   share_bitwise->size);
+	dmap_structure_increase_by_predicted_size (mlcl,
+						   share_bitwise->size);
+
+	/* Free memory after each chunk sent out over network. */
+	soup_message_body_set_accumulate (message->response_body,
+					  FALSE);
+	soup_message_headers_append (message->response_headers,
+				     "Content-Type",
+				     "application/x-dmap-tagged");
+	DMAP_SHARE_GET_CLASS (share)->
+		message_add_standard_headers (share, message);
+	soup_message_headers_set_content_length (message->
+						 response_headers,
+						 dmap_structure_get_size
+						 (root));
+	soup_message_set_status (message, SOUP_STATUS_OK);
+
+	g_signal_connect (message, "wrote_headers",
+			  G_CALLBACK (_write_dmap_preamble), root);
+	g_signal_connect (message, "wrote_chunk",
+			  G_CALLBACK (_write_next_mlit),
+			  share_bitwise);
+	g_signal_connect (message, "finished",
+			  G_CALLBACK (_chunked_message_finished),
+			  share_bitwise);
+}
+
+/* Gathers the IDs and MLIT size of records, in the order of ids (a list
+ * of keys of records) if given. */
+static void
+_accumulate_mlcl_size_and_ids_sorted (GHashTable * records,
+                                      GList * ids,
+                                      struct share_bitwise_t *share_bitwise)
+{
+	GList *id;
+
+	for (id = ids; id; id = id->next) {
+		_accumulate_mlcl_size_and_ids (GPOINTER_TO_UINT (id->data),
+		                               g_hash_table_lookup (records,
+		                                                    id->data),
+		                               share_bitwise);
+	}
+}
+
 static DmapBits
 _parse_meta_str (const char *attrs, struct DmapMetaDataMap *mdm)
 {
@@ -599,6 +873,292 @@ done:
 	return bits;
 }
 
+/* Fills changed and deleted with the IDs changed since the revision a
+ * delta request names. Returns FALSE if the request wants, or the change
+ * log can only answer with, a full listing. */
+static gboolean
+_get_delta (DmapShare * share,
+            GHashTable * query,
+            GArray ** changed,
+            GArray ** deleted)
+{
+	const gchar *delta_str;
+	guint delta;
+	gboolean ok = FALSE;
+
+	delta_str = g_hash_table_lookup (query, "delta");
+	if (NULL == delta_str || NULL == share->priv->changes) {
+		goto done;
+	}
+
+	delta = strtoul (delta_str, NULL, 10);
+	if (0 == delta) {
+		goto done;
+	}
+
+	*changed = g_array_new (FALSE, FALSE, sizeof (guint));
+	*deleted = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	ok = dmap_change_log_since (share->priv->changes, delta,
+	                            *changed, *deleted);
+	if (!ok) {
+		g_debug ("Revision %u too old for a delta", delta);
+		g_array_free (*changed, TRUE);
+		g_array_free (*deleted, TRUE);
+		*changed = *deleted = NULL;
+	}
+
+done:
+	return ok;
+}
+
+/* Gathers the changed records into share_bitwise; records, if not NULL,
+ * holds those matching the request's query. A changed record that no
+ * longer exists, or no longer matches, is added to deleted. Returns the
+ * number gathered. */
+static guint
+_accumulate_mlcl_size_and_ids_changed (DmapShare * share,
+                                       GHashTable * records,
+                                       GArray * changed,
+                                       GArray * deleted,
+                                       struct share_bitwise_t *share_bitwise)
+{
+	guint i;
+	guint count = 0;
+
+	for (i = 0; i < changed->len; i++) {
+		guint id = g_array_index (changed, guint, i);
+		DmapRecord *record;
+
+		if (NULL != records) {
+			record = g_hash_table_lookup (records,
+			                              GUINT_TO_POINTER (id));
+		} else {
+			record = dmap_db_lookup_by_id (share->priv->db, id);
+		}
+
+		if (NULL == record) {
+			g_array_append_val (deleted, id);
+			continue;
+		}
+
+		_accumulate_mlcl_size_and_ids (id, record, share_bitwise);
+		count++;
+
+		if (NULL == records) {
+			g_object_unref (record);
+		}
+	}
+
+	return count;
+}
+
+static void
+_databases_containers (DmapShare * share,
+                       SoupMessage * message,
+                       GHashTable * query)
+{
+	/* APLY database playlists
+	 *      MSTT status
+	 *      MUTY update type
+	 *      MTCO specified total count
+	 *      MRCO returned count
+	 *      MLCL listing
+	 *              MLIT listing item
+	 *                      MIID item id
+	 *                      MPER persistent item id
+	 *                      MINM item name
+	 *                      MIMC item count
+	 *                      ABPL baseplaylist (only for base)
+	 *              MLIT
+	 *              ...
+	 */
+	GNode *aply;
+	GNode *mlit;
+	struct DmapMetaDataMap *map;
+	struct DmapMlclBits mb = { NULL, 0, NULL };
+	struct share_bitwise_t *share_bitwise;
+
+	map = DMAP_SHARE_GET_CLASS (share)->get_meta_data_map (share);
+	mb.bits = _parse_meta (query, map);
+	mb.share = share;
+
+	/* Streamed like /1/items; see there. */
+	share_bitwise = _share_bitwise_new (share, mb,
+	                                    share->priv->container_db,
+	                                    (ShareBitwiseLookupByIdFunc)
+	                                    dmap_container_db_lookup_by_id,
+	                                    NULL);
+	share_bitwise->add_entry = (DmapIdRecordFunc) _add_playlist_to_mlcl;
+	dmap_container_db_foreach (share->priv->container_db,
+				   (DmapIdContainerRecordFunc)
+				   _accumulate_mlcl_size_and_ids,
+				   share_bitwise);
+
+	aply = dmap_structure_add (NULL, DMAP_CC_APLY);
+	dmap_structure_add (aply, DMAP_CC_MSTT,
+			    (gint32) SOUP_STATUS_OK);
+	dmap_structure_add (aply, DMAP_CC_MUTY, 0);
+	dmap_structure_add (aply, DMAP_CC_MTCO,
+			    (gint32) dmap_container_db_count (share->
+							      priv->
+							      container_db)
+			    + 1);
+	dmap_structure_add (aply, DMAP_CC_MRCO,
+			    (gint32) dmap_container_db_count (share->
+							      priv->
+							      container_db)
+			    + 1);
+	mb.mlcl = dmap_structure_add (aply, DMAP_CC_MLCL);
+
+	/* Base playlist (playlist 1 contains all songs): */
+	mlit = dmap_structure_add (mb.mlcl, DMAP_CC_MLIT);
+	dmap_structure_add (mlit, DMAP_CC_MIID, (gint32) 1);
+	dmap_structure_add (mlit, DMAP_CC_MPER, (gint64) 1);
+	dmap_structure_add (mlit, DMAP_CC_MINM, share->priv->name);
+	dmap_structure_add (mlit, DMAP_CC_MIMC,
+			    dmap_db_count (share->priv->db));
+	dmap_structure_add (mlit, DMAP_CC_FQUESCH, 0);
+	dmap_structure_add (mlit, DMAP_CC_MPCO, 0);
+	dmap_structure_add (mlit, DMAP_CC_AESP, 0);
+	dmap_structure_add (mlit, DMAP_CC_AEPP, 0);
+	dmap_structure_add (mlit, DMAP_CC_AEPS, 0);
+	dmap_structure_add (mlit, DMAP_CC_AESG, 0);
+
+	dmap_structure_add (mlit, DMAP_CC_ABPL, (gchar) 1);
+
+	/* Base playlist goes out with the preamble. */
+	_send_mlcl_streamed (share, message, aply, mb.mlcl,
+	                     share_bitwise);
+}
+
+/* rest_of_path is /1/containers/N/items. The items of the base playlist,
+ * 1, may be filtered and sorted by query. */
+static void
+_databases_container_items (DmapShare * share,
+                            SoupMessage * message,
+                            const char *rest_of_path,
+                            GHashTable * query)
+{
+	/* APSO playlist songs
+	 *      MSTT status
+	 *      MUTY update type
+	 *      MTCO specified total count
+	 *      MRCO returned count
+	 *      MLCL listing
+	 *              MLIT listing item
+	 *                      MIKD item kind
+	 *                      MIID item id
+	 *                      MCTI container item id
+	 *              MLIT
+	 *              ...
+	 */
+	GNode *apso;
+	struct DmapMetaDataMap *map;
+	struct DmapMlclBits mb = { NULL, 0, NULL };
+	struct share_bitwise_t *share_bitwise;
+	guint pl_id;
+	gchar *record_query;
+	GSList *filter_def;
+	GHashTable *records;
+	gint32 num_songs;
+
+	map = DMAP_SHARE_GET_CLASS (share)->get_meta_data_map (share);
+	mb.bits = _parse_meta (query, map);
+	mb.share = share;
+
+	/* Streamed like /1/items; see there. */
+	if (g_ascii_strcasecmp ("/1/items", rest_of_path + 13) == 0) {
+		gchar *sort_by;
+		GList *keys;
+
+		record_query = g_hash_table_lookup (query, "query");
+		filter_def = dmap_share_build_filter (record_query);
+		records =
+			dmap_db_apply_filter (DMAP_DB
+					      (share->priv->db),
+					      filter_def);
+		num_songs = g_hash_table_size (records);
+
+		g_debug ("Found %d records", num_songs);
+		dmap_share_free_filter (filter_def);
+
+		sort_by = g_hash_table_lookup (query, "sort");
+		keys = g_hash_table_get_keys (records);
+		if (g_strcmp0 (sort_by, "album") == 0) {
+			keys = g_list_sort_with_data (keys,
+						      (GCompareDataFunc)
+						      dmap_av_record_cmp_by_album,
+						      share->priv->
+						      db);
+		} else if (sort_by != NULL) {
+			g_warning ("Unknown sort column: %s",
+				   sort_by);
+		}
+
+		share_bitwise = _share_bitwise_new (share, mb, records,
+		                                    (ShareBitwiseLookupByIdFunc)
+		                                    _lookup_adapter,
+		                                    (ShareBitwiseDestroyFunc)
+		                                    g_hash_table_destroy);
+		_accumulate_mlcl_size_and_ids_sorted (records, keys,
+		                                      share_bitwise);
+
+		g_list_free (keys);
+	} else {
+		pl_id = strtoul (rest_of_path + 14, NULL, 10);
+		if (pl_id == 1) {
+			num_songs = dmap_db_count (share->priv->db);
+
+			share_bitwise = _share_bitwise_new (share, mb,
+			                                    share->priv->db,
+			                                    (ShareBitwiseLookupByIdFunc)
+			                                    dmap_db_lookup_by_id,
+			                                    NULL);
+			dmap_db_foreach (share->priv->db,
+			                (DmapIdRecordFunc)
+			                 _accumulate_mlcl_size_and_ids,
+			                 share_bitwise);
+		} else {
+			DmapContainerRecord *record;
+			DmapDb *entries;
+
+			record = dmap_container_db_lookup_by_id
+				(share->priv->container_db, pl_id);
+			entries =
+				dmap_container_record_get_entries
+				(record);
+			/* FIXME: what if entries is NULL (handled in dmapd but should be [also] handled here)? */
+			num_songs = dmap_db_count (entries);
+
+			/* Entries are unref'd once sent. */
+			share_bitwise = _share_bitwise_new (share, mb,
+			                                    entries,
+			                                    (ShareBitwiseLookupByIdFunc)
+			                                    dmap_db_lookup_by_id,
+			                                    (ShareBitwiseDestroyFunc)
+			                                    g_object_unref);
+			dmap_db_foreach (entries,
+			                (DmapIdRecordFunc)
+			                 _accumulate_mlcl_size_and_ids,
+			                 share_bitwise);
+
+			g_object_unref (record);
+		}
+	}
+
+	apso = dmap_structure_add (NULL, DMAP_CC_APSO);
+	dmap_structure_add (apso, DMAP_CC_MSTT,
+			    (gint32) SOUP_STATUS_OK);
+	dmap_structure_add (apso, DMAP_CC_MUTY, 0);
+	dmap_structure_add (apso, DMAP_CC_MTCO, (gint32) num_songs);
+	dmap_structure_add (apso, DMAP_CC_MRCO, (gint32) num_songs);
+	mb.mlcl = dmap_structure_add (apso, DMAP_CC_MLCL);
+
+	_send_mlcl_streamed (share, message, apso, mb.mlcl,
+	                     share_bitwise);
+}
+
 static void
 _databases (DmapShare * share,
             SoupServer * server,
@@ -756,6 +1316,9 @@ _databases (DmapShare * share,
 		 *      MUTY update type
 		 *      MTCO specified total count
 		 *      MRCO returned count
+		 *      MUDL deleted listing (delta only)
+		 *              MIID item id
+		 *              ...
 		 *      MLCL listing
 		 *              MLIT
 		 *                      attrs
@@ -767,8 +1330,12 @@ _databases (DmapShare * share,
 		GHashTable *records = NULL;
 		struct DmapMetaDataMap *map;
 		gint32 num_songs;
+		gint32 num_returned;
 		struct DmapMlclBits mb = { NULL, 0, NULL };
 		struct share_bitwise_t *share_bitwise;
+		GArray *changed = NULL;
+		GArray *deleted = NULL;
+		gboolean is_delta;
 
 		record_query = g_hash_table_lookup (query, "query");
 		if (record_query) {
@@ -802,268 +1369,90 @@ _databases (DmapShare * share,
 		 * 3. Setup libsoup response headers, etc.
 		 * 4. Setup callback to transmit DAAP preamble (_write_dmap_preamble)
 		 * 5. Setup callback to transmit MLIT's (_write_next_mlit)
+		 *
+		 * A delta request (delta=<client's revision>) gets only the
+		 * records changed since, plus an MUDL of those deleted.
 		 */
 
-		/* 1: */
-		share_bitwise = g_new0 (struct share_bitwise_t, 1);
+		is_delta = _get_delta (share, query, &changed, &deleted);
 
-		share_bitwise->share = share;
-		share_bitwise->mb = mb;
-		share_bitwise->id_list = NULL;
-		share_bitwise->size = 0;
-		if (record_query) {
-			share_bitwise->db = records;
-			share_bitwise->lookup_by_id = (ShareBitwiseLookupByIdFunc)
-				_lookup_adapter;
-			share_bitwise->destroy = (ShareBitwiseDestroyFunc) g_hash_table_destroy;
+		/* 1: */
+		if (is_delta) {
+			if (record_query) {
+				share_bitwise = _share_bitwise_new (share, mb, records,
+				                                    (ShareBitwiseLookupByIdFunc)
+				                                    _lookup_adapter,
+				                                    (ShareBitwiseDestroyFunc)
+				                                    g_hash_table_destroy);
+			} else {
+				share_bitwise = _share_bitwise_new (share, mb, share->priv->db,
+				                                    (ShareBitwiseLookupByIdFunc)
+				                                    dmap_db_lookup_by_id,
+				                                    NULL);
+			}
+			num_returned =
+				_accumulate_mlcl_size_and_ids_changed (share, records,
+				                                       changed, deleted,
+				                                       share_bitwise);
+		} else if (record_query) {
+			share_bitwise = _share_bitwise_new (share, mb, records,
+			                                    (ShareBitwiseLookupByIdFunc)
+			                                    _lookup_adapter,
+			                                    (ShareBitwiseDestroyFunc)
+			                                    g_hash_table_destroy);
 			g_hash_table_foreach (records,
 					     (GHFunc) _accumulate_mlcl_size_and_ids_adapter,
 					      share_bitwise);
 		} else {
-			share_bitwise->db = share->priv->db;
-			share_bitwise->lookup_by_id = (ShareBitwiseLookupByIdFunc) dmap_db_lookup_by_id;
-			share_bitwise->destroy = NULL;
+			share_bitwise = _share_bitwise_new (share, mb, share->priv->db,
+			                                    (ShareBitwiseLookupByIdFunc)
+			                                    dmap_db_lookup_by_id,
+			                                    NULL);
 			dmap_db_foreach (share->priv->db,
 			                (DmapIdRecordFunc) _accumulate_mlcl_size_and_ids,
 					 share_bitwise);
 		}
 
+		if (!is_delta) {
+			num_returned = num_songs;
+		}
+
 		/* 2: */
 		adbs = dmap_structure_add (NULL, DMAP_CC_ADBS);
 		dmap_structure_add (adbs, DMAP_CC_MSTT,
 				    (gint32) SOUP_STATUS_OK);
-		dmap_structure_add (adbs, DMAP_CC_MUTY, 0);
+		dmap_structure_add (adbs, DMAP_CC_MUTY, is_delta ? 1 : 0);
 		dmap_structure_add (adbs, DMAP_CC_MTCO, (gint32) num_songs);
-		dmap_structure_add (adbs, DMAP_CC_MRCO, (gint32) num_songs);
-		mb.mlcl = dmap_structure_add (adbs, DMAP_CC_MLCL);
-		dmap_structure_increase_by_predicted_size (adbs,
-							   share_bitwise->
-							   size);
-		dmap_structure_increase_by_predicted_size (mb.mlcl,
-							   share_bitwise->
-							   size);
-
-		/* 3: */
-		/* Free memory after each chunk sent out over network. */
-		soup_message_body_set_accumulate (message->response_body,
-						  FALSE);
-		soup_message_headers_append (message->response_headers,
-					     "Content-Type",
-					     "application/x-dmap-tagged");
-		DMAP_SHARE_GET_CLASS (share)->
-			message_add_standard_headers (share, message);
-		soup_message_headers_set_content_length (message->
-							 response_headers,
-							 dmap_structure_get_size
-							 (adbs));
-		soup_message_set_status (message, SOUP_STATUS_OK);
-
-		/* 4: */
-		g_signal_connect (message, "wrote_headers",
-				  G_CALLBACK (_write_dmap_preamble), adbs);
-
-		/* 5: */
-		g_signal_connect (message, "wrote_chunk",
-				  G_CALLBACK (_write_next_mlit),
-				  share_bitwise);
-		g_signal_connect (message, "finished",
-				  G_CALLBACK (_chunked_message_finished),
-				  share_bitwise);
-
-	} else if (g_ascii_strcasecmp ("/1/containers", rest_of_path) == 0) {
-		/* APLY database playlists
-		 *      MSTT status
-		 *      MUTY update type
-		 *      MTCO specified total count
-		 *      MRCO returned count
-		 *      MLCL listing
-		 *              MLIT listing item
-		 *                      MIID item id
-		 *                      MPER persistent item id
-		 *                      MINM item name
-		 *                      MIMC item count
-		 *                      ABPL baseplaylist (only for base)
-		 *              MLIT
-		 *              ...
-		 */
-		GNode *aply;
-		GNode *mlit;
-		struct DmapMetaDataMap *map;
-		struct DmapMlclBits mb = { NULL, 0, NULL };
-
-		map = DMAP_SHARE_GET_CLASS (share)->get_meta_data_map (share);
-		mb.bits = _parse_meta (query, map);
-		mb.share = share;
+		dmap_structure_add (adbs, DMAP_CC_MRCO, num_returned);
+
+		if (is_delta) {
+			/* Ahead of MLCL, whose MLITs follow the preamble. */
+			if (deleted->len > 0) {
+				GNode *mudl;
+				guint i;
+
+				mudl = dmap_structure_add (adbs, DMAP_CC_MUDL);
+				for (i = 0; i < deleted->len; i++) {
+					dmap_structure_add (mudl, DMAP_CC_MIID,
+					                    (gint32) g_array_index (deleted, guint, i));
+				}
+			}
 
-		aply = dmap_structure_add (NULL, DMAP_CC_APLY);
-		dmap_structure_add (aply, DMAP_CC_MSTT,
-				    (gint32) SOUP_STATUS_OK);
-		dmap_structure_add (aply, DMAP_CC_MUTY, 0);
-		dmap_structure_add (aply, DMAP_CC_MTCO,
-				    (gint32) dmap_container_db_count (share->
-								      priv->
-								      container_db)
-				    + 1);
-		dmap_structure_add (aply, DMAP_CC_MRCO,
-				    (gint32) dmap_container_db_count (share->
-								      priv->
-								      container_db)
-				    + 1);
-		mb.mlcl = dmap_structure_add (aply, DMAP_CC_MLCL);
-
-		/* Base playlist (playlist 1 contains all songs): */
-		mlit = dmap_structure_add (mb.mlcl, DMAP_CC_MLIT);
-		dmap_structure_add (mlit, DMAP_CC_MIID, (gint32) 1);
-		dmap_structure_add (mlit, DMAP_CC_MPER, (gint64) 1);
-		dmap_structure_add (mlit, DMAP_CC_MINM, share->priv->name);
-		dmap_structure_add (mlit, DMAP_CC_MIMC,
-				    dmap_db_count (share->priv->db));
-		dmap_structure_add (mlit, DMAP_CC_FQUESCH, 0);
-		dmap_structure_add (mlit, DMAP_CC_MPCO, 0);
-		dmap_structure_add (mlit, DMAP_CC_AESP, 0);
-		dmap_structure_add (mlit, DMAP_CC_AEPP, 0);
-		dmap_structure_add (mlit, DMAP_CC_AEPS, 0);
-		dmap_structure_add (mlit, DMAP_CC_AESG, 0);
+			g_array_free (changed, TRUE);
+			g_array_free (deleted, TRUE);
+		}
 
-		dmap_structure_add (mlit, DMAP_CC_ABPL, (gchar) 1);
+		mb.mlcl = dmap_structure_add (adbs, DMAP_CC_MLCL);
 
-		dmap_container_db_foreach (share->priv->container_db,
-					   (DmapIdContainerRecordFunc)
-					   _add_playlist_to_mlcl,
-					   &mb);
+		/* 3, 4 and 5: */
+		_send_mlcl_streamed (share, message, adbs, mb.mlcl,
+		                     share_bitwise);
 
-		dmap_share_message_set_from_dmap_structure (share, message,
-							     aply);
-		dmap_structure_destroy (aply);
+	} else if (g_ascii_strcasecmp ("/1/containers", rest_of_path) == 0) {
+		_databases_containers (share, message, query);
 	} else if (g_ascii_strncasecmp ("/1/containers/", rest_of_path, 14) ==
 		   0) {
-		/* APSO playlist songs
-		 *      MSTT status
-		 *      MUTY update type
-		 *      MTCO specified total count
-		 *      MRCO returned count
-		 *      MLCL listing
-		 *              MLIT listing item
-		 *                      MIKD item kind
-		 *                      MIID item id
-		 *                      MCTI container item id
-		 *              MLIT
-		 *              ...
-		 */
-		GNode *apso;
-		struct DmapMetaDataMap *map;
-		struct DmapMlclBits mb = { NULL, 0, NULL };
-		guint pl_id;
-		gchar *record_query;
-		GSList *filter_def;
-		GHashTable *records;
-
-		map = DMAP_SHARE_GET_CLASS (share)->get_meta_data_map (share);
-		mb.bits = _parse_meta (query, map);
-		mb.share = share;
-
-		apso = dmap_structure_add (NULL, DMAP_CC_APSO);
-		dmap_structure_add (apso, DMAP_CC_MSTT,
-				    (gint32) SOUP_STATUS_OK);
-		dmap_structure_add (apso, DMAP_CC_MUTY, 0);
-
-		if (g_ascii_strcasecmp ("/1/items", rest_of_path + 13) == 0) {
-			GList *id;
-			gchar *sort_by;
-			GList *keys;
-
-			record_query = g_hash_table_lookup (query, "query");
-			filter_def = dmap_share_build_filter (record_query);
-			records =
-				dmap_db_apply_filter (DMAP_DB
-						      (share->priv->db),
-						      filter_def);
-			gint32 num_songs = g_hash_table_size (records);
-
-			g_debug ("Found %d records", num_songs);
-			dmap_share_free_filter (filter_def);
-
-			dmap_structure_add (apso, DMAP_CC_MTCO,
-					    (gint32) num_songs);
-			dmap_structure_add (apso, DMAP_CC_MRCO,
-					    (gint32) num_songs);
-			mb.mlcl = dmap_structure_add (apso, DMAP_CC_MLCL);
-
-			sort_by = g_hash_table_lookup (query, "sort");
-			keys = g_hash_table_get_keys (records);
-			if (g_strcmp0 (sort_by, "album") == 0) {
-				keys = g_list_sort_with_data (keys,
-							      (GCompareDataFunc)
-							      dmap_av_record_cmp_by_album,
-							      share->priv->
-							      db);
-			} else if (sort_by != NULL) {
-				g_warning ("Unknown sort column: %s",
-					   sort_by);
-			}
-
-			for (id = keys; id; id = id->next) {
-				(*
-				 (DMAP_SHARE_GET_CLASS (share)->
-				  add_entry_to_mlcl)) (GPOINTER_TO_UINT(id->data),
-						       g_hash_table_lookup
-						       (records, id->data),
-						       &mb);
-			}
-
-			g_list_free (keys);
-			g_hash_table_destroy (records);
-		} else {
-			pl_id = strtoul (rest_of_path + 14, NULL, 10);
-			if (pl_id == 1) {
-				gint32 num_songs =
-					dmap_db_count (share->priv->db);
-				dmap_structure_add (apso, DMAP_CC_MTCO,
-						    (gint32) num_songs);
-				dmap_structure_add (apso, DMAP_CC_MRCO,
-						    (gint32) num_songs);
-				mb.mlcl =
-					dmap_structure_add (apso,
-							    DMAP_CC_MLCL);
-
-				dmap_db_foreach (share->priv->db,
-						 DMAP_SHARE_GET_CLASS
-						 (share)->add_entry_to_mlcl,
-						 &mb);
-			} else {
-				DmapContainerRecord *record;
-				DmapDb *entries;
-				guint num_songs;
-
-				record = dmap_container_db_lookup_by_id
-					(share->priv->container_db, pl_id);
-				entries =
-					dmap_container_record_get_entries
-					(record);
-				/* FIXME: what if entries is NULL (handled in dmapd but should be [also] handled here)? */
-				num_songs = dmap_db_count (entries);
-
-				dmap_structure_add (apso, DMAP_CC_MTCO,
-						    (gint32) num_songs);
-				dmap_structure_add (apso, DMAP_CC_MRCO,
-						    (gint32) num_songs);
-				mb.mlcl =
-					dmap_structure_add (apso,
-							    DMAP_CC_MLCL);
-
-				dmap_db_foreach (entries,
-						 DMAP_SHARE_GET_CLASS
-						 (share)->add_entry_to_mlcl,
-						 &mb);
-
-				g_object_unref (entries);
-				g_object_unref (record);
-			}
-		}
-
-		dmap_share_message_set_from_dmap_structure (share, message,
-							     apso);
-		dmap_structure_destroy (apso);
+		_databases_container_items (share, message, rest_of_path, query);
 	} else if (g_ascii_strncasecmp ("/1/browse/", rest_of_path, 9) == 0) {
 		DMAP_SHARE_GET_CLASS (share)->databases_browse_xxx (share,
 								    message,
@@ -1326,12 +1715,19 @@ _server_stop (DmapShare * share)
 	g_debug ("Stopping music sharing server on port %d",
 		 share->priv->port);
 
+	/* No one to notify once the server is gone. */
+	if (0 != share->priv->update_source) {
+		g_source_remove (share->priv->update_source);
+		share->priv->update_source = 0;
+	}
+	_update_answer_all (share, FALSE);
+
 	if (share->priv->server) {
 		soup_server_disconnect (share->priv->server);
 	}
 
-	if (share->priv->session_ids) {
-		g_hash_table_remove_all (share->priv->session_ids);
+	if (share->priv->sessions) {
+		dmap_session_table_remove_all (share->priv->sessions);
 	}
 
 	share->priv->server_active = FALSE;
@@ -1455,6 +1851,9 @@ _set_property (GObject * object,
 	case PROP_PASSWORD:
 		_set_password (share, g_value_get_string (value));
 		break;
+	case PROP_REVISION_NUMBER:
+		_set_revision_number (share, g_value_get_uint (value));
+		break;
 	case PROP_DB:
 		if (share->priv->db) {
 			g_object_unref(share->priv->db);
@@ -1475,6 +1874,16 @@ _set_property (GObject * object,
 		g_strfreev (share->priv->txt_records);
 		share->priv->txt_records = g_value_dup_boxed (value);
 		break;
+	case PROP_MAX_SESSIONS:
+		share->priv->max_sessions = g_value_get_uint (value);
+		dmap_session_table_set_max_sessions (share->priv->sessions,
+		                                     share->priv->max_sessions);
+		break;
+	case PROP_SESSION_TIMEOUT:
+		share->priv->session_timeout = g_value_get_uint (value);
+		dmap_session_table_set_idle_timeout (share->priv->sessions,
+		                                     share->priv->session_timeout);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1519,6 +1928,16 @@ _get_property (GObject * object,
 	case PROP_TXT_RECORDS:
 		g_value_set_boxed (value, share->priv->txt_records);
 		break;
+	case PROP_MAX_SESSIONS:
+		g_value_set_uint (value, share->priv->max_sessions);
+		break;
+	case PROP_SESSION_TIMEOUT:
+		g_value_set_uint (value, share->priv->session_timeout);
+		break;
+	case PROP_SESSION_COUNT:
+		g_value_set_uint (value,
+		                  dmap_session_table_count (share->priv->sessions));
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1553,8 +1972,16 @@ _finalize (GObject * object)
 
 	g_debug ("Finalizing DmapShare");
 
-	g_hash_table_destroy (share->priv->session_ids);
-	share->priv->session_ids = NULL;
+	dmap_session_table_free (share->priv->sessions);
+	share->priv->sessions = NULL;
+
+	dmap_change_log_free (share->priv->changes);
+
+	g_queue_free (share->priv->update_waiting);
+	g_hash_table_destroy (share->priv->update_index);
+	if (NULL != share->priv->update_mupd) {
+		soup_buffer_free (share->priv->update_mupd);
+	}
 
 	g_free (share->priv->name);
 	g_free (share->priv->password);
@@ -1671,6 +2098,36 @@ dmap_share_class_init (DmapShareClass * klass)
 							     G_TYPE_STRV,
 							     G_PARAM_READWRITE));
 
+	g_object_class_install_property (object_class,
+					 PROP_MAX_SESSIONS,
+					 g_param_spec_uint ("max-sessions",
+							    "Maximum sessions",
+							    "Sessions kept before evicting the least recently used (0 for no limit)",
+							    0,
+							    G_MAXUINT,
+							    DEFAULT_MAX_SESSIONS,
+							    G_PARAM_READWRITE));
+
+	g_object_class_install_property (object_class,
+					 PROP_SESSION_TIMEOUT,
+					 g_param_spec_uint ("session-timeout",
+							    "Session timeout",
+							    "Seconds a session may go unused before it expires (0 for never)",
+							    0,
+							    G_MAXUINT,
+							    DMAP_TIMEOUT,
+							    G_PARAM_READWRITE));
+
+	g_object_class_install_property (object_class,
+					 PROP_SESSION_COUNT,
+					 g_param_spec_uint ("session-count",
+							    "Session count",
+							    "Number of sessions currently held",
+							    0,
+							    G_MAXUINT,
+							    0,
+							    G_PARAM_READABLE));
+
 	_signals[ERROR] =
 		g_signal_new ("error",
 		               G_TYPE_FROM_CLASS (object_class),
@@ -1690,10 +2147,15 @@ dmap_share_init (DmapShare * share)
 	share->priv->publisher = dmap_mdns_publisher_new ();
 	share->priv->server = soup_server_new (NULL, NULL);
 
-	/* using direct since there is no g_uint_hash or g_uint_equal */
-	share->priv->session_ids =
-		g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
-				       g_free);
+	share->priv->max_sessions = DEFAULT_MAX_SESSIONS;
+	share->priv->session_timeout = DMAP_TIMEOUT;
+	share->priv->sessions =
+		dmap_session_table_new (share->priv->max_sessions,
+		                        share->priv->session_timeout);
+
+	share->priv->update_waiting = g_queue_new ();
+	share->priv->update_index = g_hash_table_new (g_direct_hash,
+	                                              g_direct_equal);
 
 	g_signal_connect_object (share->priv->publisher,
 				 "published",
@@ -1734,6 +2196,33 @@ done:
 	return ok;
 }
 
+/* Writes the binary address of the client to address, which must hold
+ * DMAP_SESSION_ADDRESS_MAX bytes. Returns its length, or 0 if unknown. */
+static gsize
+_client_address (SoupClientContext * context, guint8 * address)
+{
+	gsize len = 0;
+	GSocketAddress *socket_address;
+	GInetAddress *inet_address;
+
+	socket_address = soup_client_context_get_remote_address (context);
+	if (NULL == socket_address
+	 || !G_IS_INET_SOCKET_ADDRESS (socket_address)) {
+		goto done;
+	}
+
+	inet_address = g_inet_socket_address_get_address
+		(G_INET_SOCKET_ADDRESS (socket_address));
+
+	len = g_inet_address_get_native_size (inet_address);
+	g_assert (len <= DMAP_SESSION_ADDRESS_MAX);
+
+	memcpy (address, g_inet_address_to_bytes (inet_address), len);
+
+done:
+	return len;
+}
+
 gboolean
 dmap_share_session_id_validate (DmapShare * share,
                                 SoupClientContext * context,
@@ -1742,8 +2231,8 @@ dmap_share_session_id_validate (DmapShare * share,
 	gboolean ok = FALSE;
 	guint32 session_id;
 	gboolean res;
-	const char *addr;
-	const char *remote_address;
+	gsize address_len;
+	guint8 address[DMAP_SESSION_ADDRESS_MAX];
 
 	if (id) {
 		*id = 0;
@@ -1755,22 +2244,17 @@ dmap_share_session_id_validate (DmapShare * share,
 		goto done;
 	}
 
-	/* check hash for remote address */
-	addr = g_hash_table_lookup (share->priv->session_ids,
-				    GUINT_TO_POINTER (session_id));
-	if (addr == NULL) {
-		g_warning
-			("Validation failed: Unable to lookup session id %u",
-			 session_id);
+	address_len = _client_address (context, address);
+	if (0 == address_len) {
+		g_warning ("Validation failed: Unable to get remote address");
 		goto done;
 	}
 
-	remote_address = soup_client_context_get_host (context);
-	g_debug ("Validating session id %u from %s matches %s",
-		 session_id, remote_address, addr);
-	if (remote_address == NULL || strcmp (addr, remote_address) != 0) {
-		g_warning
-			("Validation failed: Remote address does not match stored address");
+	g_debug ("Validating session id %u", session_id);
+	if (!dmap_session_table_validate (share->priv->sessions, session_id,
+	                                  address, address_len)) {
+		/* Might have expired. */
+		g_object_notify (G_OBJECT (share), "session-count");
 		goto done;
 	}
 
@@ -1785,40 +2269,18 @@ done:
 }
 
 static guint32
-_session_id_generate (void)
+_session_id_create (DmapShare * share, SoupClientContext * context)
 {
 	guint32 id;
+	gsize address_len;
+	guint8 address[DMAP_SESSION_ADDRESS_MAX];
 
-	id = g_random_int ();
+	/* An unknown address is stored as empty, and so never validates. */
+	address_len = _client_address (context, address);
 
-	return id;
-}
-
-static guint32
-_session_id_create (DmapShare * share, SoupClientContext * context)
-{
-	guint32 id;
-	const char *addr;
-	char *remote_address;
-
-	do {
-		/* create a unique session id */
-		id = _session_id_generate ();
-		g_debug ("Generated session id %u", id);
-
-		/* if already used, try again */
-		addr = g_hash_table_lookup (share->priv->session_ids,
-					    GUINT_TO_POINTER (id));
-	} while (addr != NULL);
-
-	/* store session id and remote address */
-	/* FIXME, warning, this fails against libsoup-2.33.90-1.fc15.x86_64 with:
-	 * (dmapd:12917): libsoup-CRITICAL **: soup_address_get_physical: assertion `SOUP_IS_ADDRESS (addr)' failed
-	 * Is this a bug in libsoup or libdmapsharing?
-	 */
-	remote_address = g_strdup (soup_client_context_get_host (context));
-	g_hash_table_insert (share->priv->session_ids, GUINT_TO_POINTER (id),
-			     remote_address);
+	id = dmap_session_table_create (share->priv->sessions,
+	                                address, address_len);
+	g_object_notify (G_OBJECT (share), "session-count");
 
 	return id;
 }
@@ -1847,6 +2309,25 @@ dmap_share_message_set_from_dmap_structure (DmapShare * share,
 	soup_message_set_status (message, SOUP_STATUS_OK);
 }
 
+void
+dmap_share_message_set_from_buffer (DmapShare * share,
+				     SoupMessage * message,
+				     SoupBuffer * buffer)
+{
+	soup_message_headers_set_content_type (message->response_headers,
+					       "application/x-dmap-tagged",
+					       NULL);
+
+	/* Takes a reference; buffer may be shared between messages. */
+	soup_message_body_truncate (message->response_body);
+	soup_message_body_append_buffer (message->response_body, buffer);
+
+	DMAP_SHARE_GET_CLASS (share)->message_add_standard_headers (share,
+								    message);
+
+	soup_message_set_status (message, SOUP_STATUS_OK);
+}
+
 gboolean
 dmap_share_client_requested (DmapBits bits, gint field)
 {
@@ -2122,3 +2603,446 @@ dmap_share_emit_error(DmapShare *share, gint code, const gchar *format, ...)
 
 	va_end(ap);
 }
+
+static void
+_record_change (DmapShare * share, guint id, gboolean deleted)
+{
+	if (NULL == share->priv->changes) {
+		share->priv->changes =
+			dmap_change_log_new (_get_revision_number (share),
+			                     CHANGE_LOG_SIZE);
+	}
+
+	dmap_change_log_record (share->priv->changes, id,
+	                        _get_revision_number (share), deleted);
+}
+
+void
+dmap_share_record_changed (DmapShare * share, guint id)
+{
+	_record_change (share, id, FALSE);
+}
+
+void
+dmap_share_record_deleted (DmapShare * share, guint id)
+{
+	_record_change (share, id, TRUE);
+}
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+#include <libdmapsharing/test-dmap-db.h>
+#include <libdmapsharing/test-dmap-av-record.h>
+#include <libdmapsharing/test-dmap-container-db.h>
+#include <libdmapsharing/test-dmap-container-record.h>
+
+static DmapRecord *
+_record_test (const gchar *artist, const gchar *album)
+{
+	DmapRecord *record;
+
+	record = DMAP_RECORD (test_dmap_av_record_new ());
+	g_object_set (record, "songartist", artist,
+	                      "songalbum", album,
+	                      "title", album, NULL);
+
+	return record;
+}
+
+static DmapShare *
+_build_share_test (void)
+{
+	DmapDb *db, *entries;
+	DmapContainerRecord *container_record;
+	DmapContainerDb *container_db;
+	DmapRecord *record;
+	DmapShare *share;
+
+	db = DMAP_DB (test_dmap_db_new ());
+	container_record = DMAP_CONTAINER_RECORD (test_dmap_container_record_new ());
+	container_db = DMAP_CONTAINER_DB (test_dmap_container_db_new (container_record));
+
+	/* Out of album order, so that sorting shows. */
+	record = _record_test ("artist1", "b");
+	dmap_db_add (db, record, NULL);
+	g_object_unref (record);
+
+	record = _record_test ("artist2", "c");
+	dmap_db_add (db, record, NULL);
+	g_object_unref (record);
+
+	record = _record_test ("artist1", "a");
+	dmap_db_add (db, record, NULL);
+
+	entries = dmap_container_record_get_entries (container_record);
+	dmap_db_add (entries, record, NULL);
+	g_object_unref (entries);
+	g_object_unref (record);
+
+	share = DMAP_SHARE (dmap_av_share_new ("test", NULL, db,
+	                                       container_db, NULL));
+
+	g_object_unref (db);
+	g_object_unref (container_record);
+	g_object_unref (container_db);
+
+	return share;
+}
+
+/* Drives a streamed response as SoupServer would and returns its body. */
+static GBytes *
+_streamed_body (SoupMessage *message)
+{
+	guint i;
+	goffset length;
+	SoupBuffer *buffer;
+	GBytes *body;
+
+	ck_assert_int_eq (SOUP_STATUS_OK, message->status_code);
+	length = soup_message_headers_get_content_length (message->response_headers);
+
+	g_signal_emit_by_name (message, "wrote_headers", NULL);
+
+	for (i = 0; i < 1000 && message->response_body->length < length; i++) {
+		g_signal_emit_by_name (message, "wrote_chunk", NULL);
+	}
+	ck_assert_int_eq (length, message->response_body->length);
+
+	soup_message_body_set_accumulate (message->response_body, TRUE);
+	buffer = soup_message_body_flatten (message->response_body);
+	body = g_bytes_new (buffer->data, buffer->length);
+	soup_buffer_free (buffer);
+
+	g_signal_emit_by_name (message, "finished", NULL);
+
+	return body;
+}
+
+static void
+_assert_body_eq (GBytes *body, GNode *expected)
+{
+	gchar *data;
+	guint length;
+
+	data = dmap_structure_serialize (expected, &length);
+	ck_assert_int_eq (length, g_bytes_get_size (body));
+	ck_assert (0 == memcmp (data, g_bytes_get_data (body, NULL), length));
+
+	g_free (data);
+	dmap_structure_destroy (expected);
+}
+
+/* Listing header as the tree-built responses had it. */
+static GNode *
+_listing_test (int cc, gint32 count, struct DmapMlclBits *mb)
+{
+	GNode *root;
+
+	root = dmap_structure_add (NULL, cc);
+	dmap_structure_add (root, DMAP_CC_MSTT, (gint32) SOUP_STATUS_OK);
+	dmap_structure_add (root, DMAP_CC_MUTY, 0);
+	dmap_structure_add (root, DMAP_CC_MTCO, count);
+	dmap_structure_add (root, DMAP_CC_MRCO, count);
+	mb->mlcl = dmap_structure_add (root, DMAP_CC_MLCL);
+
+	return root;
+}
+
+static GHashTable *
+_query_test (const gchar *meta, const gchar *query, const gchar *sort)
+{
+	GHashTable *ht = g_hash_table_new (g_str_hash, g_str_equal);
+
+	g_hash_table_insert (ht, "meta", (gpointer) meta);
+	if (NULL != query) {
+		g_hash_table_insert (ht, "query", (gpointer) query);
+	}
+	if (NULL != sort) {
+		g_hash_table_insert (ht, "sort", (gpointer) sort);
+	}
+
+	return ht;
+}
+
+static struct DmapMlclBits
+_mb_test (DmapShare *share, GHashTable *query)
+{
+	struct DmapMlclBits mb = { NULL, 0, share };
+
+	mb.bits = _parse_meta (query,
+	                       DMAP_SHARE_GET_CLASS (share)->get_meta_data_map (share));
+
+	return mb;
+}
+
+START_TEST(_databases_containers_streamed_test)
+{
+	GNode *expected, *mlit;
+	GBytes *body;
+	GHashTable *query;
+	SoupMessage *message;
+	DmapShare *share;
+	struct DmapMlclBits mb;
+
+	share = _build_share_test ();
+	query = _query_test ("dmap.itemid,dmap.itemname,dmap.persistentid", NULL, NULL);
+	message = soup_message_new (SOUP_METHOD_GET, "http://test/");
+
+	_databases_containers (share, message, query);
+	body = _streamed_body (message);
+
+	mb = _mb_test (share, query);
+	expected = _listing_test (DMAP_CC_APLY,
+	                          dmap_container_db_count (share->priv->container_db) + 1,
+	                         &mb);
+	mlit = dmap_structure_add (mb.mlcl, DMAP_CC_MLIT);
+	dmap_structure_add (mlit, DMAP_CC_MIID, (gint32) 1);
+	dmap_structure_add (mlit, DMAP_CC_MPER, (gint64) 1);
+	dmap_structure_add (mlit, DMAP_CC_MINM, share->priv->name);
+	dmap_structure_add (mlit, DMAP_CC_MIMC, dmap_db_count (share->priv->db));
+	dmap_structure_add (mlit, DMAP_CC_FQUESCH, 0);
+	dmap_structure_add (mlit, DMAP_CC_MPCO, 0);
+	dmap_structure_add (mlit, DMAP_CC_AESP, 0);
+	dmap_structure_add (mlit, DMAP_CC_AEPP, 0);
+	dmap_structure_add (mlit, DMAP_CC_AEPS, 0);
+	dmap_structure_add (mlit, DMAP_CC_AESG, 0);
+	dmap_structure_add (mlit, DMAP_CC_ABPL, (gchar) 1);
+	dmap_container_db_foreach (share->priv->container_db,
+	                           (DmapIdContainerRecordFunc) _add_playlist_to_mlcl,
+	                          &mb);
+
+	_assert_body_eq (body, expected);
+
+	g_bytes_unref (body);
+	g_hash_table_destroy (query);
+	g_object_unref (message);
+	g_object_unref (share);
+}
+END_TEST
+
+START_TEST(_databases_container_items_streamed_test)
+{
+	GNode *expected;
+	GBytes *body;
+	GHashTable *query;
+	SoupMessage *message;
+	DmapShare *share;
+	DmapContainerRecord *record;
+	DmapDb *entries;
+	struct DmapMlclBits mb;
+
+	share = _build_share_test ();
+	query = _query_test ("dmap.itemid,dmap.itemname,daap.songalbum", NULL, NULL);
+
+	/* The base playlist. */
+	message = soup_message_new (SOUP_METHOD_GET, "http://test/");
+	_databases_container_items (share, message, "/1/containers/1/items", query);
+	body = _streamed_body (message);
+
+	mb = _mb_test (share, query);
+	expected = _listing_test (DMAP_CC_APSO, dmap_db_count (share->priv->db), &mb);
+	dmap_db_foreach (share->priv->db,
+	                 DMAP_SHARE_GET_CLASS (share)->add_entry_to_mlcl, &mb);
+	_assert_body_eq (body, expected);
+
+	g_bytes_unref (body);
+	g_object_unref (message);
+
+	/* Any other playlist. */
+	message = soup_message_new (SOUP_METHOD_GET, "http://test/");
+	_databases_container_items (share, message, "/1/containers/2/items", query);
+	body = _streamed_body (message);
+
+	record = dmap_container_db_lookup_by_id (share->priv->container_db, 2);
+	entries = dmap_container_record_get_entries (record);
+	ck_assert_int_eq (1, dmap_db_count (entries));
+
+	expected = _listing_test (DMAP_CC_APSO, dmap_db_count (entries), &mb);
+	dmap_db_foreach (entries,
+	                 DMAP_SHARE_GET_CLASS (share)->add_entry_to_mlcl, &mb);
+	_assert_body_eq (body, expected);
+
+	g_object_unref (entries);
+	g_object_unref (record);
+	g_bytes_unref (body);
+	g_object_unref (message);
+	g_hash_table_destroy (query);
+	g_object_unref (share);
+}
+END_TEST
+
+static void
+_assert_album_eq (const gchar *expected, DmapRecord *record)
+{
+	gchar *album;
+
+	g_object_get (record, "songalbum", &album, NULL);
+	ck_assert_str_eq (expected, album);
+	g_free (album);
+}
+
+START_TEST(_databases_container_items_filtered_streamed_test)
+{
+	GNode *expected;
+	GBytes *body;
+	GList *keys, *iter;
+	GSList *filter_def;
+	GHashTable *query, *records;
+	SoupMessage *message;
+	DmapShare *share;
+	struct DmapMlclBits mb;
+	const gchar *filter = "'daap.songartist:artist1'";
+
+	share = _build_share_test ();
+	query = _query_test ("dmap.itemid,dmap.itemname,daap.songalbum",
+	                     filter, "album");
+
+	message = soup_message_new (SOUP_METHOD_GET, "http://test/");
+	_databases_container_items (share, message, "/1/containers/1/items", query);
+	body = _streamed_body (message);
+
+	filter_def = dmap_share_build_filter ((gchar *) filter);
+	records = dmap_db_apply_filter (share->priv->db, filter_def);
+	dmap_share_free_filter (filter_def);
+	ck_assert_int_eq (2, g_hash_table_size (records));
+
+	keys = g_hash_table_get_keys (records);
+	keys = g_list_sort_with_data (keys,
+	                              (GCompareDataFunc) dmap_av_record_cmp_by_album,
+	                              share->priv->db);
+	_assert_album_eq ("a", g_hash_table_lookup (records, keys->data));
+	_assert_album_eq ("b", g_hash_table_lookup (records, keys->next->data));
+
+	mb = _mb_test (share, query);
+	expected = _listing_test (DMAP_CC_APSO, g_hash_table_size (records), &mb);
+	for (iter = keys; iter; iter = iter->next) {
+		DMAP_SHARE_GET_CLASS (share)->add_entry_to_mlcl
+			(GPOINTER_TO_UINT (iter->data),
+			 g_hash_table_lookup (records, iter->data), &mb);
+	}
+	_assert_body_eq (body, expected);
+
+	g_list_free (keys);
+	g_hash_table_destroy (records);
+	g_bytes_unref (body);
+	g_object_unref (message);
+	g_hash_table_destroy (query);
+	g_object_unref (share);
+}
+END_TEST
+
+static SoupMessage *
+_update_test (DmapShare *share)
+{
+	gchar *revision;
+	GHashTable *query;
+	SoupMessage *message;
+
+	revision = g_strdup_printf ("%u", _get_revision_number (share));
+	query = g_hash_table_new (g_str_hash, g_str_equal);
+	g_hash_table_insert (query, "revision-number", revision);
+
+	message = soup_message_new (SOUP_METHOD_GET, "http://test/update");
+	_update (share, share->priv->server, message, "/update", query);
+
+	g_hash_table_destroy (query);
+	g_free (revision);
+
+	return message;
+}
+
+static void
+_update_wait_notify_test (DmapShare *share)
+{
+	while (0 != share->priv->update_source) {
+		g_main_context_iteration (NULL, TRUE);
+	}
+}
+
+START_TEST(_update_answer_once_test)
+{
+	guint i;
+	DmapShare *share;
+	SoupMessage *messages[3];
+
+	share = _build_share_test ();
+
+	for (i = 0; i < G_N_ELEMENTS (messages); i++) {
+		messages[i] = _update_test (share);
+		ck_assert_int_eq (SOUP_STATUS_NONE, messages[i]->status_code);
+	}
+	ck_assert_int_eq (G_N_ELEMENTS (messages),
+	                  g_queue_get_length (share->priv->update_waiting));
+
+	/* Two bumps in quick succession are answered together. */
+	g_object_set (share, "revision-number", _get_revision_number (share) + 1, NULL);
+	g_object_set (share, "revision-number", _get_revision_number (share) + 1, NULL);
+	_update_wait_notify_test (share);
+
+	ck_assert (g_queue_is_empty (share->priv->update_waiting));
+	ck_assert_int_eq (0, g_hash_table_size (share->priv->update_index));
+
+	for (i = 0; i < G_N_ELEMENTS (messages); i++) {
+		ck_assert_int_eq (SOUP_STATUS_OK, messages[i]->status_code);
+		ck_assert_int_eq (share->priv->update_mupd->length,
+		                  messages[i]->response_body->length);
+		soup_message_set_status (messages[i], SOUP_STATUS_NONE);
+	}
+
+	/* Answered waiters are no longer parked. */
+	g_object_set (share, "revision-number", _get_revision_number (share) + 1, NULL);
+	ck_assert_int_eq (0, share->priv->update_source);
+
+	for (i = 0; i < G_N_ELEMENTS (messages); i++) {
+		ck_assert_int_eq (SOUP_STATUS_NONE, messages[i]->status_code);
+		g_object_unref (messages[i]);
+	}
+
+	g_object_unref (share);
+}
+END_TEST
+
+START_TEST(_update_max_waiting_test)
+{
+	guint i;
+	DmapShare *share;
+	SoupMessage *messages[UPDATE_MAX_WAITING + 1];
+
+	share = _build_share_test ();
+
+	for (i = 0; i < UPDATE_MAX_WAITING; i++) {
+		messages[i] = _update_test (share);
+	}
+	ck_assert_int_eq (UPDATE_MAX_WAITING,
+	                  g_queue_get_length (share->priv->update_waiting));
+
+	/* One more answers the oldest to make room. */
+	messages[UPDATE_MAX_WAITING] = _update_test (share);
+	ck_assert_int_eq (UPDATE_MAX_WAITING,
+	                  g_queue_get_length (share->priv->update_waiting));
+	ck_assert_int_eq (SOUP_STATUS_OK, messages[0]->status_code);
+	ck_assert (NULL == g_hash_table_lookup (share->priv->update_index,
+	                                        messages[0]));
+
+	for (i = 1; i < G_N_ELEMENTS (messages); i++) {
+		ck_assert_int_eq (SOUP_STATUS_NONE, messages[i]->status_code);
+		ck_assert (NULL != g_hash_table_lookup (share->priv->update_index,
+		                                        messages[i]));
+
+		/* As if the client went away. */
+		g_signal_emit_by_name (messages[i], "finished", NULL);
+	}
+	ck_assert (g_queue_is_empty (share->priv->update_waiting));
+
+	for (i = 0; i < G_N_ELEMENTS (messages); i++) {
+		g_object_unref (messages[i]);
+	}
+
+	g_object_unref (share);
+}
+END_TEST
+
+#include "dmap-share-suite.c"
+
+#endif
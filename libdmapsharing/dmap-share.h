@@ -224,6 +224,28 @@ void dmap_share_free_filter (GSList * filter);
  */
 void dmap_share_emit_error(DmapShare *share, gint code, const gchar *format, ...);
 
+/**
+ * dmap_share_record_changed:
+ * @share: a #DmapShare instance.
+ * @id: the ID of the record added or modified.
+ *
+ * Note a change to the share's database ahead of the next bump of
+ * #DmapShare:revision-number, so that clients can fetch just the changes.
+ * Once called, every later change must be reported this way or through
+ * dmap_share_record_deleted().
+ */
+void dmap_share_record_changed (DmapShare *share, guint id);
+
+/**
+ * dmap_share_record_deleted:
+ * @share: a #DmapShare instance.
+ * @id: the ID of the record removed.
+ *
+ * Note a removal from the share's database; see
+ * dmap_share_record_changed().
+ */
+void dmap_share_record_deleted (DmapShare *share, guint id);
+
 #endif /* _DMAP_SHARE_H */
 
 G_END_DECLS
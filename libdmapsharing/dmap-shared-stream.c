@@ -0,0 +1,497 @@
+/*
+ * Single source stream read by several concurrent readers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "dmap-shared-stream.h"
+#include "dmap-private-utils.h"
+
+#define JOIN_WINDOW  (1024 * 1024)		/* Bytes read before joining closes */
+#define MAX_RETAINED (32 * 1024 * 1024)	/* Bytes held for slow readers */
+
+struct DmapSharedStream
+{
+	GInputStream *source;
+	GInputStream *original_source;
+	GQueue *chunks;		/* GBytes, in order */
+	goffset base;		/* Offset of first byte in chunks */
+	goffset produced;	/* Bytes read from source */
+	gboolean eof;
+	GError *error;		/* Error reading source, if any */
+	GSList *subscribers;
+	GDestroyNotify notify;
+	gpointer user_data;
+};
+
+#define DMAP_TYPE_SHARED_INPUT_STREAM (_shared_input_stream_get_type ())
+#define DMAP_SHARED_INPUT_STREAM(o)   (G_TYPE_CHECK_INSTANCE_CAST ((o), \
+                                       DMAP_TYPE_SHARED_INPUT_STREAM, \
+                                       DmapSharedInputStream))
+
+typedef struct
+{
+	GInputStream parent;
+	DmapSharedStream *shared;
+	goffset pos;
+	gboolean overrun;	/* Fell more than MAX_RETAINED behind */
+} DmapSharedInputStream;
+
+typedef struct
+{
+	GInputStreamClass parent;
+} DmapSharedInputStreamClass;
+
+static GType _shared_input_stream_get_type (void);
+
+G_DEFINE_TYPE (DmapSharedInputStream, _shared_input_stream, G_TYPE_INPUT_STREAM);
+
+static void
+_trim (DmapSharedStream * shared)
+{
+	GSList *iter;
+	GBytes *chunk;
+	goffset min = shared->produced;
+
+	for (iter = shared->subscribers; iter; iter = iter->next) {
+		DmapSharedInputStream *sub = iter->data;
+
+		if (!sub->overrun && sub->pos < min) {
+			min = sub->pos;
+		}
+	}
+
+	/* Hold the beginning for readers that might still join. */
+	if (0 == shared->base && shared->produced < JOIN_WINDOW) {
+		return;
+	}
+
+	while (NULL != (chunk = g_queue_peek_head (shared->chunks))
+	    && shared->base + (goffset) g_bytes_get_size (chunk) <= min) {
+		shared->base += g_bytes_get_size (chunk);
+		g_bytes_unref (g_queue_pop_head (shared->chunks));
+	}
+}
+
+static void
+_mark_overrun (DmapSharedStream * shared)
+{
+	GSList *iter;
+
+	for (iter = shared->subscribers; iter; iter = iter->next) {
+		DmapSharedInputStream *sub = iter->data;
+
+		if (shared->produced - sub->pos > MAX_RETAINED) {
+			sub->overrun = TRUE;
+		}
+	}
+}
+
+static gboolean
+_produce (DmapSharedStream * shared)
+{
+	gssize read_size;
+	gchar *data;
+	GError *error = NULL;
+
+	data = g_malloc (DMAP_SHARE_CHUNK_SIZE);
+
+	read_size = g_input_stream_read (shared->source, data,
+	                                 DMAP_SHARE_CHUNK_SIZE, NULL, &error);
+	if (read_size < 0
+	 && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+		/* Nothing decoded yet; a reader will ask again. */
+		g_error_free (error);
+		g_free (data);
+		goto done;
+	}
+
+	if (read_size <= 0) {
+		g_free (data);
+		shared->eof = TRUE;
+		shared->error = error;
+		goto done;
+	}
+
+	g_queue_push_tail (shared->chunks, g_bytes_new_take (data, read_size));
+	shared->produced += read_size;
+
+	_mark_overrun (shared);
+	_trim (shared);
+
+done:
+	return read_size > 0;
+}
+
+static gssize
+_read (GInputStream * stream,
+       void *buffer,
+       gsize count,
+       G_GNUC_UNUSED GCancellable * cancellable,
+       GError ** error)
+{
+	gssize nread = 0;
+	goffset offset;
+	GList *iter;
+	DmapSharedInputStream *sub = DMAP_SHARED_INPUT_STREAM (stream);
+	DmapSharedStream *shared = sub->shared;
+
+	if (sub->overrun) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		             "Fell too far behind other readers of shared stream");
+		nread = -1;
+		goto done;
+	}
+
+	/* The reader furthest ahead reads the source for everyone. */
+	if (sub->pos == shared->produced && !shared->eof) {
+		_produce (shared);
+	}
+
+	if (sub->pos == shared->produced && NULL != shared->error) {
+		g_set_error_literal (error, shared->error->domain,
+		                     shared->error->code,
+		                     shared->error->message);
+		nread = -1;
+		goto done;
+	}
+
+	if (sub->pos == shared->produced && !shared->eof) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+		                     "No data available yet");
+		nread = -1;
+		goto done;
+	}
+
+	offset = shared->base;
+	for (iter = shared->chunks->head; iter && (gsize) nread < count; iter = iter->next) {
+		gsize size, start, n;
+		const guint8 *data;
+
+		data = g_bytes_get_data (iter->data, &size);
+
+		if (offset + (goffset) size > sub->pos) {
+			start = sub->pos - offset;
+			n = MIN (size - start, count - nread);
+			memcpy ((guint8 *) buffer + nread, data + start, n);
+			nread += n;
+			sub->pos += n;
+		}
+
+		offset += size;
+	}
+
+	_trim (shared);
+
+done:
+	return nread;
+}
+
+static void
+_shared_stream_free (DmapSharedStream * shared)
+{
+	g_input_stream_close (shared->source, NULL, NULL);
+	g_object_unref (shared->source);
+
+	if (NULL != shared->original_source) {
+		g_input_stream_close (shared->original_source, NULL, NULL);
+		g_object_unref (shared->original_source);
+	}
+
+	g_queue_free_full (shared->chunks, (GDestroyNotify) g_bytes_unref);
+	g_clear_error (&shared->error);
+
+	if (NULL != shared->notify) {
+		shared->notify (shared->user_data);
+	}
+
+	g_free (shared);
+}
+
+static gboolean
+_close (GInputStream * stream,
+        G_GNUC_UNUSED GCancellable * cancellable,
+        G_GNUC_UNUSED GError ** error)
+{
+	DmapSharedInputStream *sub = DMAP_SHARED_INPUT_STREAM (stream);
+	DmapSharedStream *shared = sub->shared;
+
+	shared->subscribers = g_slist_remove (shared->subscribers, sub);
+	sub->shared = NULL;
+
+	if (NULL == shared->subscribers) {
+		_shared_stream_free (shared);
+	} else {
+		_trim (shared);
+	}
+
+	return TRUE;
+}
+
+static void
+_shared_input_stream_class_init (DmapSharedInputStreamClass * klass)
+{
+	GInputStreamClass *istream_class = G_INPUT_STREAM_CLASS (klass);
+
+	istream_class->read_fn = _read;
+	istream_class->close_fn = _close;
+}
+
+static void
+_shared_input_stream_init (G_GNUC_UNUSED DmapSharedInputStream * stream)
+{
+}
+
+DmapSharedStream *
+dmap_shared_stream_new (GInputStream * source,
+                        GInputStream * original_source,
+                        GDestroyNotify notify,
+                        gpointer user_data)
+{
+	DmapSharedStream *shared;
+
+	shared = g_new0 (DmapSharedStream, 1);
+	shared->source = source;
+	shared->original_source = original_source;
+	shared->chunks = g_queue_new ();
+	shared->notify = notify;
+	shared->user_data = user_data;
+
+	return shared;
+}
+
+gboolean
+dmap_shared_stream_joinable (DmapSharedStream * shared)
+{
+	return 0 == shared->base
+	    && shared->produced < JOIN_WINDOW
+	    && NULL == shared->error;
+}
+
+GInputStream *
+dmap_shared_stream_subscribe (DmapSharedStream * shared)
+{
+	DmapSharedInputStream *sub = NULL;
+
+	if (!dmap_shared_stream_joinable (shared)) {
+		goto done;
+	}
+
+	sub = g_object_new (DMAP_TYPE_SHARED_INPUT_STREAM, NULL);
+	sub->shared = shared;
+	sub->pos = 0;
+
+	shared->subscribers = g_slist_prepend (shared->subscribers, sub);
+
+done:
+	return G_INPUT_STREAM (sub);
+}
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+
+static GInputStream *
+_memory_stream_test (gsize size)
+{
+	gsize i;
+	guint8 *data = g_malloc (size);
+
+	for (i = 0; i < size; i++) {
+		data[i] = i & 0xff;
+	}
+
+	return g_memory_input_stream_new_from_data (data, size, g_free);
+}
+
+static void
+_notify_test (gpointer user_data)
+{
+	*(gboolean *) user_data = TRUE;
+}
+
+START_TEST(_shared_stream_two_readers_test)
+{
+	const gsize size = DMAP_SHARE_CHUNK_SIZE * 3 + 7;
+	guint8 *out1, *out2;
+	gsize n1, n2;
+	gboolean notified = FALSE;
+	GInputStream *source, *sub1, *sub2;
+	DmapSharedStream *shared;
+
+	source = _memory_stream_test (size);
+	shared = dmap_shared_stream_new (source, NULL, _notify_test, &notified);
+
+	sub1 = dmap_shared_stream_subscribe (shared);
+	ck_assert (NULL != sub1);
+
+	out1 = g_malloc (size);
+	out2 = g_malloc (size);
+
+	/* sub1 leads; sub2 joins late and catches up from held data. */
+	ck_assert (g_input_stream_read_all (sub1, out1, 100, &n1, NULL, NULL));
+	ck_assert_int_eq (100, n1);
+
+	sub2 = dmap_shared_stream_subscribe (shared);
+	ck_assert (NULL != sub2);
+
+	ck_assert (g_input_stream_read_all (sub1, out1 + 100, size - 100, &n1, NULL, NULL));
+	ck_assert_int_eq (size - 100, n1);
+	ck_assert (g_input_stream_read_all (sub2, out2, size, &n2, NULL, NULL));
+	ck_assert_int_eq (size, n2);
+
+	ck_assert (0 == memcmp (out1, out2, size));
+	ck_assert_int_eq (0, out1[0]);
+	ck_assert_int_eq ((size - 1) & 0xff, out1[size - 1]);
+
+	g_input_stream_close (sub1, NULL, NULL);
+	ck_assert (!notified);
+	g_input_stream_close (sub2, NULL, NULL);
+	ck_assert (notified);
+
+	g_object_unref (sub1);
+	g_object_unref (sub2);
+	g_free (out1);
+	g_free (out2);
+}
+END_TEST
+
+START_TEST(_shared_stream_join_window_test)
+{
+	const gsize size = JOIN_WINDOW + DMAP_SHARE_CHUNK_SIZE * 2;
+	guint8 *out;
+	gsize n;
+	GInputStream *source, *sub1, *sub2;
+	DmapSharedStream *shared;
+
+	source = _memory_stream_test (size);
+	shared = dmap_shared_stream_new (source, NULL, NULL, NULL);
+
+	sub1 = dmap_shared_stream_subscribe (shared);
+
+	out = g_malloc (size);
+	ck_assert (g_input_stream_read_all (sub1, out, size, &n, NULL, NULL));
+	ck_assert (!dmap_shared_stream_joinable (shared));
+
+	sub2 = dmap_shared_stream_subscribe (shared);
+	ck_assert (NULL == sub2);
+
+	g_input_stream_close (sub1, NULL, NULL);
+	g_object_unref (sub1);
+	g_free (out);
+}
+END_TEST
+
+/* Fails every other read with G_IO_ERROR_WOULD_BLOCK, as a transcode
+ * stream does while its pipeline has nothing decoded yet. */
+typedef struct
+{
+	GFilterInputStream parent;
+	gboolean stall;
+} _StallingStream;
+
+typedef struct
+{
+	GFilterInputStreamClass parent;
+} _StallingStreamClass;
+
+static GType _stalling_stream_get_type (void);
+
+G_DEFINE_TYPE (_StallingStream, _stalling_stream, G_TYPE_FILTER_INPUT_STREAM);
+
+static gssize
+_stalling_stream_read (GInputStream * stream, void *buffer, gsize count,
+                       GCancellable * cancellable, GError ** error)
+{
+	gssize nread = -1;
+	_StallingStream *stalling = (_StallingStream *) stream;
+
+	stalling->stall = !stalling->stall;
+	if (stalling->stall) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+		                     "Stalled");
+		goto done;
+	}
+
+	nread = g_input_stream_read (G_FILTER_INPUT_STREAM (stream)->base_stream,
+	                             buffer, count, cancellable, error);
+
+done:
+	return nread;
+}
+
+static void
+_stalling_stream_class_init (_StallingStreamClass * klass)
+{
+	G_INPUT_STREAM_CLASS (klass)->read_fn = _stalling_stream_read;
+}
+
+static void
+_stalling_stream_init (G_GNUC_UNUSED _StallingStream * stream)
+{
+}
+
+START_TEST(_shared_stream_would_block_test)
+{
+	const gsize size = DMAP_SHARE_CHUNK_SIZE * 2 + 7;
+	guint8 *out;
+	gsize n = 0;
+	gssize nread;
+	guint stalls = 0;
+	GError *error = NULL;
+	GInputStream *memory, *source, *sub;
+	DmapSharedStream *shared;
+
+	memory = _memory_stream_test (size);
+	source = g_object_new (_stalling_stream_get_type (),
+	                       "base-stream", memory, NULL);
+	g_object_unref (memory);
+
+	shared = dmap_shared_stream_new (source, NULL, NULL, NULL);
+	sub = dmap_shared_stream_subscribe (shared);
+
+	out = g_malloc (size);
+
+	/* A stall is passed on to the reader, but is not sticky. */
+	while (0 != (nread = g_input_stream_read (sub, out + n, size - n,
+	                                          NULL, &error))) {
+		if (nread < 0) {
+			ck_assert (g_error_matches (error, G_IO_ERROR,
+			                            G_IO_ERROR_WOULD_BLOCK));
+			g_clear_error (&error);
+			stalls++;
+			continue;
+		}
+
+		n += nread;
+	}
+
+	ck_assert_int_eq (size, n);
+	ck_assert (stalls > 0);
+	ck_assert_int_eq ((size - 1) & 0xff, out[size - 1]);
+
+	g_input_stream_close (sub, NULL, NULL);
+	g_object_unref (sub);
+	g_free (out);
+}
+END_TEST
+
+#include "dmap-shared-stream-suite.c"
+
+#endif
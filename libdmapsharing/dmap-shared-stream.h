@@ -0,0 +1,50 @@
+/*
+ * Single source stream read by several concurrent readers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DMAP_SHARED_STREAM_H
+#define _DMAP_SHARED_STREAM_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* A DmapSharedStream reads its source once, on demand of whichever
+ * subscriber is furthest ahead, and keeps what it read until every
+ * subscriber has passed it. Each subscriber is a GInputStream with its own
+ * position. New subscribers start at offset 0, so may only join while the
+ * beginning of the source is still held. A subscriber that falls too far
+ * behind the others gets an error rather than letting the buffer grow
+ * without bound. Not thread-safe.
+ */
+typedef struct DmapSharedStream DmapSharedStream;
+
+/* Takes ownership of source and original_source (which may be NULL);
+ * both are closed once the last subscriber closes, after which notify
+ * is called with user_data and the DmapSharedStream is freed. */
+DmapSharedStream *dmap_shared_stream_new (GInputStream * source,
+                                          GInputStream * original_source,
+                                          GDestroyNotify notify,
+                                          gpointer user_data);
+
+gboolean      dmap_shared_stream_joinable (DmapSharedStream * shared);
+
+/* Returns NULL if the stream is no longer joinable. */
+GInputStream *dmap_shared_stream_subscribe (DmapSharedStream * shared);
+
+G_END_DECLS
+#endif /* _DMAP_SHARED_STREAM_H */
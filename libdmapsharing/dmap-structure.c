@@ -18,6 +18,8 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA*
  */
 
+#include "config.h"
+
 #include "dmap-error.h"
 #include "dmap-structure.h"
 #include "dmap-private-utils.h"
@@ -413,11 +415,9 @@ _cc_gtype (DmapContentCode code, GError **error)
 	return type;
 }
 
-static gboolean
-_node_serialize (GNode * node, GByteArray * array)
+static void
+_node_serialize_header (DmapStructureItem * item, GByteArray * array)
 {
-	DmapStructureItem *item = node->data;
-	DmapType dmap_type;
 	guint32 size = GINT32_TO_BE (item->size);
 
 	if (item->content_code != DMAP_RAW) {
@@ -428,6 +428,15 @@ _node_serialize (GNode * node, GByteArray * array)
 				     4);
 		g_byte_array_append (array, (const guint8 *) &size, 4);
 	}
+}
+
+static gboolean
+_node_serialize (GNode * node, GByteArray * array)
+{
+	DmapStructureItem *item = node->data;
+	DmapType dmap_type;
+
+	_node_serialize_header (item, array);
 
 	dmap_type = _cc_dmap_type (item->content_code, NULL);
 
@@ -495,8 +504,14 @@ _node_serialize (GNode * node, GByteArray * array)
 			break;
 		}
 	case DMAP_TYPE_POINTER:{
-			const gpointer *data =
-				g_value_get_pointer (&(item->content));
+			gconstpointer data;
+
+			if (G_VALUE_HOLDS (&(item->content), G_TYPE_BYTES)) {
+				data = g_bytes_get_data (g_value_get_boxed
+				                         (&(item->content)), NULL);
+			} else {
+				data = g_value_get_pointer (&(item->content));
+			}
 
 			g_byte_array_append (array, (const guint8 *) data,
 					     item->size);
@@ -533,6 +548,59 @@ dmap_structure_serialize (GNode * structure, guint * length)
 	return data;
 }
 
+typedef struct
+{
+	GByteArray *array;	/* Serialized since the last payload */
+	GSList *chunks;		/* GBytes, last first */
+} _Chunks;
+
+static void
+_chunks_flush (_Chunks * chunks)
+{
+	if (chunks->array->len > 0) {
+		chunks->chunks = g_slist_prepend (chunks->chunks,
+		                                  g_byte_array_free_to_bytes (chunks->array));
+		chunks->array = g_byte_array_new ();
+	}
+}
+
+static gboolean
+_node_serialize_chunk (GNode * node, _Chunks * chunks)
+{
+	DmapStructureItem *item = node->data;
+
+	if (_cc_dmap_type (item->content_code, NULL) == DMAP_TYPE_POINTER
+	 && G_VALUE_HOLDS (&(item->content), G_TYPE_BYTES)) {
+		_node_serialize_header (item, chunks->array);
+		if (item->size > 0) {
+			_chunks_flush (chunks);
+			chunks->chunks = g_slist_prepend (chunks->chunks,
+			                                  g_value_dup_boxed (&(item->content)));
+		}
+	} else {
+		_node_serialize (node, chunks->array);
+	}
+
+	return FALSE;
+}
+
+GSList *
+dmap_structure_serialize_chunks (GNode * structure)
+{
+	_Chunks chunks = { g_byte_array_new (), NULL };
+
+	if (structure) {
+		g_node_traverse (structure, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+				 (GNodeTraverseFunc)
+				 _node_serialize_chunk, &chunks);
+	}
+
+	_chunks_flush (&chunks);
+	g_byte_array_unref (chunks.array);
+
+	return g_slist_reverse (chunks.chunks);
+}
+
 static DmapContentCode
 _cc_read_from_buffer (const gchar * buf, GError **error)
 {
@@ -906,6 +974,35 @@ dmap_structure_add (GNode * parent, DmapContentCode cc, ...)
 	return node;
 }
 
+GNode *
+dmap_structure_add_bytes (GNode * parent, DmapContentCode cc, GBytes * bytes)
+{
+	GNode *node = NULL;
+	DmapStructureItem *item;
+
+	g_assert (_cc_dmap_type (cc, NULL) == DMAP_TYPE_POINTER);
+
+	/* The size travels as a signed 32-bit value; see dmap_structure_add. */
+	if (g_bytes_get_size (bytes) > G_MAXINT) {
+		g_warning ("Payload of %" G_GSIZE_FORMAT " bytes is too large",
+		           g_bytes_get_size (bytes));
+		goto done;
+	}
+
+	node = dmap_structure_add (parent, cc,
+	                           g_bytes_get_data (bytes, NULL),
+	                           (gint) g_bytes_get_size (bytes));
+
+	/* Hold a reference in place of the bare pointer. */
+	item = node->data;
+	g_value_unset (&(item->content));
+	g_value_init (&(item->content), G_TYPE_BYTES);
+	g_value_set_boxed (&(item->content), bytes);
+
+done:
+	return node;
+}
+
 GNode *
 dmap_structure_find_node (GNode * structure, DmapContentCode code)
 {
@@ -1036,3 +1133,106 @@ dmap_structure_increase_by_predicted_size (GNode * structure, guint size)
 {
 	((DmapStructureItem *) structure->data)->size += size;
 }
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+
+static GNode *
+_build_tree_test (GBytes *payload)
+{
+	GNode *mlcl, *mlit;
+	GBytes *empty;
+
+	empty = g_bytes_new (NULL, 0);
+
+	mlcl = dmap_structure_add (NULL, DMAP_CC_MLCL);
+
+	mlit = dmap_structure_add (mlcl, DMAP_CC_MLIT);
+	dmap_structure_add (mlit, DMAP_CC_MIID, 1);
+	dmap_structure_add (mlit, DMAP_CC_MINM, "first");
+	dmap_structure_add_bytes (mlit, DMAP_CC_PFDT, payload);
+
+	/* Empty payloads add no chunk of their own. */
+	mlit = dmap_structure_add (mlcl, DMAP_CC_MLIT);
+	dmap_structure_add (mlit, DMAP_CC_MIID, 2);
+	dmap_structure_add_bytes (mlit, DMAP_CC_PFDT, empty);
+	dmap_structure_add (mlit, DMAP_CC_MINM, "second");
+
+	g_bytes_unref (empty);
+
+	return mlcl;
+}
+
+START_TEST(_serialize_chunks_test)
+{
+	guint length, i;
+	gchar *data;
+	guint8 buf[300];
+	gboolean referenced = FALSE;
+	GByteArray *joined;
+	GSList *chunks, *iter;
+	GBytes *payload;
+	GNode *root;
+
+	for (i = 0; i < sizeof buf; i++) {
+		buf[i] = i & 0xff;
+	}
+	payload = g_bytes_new (buf, sizeof buf);
+
+	root = _build_tree_test (payload);
+
+	data = dmap_structure_serialize (root, &length);
+	ck_assert_int_eq (length, dmap_structure_get_size (root));
+
+	joined = g_byte_array_new ();
+	chunks = dmap_structure_serialize_chunks (root);
+	for (iter = chunks; iter; iter = iter->next) {
+		gsize size;
+		gconstpointer chunk = g_bytes_get_data (iter->data, &size);
+
+		ck_assert (size > 0);
+		g_byte_array_append (joined, chunk, size);
+
+		if (chunk == g_bytes_get_data (payload, NULL)) {
+			referenced = TRUE;
+		}
+	}
+
+	ck_assert_int_eq (length, joined->len);
+	ck_assert (0 == memcmp (data, joined->data, length));
+	ck_assert (referenced);
+
+	g_slist_free_full (chunks, (GDestroyNotify) g_bytes_unref);
+	g_byte_array_unref (joined);
+	g_free (data);
+	dmap_structure_destroy (root);
+	g_bytes_unref (payload);
+}
+END_TEST
+
+START_TEST(_add_bytes_too_large_test)
+{
+	static const guint8 buf[1];
+	guint size;
+	GBytes *payload;
+	GNode *mlit;
+
+	/* Never read, so need not be backed by that much memory. */
+	payload = g_bytes_new_static (buf, (gsize) G_MAXINT + 1);
+
+	mlit = dmap_structure_add (NULL, DMAP_CC_MLIT);
+	size = dmap_structure_get_size (mlit);
+
+	ck_assert (NULL == dmap_structure_add_bytes (mlit, DMAP_CC_PFDT, payload));
+	ck_assert (NULL == g_node_first_child (mlit));
+	ck_assert_int_eq (size, dmap_structure_get_size (mlit));
+
+	dmap_structure_destroy (mlit);
+	g_bytes_unref (payload);
+}
+END_TEST
+
+#include "dmap-structure-suite.c"
+
+#endif
@@ -36,7 +36,14 @@ struct _DmapStructureItem
 };
 
 GNode *dmap_structure_add (GNode * parent, DmapContentCode cc, ...);
+/* Adds a DMAP_TYPE_POINTER item whose payload is referenced, not copied.
+ * Returns NULL, adding nothing, if bytes is larger than G_MAXINT. */
+GNode *dmap_structure_add_bytes (GNode * parent, DmapContentCode cc,
+                                 GBytes * bytes);
 gchar *dmap_structure_serialize (GNode * structure, guint * length);
+/* Serializes structure as a list of non-empty GBytes, with the payloads
+ * added by dmap_structure_add_bytes referenced rather than copied. */
+GSList *dmap_structure_serialize_chunks (GNode * structure);
 GNode *dmap_structure_parse (const guint8 * buf, gsize buf_length, GError **error);
 DmapStructureItem *dmap_structure_find_item (GNode * structure,
 					     DmapContentCode code);
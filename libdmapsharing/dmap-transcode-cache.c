@@ -0,0 +1,556 @@
+/*
+ * On-disk cache of transcoded media used by DmapAvShare
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "dmap-transcode-cache.h"
+
+#define PARTIAL_SUFFIX ".part"
+
+struct DmapTranscodeCache
+{
+	gint refcount;
+	GFile *dir;
+	guint64 max_size;	/* Bytes; 0 means unbounded */
+	guint64 total;		/* Bytes in all entries */
+	GQueue lru;		/* _CacheEntry, least recently used first */
+	GHashTable *entries;	/* Key to link in lru */
+};
+
+typedef struct
+{
+	gchar *key;
+	guint64 size;
+	guint64 mtime;		/* Only used to order the initial scan */
+} _CacheEntry;
+
+static GFile *
+_partial_file (DmapTranscodeCache * cache, const gchar * key)
+{
+	GFile *file;
+	gchar *name;
+
+	name = g_strconcat (key, PARTIAL_SUFFIX, NULL);
+	file = g_file_get_child (cache->dir, name);
+	g_free (name);
+
+	return file;
+}
+
+static void
+_touch (GFile * file)
+{
+	GError *error = NULL;
+
+	if (!g_file_set_attribute_uint64 (file,
+	                                  G_FILE_ATTRIBUTE_TIME_MODIFIED,
+	                                  g_get_real_time () / G_USEC_PER_SEC,
+	                                  G_FILE_QUERY_INFO_NONE,
+	                                  NULL,
+	                                 &error)) {
+		g_debug ("Could not update transcode cache entry time: %s",
+		         error->message);
+		g_error_free (error);
+	}
+}
+
+static gint
+_entry_cmp_by_mtime (gconstpointer a, gconstpointer b, G_GNUC_UNUSED gpointer user_data)
+{
+	const _CacheEntry *entry_a = a;
+	const _CacheEntry *entry_b = b;
+
+	return entry_a->mtime < entry_b->mtime ? -1
+	     : entry_a->mtime > entry_b->mtime ?  1 : 0;
+}
+
+static void
+_entry_free (_CacheEntry * entry)
+{
+	g_free (entry->key);
+	g_free (entry);
+}
+
+/* Adds a newly stored entry as the most recently used. */
+static void
+_index_add (DmapTranscodeCache * cache, const gchar * key, guint64 size)
+{
+	_CacheEntry *entry = g_new0 (_CacheEntry, 1);
+
+	entry->key = g_strdup (key);
+	entry->size = size;
+
+	g_queue_push_tail (&cache->lru, entry);
+	g_hash_table_insert (cache->entries, entry->key, cache->lru.tail);
+	cache->total += size;
+}
+
+static void
+_index_remove (DmapTranscodeCache * cache, GList * link)
+{
+	_CacheEntry *entry = link->data;
+
+	cache->total -= entry->size;
+	g_hash_table_remove (cache->entries, entry->key);
+	g_queue_delete_link (&cache->lru, link);
+	_entry_free (entry);
+}
+
+/* Remove least recently used entries until the cache fits in max_size. */
+static void
+_evict (DmapTranscodeCache * cache)
+{
+	if (0 == cache->max_size) {
+		goto done;
+	}
+
+	while (cache->total > cache->max_size && NULL != cache->lru.head) {
+		_CacheEntry *entry = cache->lru.head->data;
+		GFile *file = g_file_get_child (cache->dir, entry->key);
+
+		if (g_file_delete (file, NULL, NULL)) {
+			g_debug ("Evicted transcode cache entry of %" G_GUINT64_FORMAT
+			         " bytes", entry->size);
+		}
+
+		/* Forget it either way, or we would retry it forever. */
+		_index_remove (cache, cache->lru.head);
+		g_object_unref (file);
+	}
+
+done:
+	return;
+}
+
+/* Builds the index from the directory, using modification times as the
+ * order of last use, and removes partial entries. Run once, when the
+ * cache is created; the index is kept up to date after that. */
+static void
+_scan (DmapTranscodeCache * cache)
+{
+	GList *iter;
+	GFileInfo *info;
+	GFileEnumerator *enumerator;
+	GError *error = NULL;
+
+	enumerator = g_file_enumerate_children (cache->dir,
+	                                        G_FILE_ATTRIBUTE_STANDARD_NAME ","
+	                                        G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+	                                        G_FILE_ATTRIBUTE_TIME_MODIFIED,
+	                                        G_FILE_QUERY_INFO_NONE,
+	                                        NULL,
+	                                       &error);
+	if (NULL == enumerator) {
+		g_warning ("Could not read transcode cache: %s", error->message);
+		g_error_free (error);
+		goto done;
+	}
+
+	while (NULL != (info = g_file_enumerator_next_file (enumerator, NULL, NULL))) {
+		const gchar *name = g_file_info_get_name (info);
+
+		if (g_str_has_suffix (name, PARTIAL_SUFFIX)) {
+			/* Left behind by transcodes interrupted by an exit. */
+			GFile *file = g_file_get_child (cache->dir, name);
+			g_file_delete (file, NULL, NULL);
+			g_object_unref (file);
+		} else {
+			_CacheEntry *entry = g_new (_CacheEntry, 1);
+
+			entry->key   = g_strdup (name);
+			entry->size  = g_file_info_get_size (info);
+			entry->mtime = g_file_info_get_attribute_uint64
+			                   (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+
+			g_queue_push_tail (&cache->lru, entry);
+			cache->total += entry->size;
+		}
+
+		g_object_unref (info);
+	}
+
+	g_object_unref (enumerator);
+
+	g_queue_sort (&cache->lru, _entry_cmp_by_mtime, NULL);
+
+	for (iter = cache->lru.head; iter; iter = iter->next) {
+		_CacheEntry *entry = iter->data;
+		g_hash_table_insert (cache->entries, entry->key, iter);
+	}
+
+	_evict (cache);
+
+done:
+	return;
+}
+
+DmapTranscodeCache *
+dmap_transcode_cache_new (const gchar * dir, guint64 max_size)
+{
+	DmapTranscodeCache *cache = NULL;
+
+	if (g_mkdir_with_parents (dir, 0700) != 0) {
+		g_warning ("Could not create transcode cache directory %s", dir);
+		goto done;
+	}
+
+	cache = g_new0 (DmapTranscodeCache, 1);
+	cache->refcount = 1;
+	cache->dir = g_file_new_for_path (dir);
+	cache->max_size = max_size;
+	cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+	g_queue_init (&cache->lru);
+
+	_scan (cache);
+
+done:
+	return cache;
+}
+
+DmapTranscodeCache *
+dmap_transcode_cache_ref (DmapTranscodeCache * cache)
+{
+	g_atomic_int_inc (&cache->refcount);
+
+	return cache;
+}
+
+void
+dmap_transcode_cache_unref (DmapTranscodeCache * cache)
+{
+	if (NULL == cache || !g_atomic_int_dec_and_test (&cache->refcount)) {
+		return;
+	}
+
+	g_hash_table_destroy (cache->entries);
+	g_queue_foreach (&cache->lru, (GFunc) _entry_free, NULL);
+	g_queue_clear (&cache->lru);
+	g_object_unref (cache->dir);
+	g_free (cache);
+}
+
+gchar *
+dmap_transcode_cache_key (const gchar * location, const gchar * mimetype)
+{
+	gchar *key = NULL;
+	gchar *material = NULL;
+	guint64 mtime;
+	GFile *file = NULL;
+	GFileInfo *info = NULL;
+
+	file = g_file_new_for_uri (location);
+
+	info = g_file_query_info (file,
+	                          G_FILE_ATTRIBUTE_TIME_MODIFIED,
+	                          G_FILE_QUERY_INFO_NONE,
+	                          NULL,
+	                          NULL);
+	if (NULL == info) {
+		goto done;
+	}
+
+	mtime = g_file_info_get_attribute_uint64 (info,
+	                                          G_FILE_ATTRIBUTE_TIME_MODIFIED);
+
+	material = g_strdup_printf ("%s\n%" G_GUINT64_FORMAT "\n%s",
+	                            location, mtime, mimetype);
+	key = g_compute_checksum_for_string (G_CHECKSUM_SHA1, material, -1);
+
+done:
+	if (NULL != info) {
+		g_object_unref (info);
+	}
+
+	g_object_unref (file);
+	g_free (material);
+
+	return key;
+}
+
+GFile *
+dmap_transcode_cache_lookup (DmapTranscodeCache * cache,
+                             const gchar * key,
+                             guint64 * size)
+{
+	GList *link;
+	GFile *file = NULL;
+	_CacheEntry *entry;
+
+	link = g_hash_table_lookup (cache->entries, key);
+	if (NULL == link) {
+		goto done;
+	}
+
+	entry = link->data;
+	file = g_file_get_child (cache->dir, key);
+
+	if (!g_file_query_exists (file, NULL)) {
+		/* Removed behind our back. */
+		_index_remove (cache, link);
+		g_clear_object (&file);
+		goto done;
+	}
+
+	*size = entry->size;
+
+	g_queue_unlink (&cache->lru, link);
+	g_queue_push_tail_link (&cache->lru, link);
+
+	/* Keeps the order of use across restarts; see _scan. */
+	_touch (file);
+
+done:
+	return file;
+}
+
+GOutputStream *
+dmap_transcode_cache_store_begin (DmapTranscodeCache * cache,
+                                  const gchar * key)
+{
+	GFile *file;
+	GFileOutputStream *stream;
+
+	file = _partial_file (cache, key);
+
+	/* Fails if another request is already storing this entry. */
+	stream = g_file_create (file, G_FILE_CREATE_PRIVATE, NULL, NULL);
+
+	g_object_unref (file);
+
+	return G_OUTPUT_STREAM (stream);
+}
+
+void
+dmap_transcode_cache_store_end (DmapTranscodeCache * cache,
+                                const gchar * key,
+                                GOutputStream * stream,
+                                gboolean complete)
+{
+	GList *link;
+	GFile *partial, *file = NULL;
+	GFileInfo *info = NULL;
+	GError *error = NULL;
+
+	partial = _partial_file (cache, key);
+
+	if (NULL != stream) {
+		if (!g_output_stream_close (stream, NULL, &error)) {
+			g_warning ("Error closing transcode cache entry: %s",
+			           error->message);
+			g_clear_error (&error);
+			complete = FALSE;
+		}
+	} else {
+		complete = FALSE;
+	}
+
+	if (!complete) {
+		g_file_delete (partial, NULL, NULL);
+		goto done;
+	}
+
+	info = g_file_query_info (partial,
+	                          G_FILE_ATTRIBUTE_STANDARD_SIZE,
+	                          G_FILE_QUERY_INFO_NONE,
+	                          NULL,
+	                         &error);
+	if (NULL == info) {
+		g_warning ("Error storing transcode cache entry: %s",
+		           error->message);
+		g_error_free (error);
+		g_file_delete (partial, NULL, NULL);
+		goto done;
+	}
+
+	file = g_file_get_child (cache->dir, key);
+
+	if (!g_file_move (partial, file, G_FILE_COPY_OVERWRITE,
+	                  NULL, NULL, NULL, &error)) {
+		g_warning ("Error storing transcode cache entry: %s",
+		           error->message);
+		g_error_free (error);
+		g_file_delete (partial, NULL, NULL);
+		goto done;
+	}
+
+	/* Replaces any entry this overwrote. */
+	link = g_hash_table_lookup (cache->entries, key);
+	if (NULL != link) {
+		_index_remove (cache, link);
+	}
+
+	_index_add (cache, key, g_file_info_get_size (info));
+	_evict (cache);
+
+done:
+	if (NULL != info) {
+		g_object_unref (info);
+	}
+
+	if (NULL != file) {
+		g_object_unref (file);
+	}
+
+	g_object_unref (partial);
+}
+
+#ifdef HAVE_CHECK
+
+#include <check.h>
+#include <utime.h>
+
+static void
+_store (DmapTranscodeCache *cache, const gchar *key, const gchar *data)
+{
+	GOutputStream *stream;
+
+	stream = dmap_transcode_cache_store_begin (cache, key);
+	ck_assert (NULL != stream);
+	ck_assert (g_output_stream_write_all (stream, data, strlen (data),
+	                                      NULL, NULL, NULL));
+	dmap_transcode_cache_store_end (cache, key, stream, TRUE);
+	g_object_unref (stream);
+}
+
+START_TEST(_transcode_cache_store_lookup_test)
+{
+	gchar *dir;
+	guint64 size = 0;
+	GFile *file;
+	GOutputStream *stream, *stream2;
+	DmapTranscodeCache *cache;
+
+	dir = g_dir_make_tmp ("libdmapsharing-test-XXXXXX", NULL);
+	cache = dmap_transcode_cache_new (dir, 0);
+
+	ck_assert (NULL == dmap_transcode_cache_lookup (cache, "a", &size));
+
+	/* Incomplete entries are discarded. */
+	stream = dmap_transcode_cache_store_begin (cache, "a");
+	ck_assert (NULL != stream);
+
+	/* Only one writer per key. */
+	stream2 = dmap_transcode_cache_store_begin (cache, "a");
+	ck_assert (NULL == stream2);
+
+	dmap_transcode_cache_store_end (cache, "a", stream, FALSE);
+	g_object_unref (stream);
+	ck_assert (NULL == dmap_transcode_cache_lookup (cache, "a", &size));
+
+	_store (cache, "a", "0123456789");
+
+	file = dmap_transcode_cache_lookup (cache, "a", &size);
+	ck_assert (NULL != file);
+	ck_assert_int_eq (10, size);
+	g_file_delete (file, NULL, NULL);
+	g_object_unref (file);
+
+	dmap_transcode_cache_unref (cache);
+	g_rmdir (dir);
+	g_free (dir);
+}
+END_TEST
+
+static void
+_set_mtime (const gchar *dir, const gchar *key, time_t mtime)
+{
+	gchar *path;
+	struct utimbuf times = { mtime, mtime };
+
+	path = g_build_filename (dir, key, NULL);
+	ck_assert_int_eq (0, g_utime (path, &times));
+	g_free (path);
+}
+
+static void
+_remove (DmapTranscodeCache *cache, const gchar *key)
+{
+	guint64 size;
+	GFile *file;
+
+	file = dmap_transcode_cache_lookup (cache, key, &size);
+	ck_assert (NULL != file);
+	g_file_delete (file, NULL, NULL);
+	g_object_unref (file);
+}
+
+START_TEST(_transcode_cache_evict_test)
+{
+	gchar *dir;
+	guint64 size = 0;
+	GFile *file;
+	DmapTranscodeCache *cache;
+
+	dir = g_dir_make_tmp ("libdmapsharing-test-XXXXXX", NULL);
+	cache = dmap_transcode_cache_new (dir, 25);
+
+	_store (cache, "a", "0123456789");
+	_store (cache, "b", "0123456789");
+
+	/* Using a leaves b least recently used, so storing c evicts b. */
+	file = dmap_transcode_cache_lookup (cache, "a", &size);
+	ck_assert (NULL != file);
+	g_object_unref (file);
+
+	_store (cache, "c", "0123456789");
+
+	ck_assert (NULL == dmap_transcode_cache_lookup (cache, "b", &size));
+	_remove (cache, "a");
+	_remove (cache, "c");
+
+	dmap_transcode_cache_unref (cache);
+	g_rmdir (dir);
+	g_free (dir);
+}
+END_TEST
+
+START_TEST(_transcode_cache_evict_on_open_test)
+{
+	gchar *dir;
+	guint64 size = 0;
+	DmapTranscodeCache *cache;
+
+	dir = g_dir_make_tmp ("libdmapsharing-test-XXXXXX", NULL);
+	cache = dmap_transcode_cache_new (dir, 0);
+
+	_store (cache, "a", "0123456789");
+	_store (cache, "b", "0123456789");
+
+	dmap_transcode_cache_unref (cache);
+
+	/* A later run orders entries by modification time, so a goes. */
+	_set_mtime (dir, "a", 1000);
+	_set_mtime (dir, "b", 2000);
+
+	cache = dmap_transcode_cache_new (dir, 15);
+
+	ck_assert (NULL == dmap_transcode_cache_lookup (cache, "a", &size));
+	_remove (cache, "b");
+
+	dmap_transcode_cache_unref (cache);
+	g_rmdir (dir);
+	g_free (dir);
+}
+END_TEST
+
+#include "dmap-transcode-cache-suite.c"
+
+#endif
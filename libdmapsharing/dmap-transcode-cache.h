@@ -0,0 +1,62 @@
+/*
+ * On-disk cache of transcoded media used by DmapAvShare
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _DMAP_TRANSCODE_CACHE_H
+#define _DMAP_TRANSCODE_CACHE_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Directory of finished transcodes. Each entry is named by a key derived
+ * from the source location, its modification time and the target MIME
+ * type, so a changed source file never hits a stale entry. The directory
+ * is kept below a maximum size by removing the least recently used
+ * entries; the cache keeps an index of its entries in memory, and the
+ * modification time of an entry records its last use across restarts.
+ * Only one cache should use a directory at a time, since creating one
+ * removes the partial entries left in it. The cache is reference counted
+ * so that stores in progress can keep it alive, but is otherwise not
+ * thread safe: call the other functions from a single thread. A stream
+ * returned by _store_begin may be written from another thread.
+ */
+typedef struct DmapTranscodeCache DmapTranscodeCache;
+
+DmapTranscodeCache *dmap_transcode_cache_new (const gchar * dir, guint64 max_size);
+DmapTranscodeCache *dmap_transcode_cache_ref (DmapTranscodeCache * cache);
+void   dmap_transcode_cache_unref (DmapTranscodeCache * cache);
+
+gchar *dmap_transcode_cache_key (const gchar * location, const gchar * mimetype);
+
+/* Returns NULL on a miss. */
+GFile *dmap_transcode_cache_lookup (DmapTranscodeCache * cache,
+                                    const gchar * key,
+                                    guint64 * size);
+
+/* Returns NULL if the entry cannot be written, e.g., because another
+ * request is already storing it. Pass the stream to _store_end, with
+ * complete set only if the entire transcode was written to it. */
+GOutputStream *dmap_transcode_cache_store_begin (DmapTranscodeCache * cache,
+                                                 const gchar * key);
+void   dmap_transcode_cache_store_end (DmapTranscodeCache * cache,
+                                       const gchar * key,
+                                       GOutputStream * stream,
+                                       gboolean complete);
+
+G_END_DECLS
+#endif /* _DMAP_TRANSCODE_CACHE_H */
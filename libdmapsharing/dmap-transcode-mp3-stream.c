@@ -27,7 +27,9 @@
 #include "dmap-transcode-stream-private.h"
 #include "gst-util.h"
 
-#define GST_APP_MAX_BUFFERS 1024
+#define GST_APP_MAX_BUFFERS 64
+#define TRANSCODE_MIMETYPE "audio/mp3"
+#define MP3_BITRATE 128 /* kbit/s, constant */
 
 struct DmapTranscodeMp3StreamPrivate
 {
@@ -66,6 +68,7 @@ dmap_transcode_mp3_stream_new (GInputStream * src_stream)
 {
 	GstStateChangeReturn sret;
 	GstState state;
+	gboolean started = FALSE;
 	DmapTranscodeMp3Stream *stream = NULL;
 
 	GstElement *pipeline = NULL;
@@ -77,6 +80,17 @@ dmap_transcode_mp3_stream_new (GInputStream * src_stream)
 
 	g_assert (G_IS_INPUT_STREAM (src_stream));
 
+	/* An idle pipeline from the pool is already built and linked. */
+	pipeline = dmap_transcode_stream_pool_take (TRANSCODE_MIMETYPE);
+	if (NULL != pipeline) {
+		src          = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+		decode       = gst_bin_get_by_name (GST_BIN (pipeline), "decode");
+		convert      = gst_bin_get_by_name (GST_BIN (pipeline), "convert");
+		audio_encode = gst_bin_get_by_name (GST_BIN (pipeline), "audioencode");
+		sink         = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+		goto play;
+	}
+
 	pipeline = gst_pipeline_new ("pipeline");
 	if (NULL == pipeline) {
 		g_warning ("Could not create GStreamer pipeline");
@@ -125,20 +139,23 @@ dmap_transcode_mp3_stream_new (GInputStream * src_stream)
 		goto done;
 	}
 
-	g_object_set (G_OBJECT (src), "stream", src_stream, NULL);
-
 	/* quality=9 is important for fast, realtime transcoding: */
 	// FIXME: Causes crash; why?
 	// g_object_set (G_OBJECT (audio_encode), "quality", 9, NULL);
-	g_object_set (G_OBJECT (audio_encode), "bitrate", 128, NULL);
+	g_object_set (G_OBJECT (audio_encode), "bitrate", MP3_BITRATE, NULL);
 	g_object_set (G_OBJECT (audio_encode), "vbr", 0, NULL);
 
-	g_object_set (G_OBJECT (sink), "emit-signals", TRUE, "sync", FALSE, NULL);
+	g_object_set (G_OBJECT (sink), "emit-signals", FALSE, "sync", FALSE, NULL);
 	gst_app_sink_set_max_buffers (GST_APP_SINK (sink), GST_APP_MAX_BUFFERS);
 	gst_app_sink_set_drop (GST_APP_SINK (sink), FALSE);
 
 	g_signal_connect (decode, "pad-added", G_CALLBACK (_pad_added_cb), convert);
 
+play:
+	g_object_set (G_OBJECT (src), "stream", src_stream, NULL);
+
+	started = TRUE;
+
 	/* FIXME: this technique is shared with dmapd-dmap-av-share.c */
 	sret = gst_element_set_state (pipeline, GST_STATE_PLAYING);
 	if (GST_STATE_CHANGE_ASYNC == sret) {
@@ -158,7 +175,11 @@ dmap_transcode_mp3_stream_new (GInputStream * src_stream)
 	}
 	g_assert (G_IS_SEEKABLE (stream));
 
-	g_signal_connect (sink, "new-sample", G_CALLBACK (dmap_transcode_stream_new_buffer_cb), stream);
+	dmap_transcode_stream_set_pipeline (DMAP_TRANSCODE_STREAM (stream),
+	                                    pipeline,
+	                                    sink,
+	                                    MP3_BITRATE * 1000 / 8,
+	                                    0);
 
 	stream->priv->pipeline = gst_object_ref (pipeline);
 	stream->priv->src = gst_object_ref (src);
@@ -168,6 +189,12 @@ dmap_transcode_mp3_stream_new (GInputStream * src_stream)
 	stream->priv->sink = gst_object_ref (sink);
 
 done:
+	if (started && NULL == stream) {
+		/* May be stuck in PAUSED; stop it or return it to the pool. */
+		dmap_transcode_stream_pool_release (TRANSCODE_MIMETYPE, pipeline);
+		pipeline = NULL;
+	}
+
 	if (pipeline) {
 		gst_object_unref (pipeline);
 	}
@@ -201,8 +228,8 @@ _kill_pipeline (DmapTranscodeStream * stream)
 	DmapTranscodeMp3Stream *mp3_stream =
 		DMAP_TRANSCODE_MP3_STREAM (stream);
 
-	gst_element_set_state (mp3_stream->priv->pipeline, GST_STATE_NULL);
-	gst_object_unref (GST_OBJECT (mp3_stream->priv->pipeline));
+	dmap_transcode_stream_pool_release (TRANSCODE_MIMETYPE,
+	                                    mp3_stream->priv->pipeline);
 }
 
 G_DEFINE_TYPE_WITH_PRIVATE (DmapTranscodeMp3Stream,
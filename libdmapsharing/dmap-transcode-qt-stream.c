@@ -27,7 +27,8 @@
 #include "dmap-transcode-stream-private.h"
 #include "gst-util.h"
 
-#define GST_APP_MAX_BUFFERS 1024
+#define GST_APP_MAX_BUFFERS 64
+#define TRANSCODE_MIMETYPE "video/quicktime"
 
 struct DmapTranscodeQtStreamPrivate
 {
@@ -67,6 +68,7 @@ dmap_transcode_qt_stream_new (GInputStream * src_stream)
 {
 	GstStateChangeReturn sret;
 	GstState state;
+	gboolean started = FALSE;
 	DmapTranscodeQtStream *stream = NULL;
 
 	GstElement *pipeline = NULL;
@@ -79,6 +81,18 @@ dmap_transcode_qt_stream_new (GInputStream * src_stream)
 
 	g_assert (G_IS_INPUT_STREAM (src_stream));
 
+	/* An idle pipeline from the pool is already built and linked. */
+	pipeline = dmap_transcode_stream_pool_take (TRANSCODE_MIMETYPE);
+	if (NULL != pipeline) {
+		src          = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+		decode       = gst_bin_get_by_name (GST_BIN (pipeline), "decode");
+		convert      = gst_bin_get_by_name (GST_BIN (pipeline), "convert");
+		audio_encode = gst_bin_get_by_name (GST_BIN (pipeline), "audioencode");
+		mux          = gst_bin_get_by_name (GST_BIN (pipeline), "mux");
+		sink         = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+		goto play;
+	}
+
 	pipeline = gst_pipeline_new ("pipeline");
         if (NULL == pipeline) {
                 g_warning ("Could not create GStreamer pipeline");
@@ -133,14 +147,17 @@ dmap_transcode_qt_stream_new (GInputStream * src_stream)
 		goto done;
 	}
 
-	g_object_set (G_OBJECT (src), "stream", src_stream, NULL);
-
-	g_object_set (G_OBJECT (sink), "emit-signals", TRUE, "sync", FALSE, NULL);
+	g_object_set (G_OBJECT (sink), "emit-signals", FALSE, "sync", FALSE, NULL);
 	gst_app_sink_set_max_buffers (GST_APP_SINK (sink), GST_APP_MAX_BUFFERS);
 	gst_app_sink_set_drop (GST_APP_SINK (sink), FALSE);
 
 	g_signal_connect (decode, "pad-added", G_CALLBACK (_pad_added_cb), convert);
 
+play:
+	g_object_set (G_OBJECT (src), "stream", src_stream, NULL);
+
+	started = TRUE;
+
 	/* FIXME: this technique is shared with dmapd-dmap-av-share.c */
 	sret = gst_element_set_state (pipeline, GST_STATE_PLAYING);
 	if (GST_STATE_CHANGE_ASYNC == sret) {
@@ -160,7 +177,12 @@ dmap_transcode_qt_stream_new (GInputStream * src_stream)
         }
         g_assert (G_IS_SEEKABLE (stream));
 
-	g_signal_connect (sink, "new-sample", G_CALLBACK (dmap_transcode_stream_new_buffer_cb), stream);
+	/* AAC in QuickTime has no fixed byte rate, so cannot seek. */
+	dmap_transcode_stream_set_pipeline (DMAP_TRANSCODE_STREAM (stream),
+	                                    pipeline,
+	                                    sink,
+	                                    0,
+	                                    0);
 
 	stream->priv->pipeline = gst_object_ref (pipeline);
         stream->priv->src = gst_object_ref (src);
@@ -171,6 +193,12 @@ dmap_transcode_qt_stream_new (GInputStream * src_stream)
         stream->priv->sink = gst_object_ref (sink);
 
 done:
+	if (started && NULL == stream) {
+		/* May be stuck in PAUSED; stop it or return it to the pool. */
+		dmap_transcode_stream_pool_release (TRANSCODE_MIMETYPE, pipeline);
+		pipeline = NULL;
+	}
+
 	if (pipeline) {
                 gst_object_unref (pipeline);
         }
@@ -212,8 +240,8 @@ _kill_pipeline (DmapTranscodeStream * stream)
 	// its headers after encoding the streams, but this does not yet work.
 	gst_element_send_event(qt_stream->priv->pipeline, gst_event_new_eos());
 	
-	gst_element_set_state (qt_stream->priv->pipeline, GST_STATE_NULL);
-	gst_object_unref (GST_OBJECT (qt_stream->priv->pipeline));
+	dmap_transcode_stream_pool_release (TRANSCODE_MIMETYPE,
+	                                    qt_stream->priv->pipeline);
 }
 
 G_DEFINE_TYPE_WITH_PRIVATE (DmapTranscodeQtStream,
@@ -19,7 +19,37 @@
 #ifndef _DMAP_TRANSCODE_STREAM_PRIVATE_H
 #define _DMAP_TRANSCODE_STREAM_PRIVATE_H
 
-void dmap_transcode_stream_new_buffer_cb(GstElement *element,
-                                         DmapTranscodeStream *stream);
+#include <gst/gst.h>
+
+#include "dmap-transcode-stream.h"
+
+/* Subclasses take an idle, already linked pipeline for their target MIME
+ * type before building a new one, and release it again instead of
+ * destroying it. Ownership of the pipeline reference passes each way.
+ * Idle pipelines are only kept while the pool has users, such as a
+ * DmapAvShare; the last _pool_unref destroys them. Stopping a pipeline
+ * that never reached PLAYING also goes through _pool_release. */
+void dmap_transcode_stream_pool_ref(void);
+void dmap_transcode_stream_pool_unref(void);
+guint dmap_transcode_stream_pool_size(const gchar *transcode_mimetype);
+GstElement *dmap_transcode_stream_pool_take(const gchar *transcode_mimetype);
+void dmap_transcode_stream_pool_release(const gchar *transcode_mimetype,
+                                        GstElement *pipeline);
+
+/* byte_rate is the number of encoded bytes per second of stream time, used
+ * to map seek offsets to time; pass 0 if the output bitrate is not fixed.
+ * header_size is the number of bytes the encoder writes before the first
+ * timed byte, such as a WAV file's RIFF header. */
+void dmap_transcode_stream_set_pipeline(DmapTranscodeStream *stream,
+                                        GstElement *pipeline,
+                                        GstElement *sink,
+                                        guint byte_rate,
+                                        gsize header_size);
+
+/* By default a read that finds no decoded data fails at once with
+ * G_IO_ERROR_WOULD_BLOCK, so the main loop never waits on the pipeline.
+ * A reader on a worker thread may instead wait up to mseconds for it. */
+void dmap_transcode_stream_set_read_wait(DmapTranscodeStream *stream,
+                                         guint mseconds);
 
 #endif
@@ -20,6 +20,8 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include "config.h"
+
 #include <string.h>
 #include <gst/gst.h>
 #include <gst/app/gstappsink.h>
@@ -30,66 +32,74 @@
 #include "dmap-transcode-wav-stream.h"
 #include "dmap-transcode-qt-stream.h"
 #include "gst-util.h"
+#include "dmap-private-utils.h"
 
-#define GST_APP_MAX_BUFFERS 1024
 #define DECODED_BUFFER_SIZE 1024 * 128
-#define QUEUE_PUSH_WAIT_SECONDS 10
-#define QUEUE_POP_WAIT_SECONDS 1
+#define PIPELINE_POOL_SIZE 2	/* Idle pipelines kept per target format */
+
+/* Idle pipelines by target MIME type; see dmap_transcode_stream_pool_take.
+ * Exists only while _pool_users is non-zero. */
+static GHashTable *_pool = NULL;
+static guint _pool_users = 0;
+static GMutex _pool_mutex;
 
 struct DmapTranscodeStreamPrivate
 {
-	GQueue *buffer;
-	gsize read_request;	/* Size of data asked for */
-	gsize write_request;	/* Number of bytes that must be read
-				 * to make room for write */
-	GCond buffer_read_ready;	/* Signals when buffer >= read_req. */
-	GCond buffer_write_ready;	/* Signals when buffer not full. */
-	GMutex buffer_mutex;	/* Protects buffer and read_request */
+	GstElement *pipeline;	/* Seeked by _seek */
+	GstElement *sink;	/* Pulled from on demand by _read */
+	guint byte_rate;	/* Encoded bytes per second; 0 if unknown */
+	gsize header_size;	/* Encoded bytes before the first timed byte */
+	GstClockTime read_wait;	/* Longest _read waits for a sample */
+	goffset pos;		/* Encoded bytes returned so far */
+	DmapRingBuffer buffer;	/* Decoded data pulled but not yet read */
 	gboolean buffer_closed;	/* May close before decoding complete */
 };
 
 static goffset
-_tell (G_GNUC_UNUSED GSeekable * seekable)
+_tell (GSeekable * seekable)
 {
-	/* FIXME: implement return current position in stream. */
-	g_error ("Not implemented");
-	return 0;
+	return DMAP_TRANSCODE_STREAM (seekable)->priv->pos;
 }
 
 static gboolean
-_can_seek (G_GNUC_UNUSED GSeekable * seekable)
+_can_seek (GSeekable * seekable)
 {
-	return TRUE;
+	DmapTranscodeStream *stream = DMAP_TRANSCODE_STREAM (seekable);
+
+	return NULL != stream->priv->pipeline && 0 != stream->priv->byte_rate;
 }
 
 static gboolean
-_seek (G_GNUC_UNUSED GSeekable * seekable,
-       G_GNUC_UNUSED goffset offset,
+_seek (GSeekable * seekable,
+       goffset offset,
        GSeekType type,
        G_GNUC_UNUSED GCancellable * cacellable,
        GError ** error)
 {
 	gboolean ok = FALSE;
-	// FIXME: implement: DmapTranscodeStream *stream;
-	// FIXME: implement: goffset absolute;
+	goffset absolute;
+	guint64 position;
+	DmapTranscodeStream *stream;
 
-	// FIXME: implement: stream = DMAP_TRANSCODE_STREAM (seekable);
+	stream = DMAP_TRANSCODE_STREAM (seekable);
 
 	switch (type) {
-		/* FIXME: implement:
-		 * case G_SEEK_CUR:
-		 *      absolute = stream->priv->pos + offset;
-		 *      break;
-		 *
-		 * case G_SEEK_END:
-		 *      absolute = stream->priv->len + offset;
-		 *      break;
-		 */
+	case G_SEEK_CUR:
+		absolute = stream->priv->pos + offset;
+		break;
 
 	case G_SEEK_SET:
-		// FIXME: implement: absolute = offset;
+		absolute = offset;
 		break;
 
+	case G_SEEK_END:
+		/* Length of the encoded stream is not known up front. */
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_SUPPORTED,
+			     "Cannot seek relative to end of DmapTranscodeStream");
+		goto done;
+
 	default:
 		g_set_error (error,
 			     G_IO_ERROR,
@@ -98,28 +108,57 @@ _seek (G_GNUC_UNUSED GSeekable * seekable,
 		goto done;
 	}
 
-	/* FIXME: implement:
-	 * if (absolute < 0 || absolute > stream->priv->len) {
-	 *      g_set_error_literal (error,
-	 *              G_IO_ERROR,
-	 *              G_IO_ERROR_INVALID_ARGUMENT,
-	 *              _("Invalid seek request"));
-	 *	goto done;
-	 * }
-	 */
+	if (absolute < 0) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_INVALID_ARGUMENT,
+			     "Invalid seek request");
+		goto done;
+	}
+
+	if (absolute == stream->priv->pos) {
+		ok = TRUE;
+		goto done;
+	}
+
+	if (!_can_seek (seekable)) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_SUPPORTED,
+			     "Transcoded stream is not seekable");
+		goto done;
+	}
 
-	/* FIXME:
-	 * if (! gst_element_seek_simple (DMAP_TRANSCODE_STREAM (seekable)->priv->pipeline,
-	 * GST_FORMAT_BYTES,
-	 * GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
-	 * absolute)) {
-	 * g_set_error (error,
-	 * G_IO_ERROR,
-	 * G_IO_ERROR_FAILED,
-	 * "Seek failed");
-	 * goto done;
-	 * }
+	/* Encoded byte offset to stream time, using the output bitrate.
+	 * The header is only written once, so offsets within it cannot be
+	 * reached again. A flushing seek also empties the appsink's queue,
+	 * so anything left in our own buffer is now stale.
 	 */
+	if (!dmap_private_utils_offset_to_time (absolute,
+	                                        stream->priv->header_size,
+	                                        stream->priv->byte_rate,
+	                                       &position)) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_SUPPORTED,
+			     "Cannot seek into transcoded stream's header");
+		goto done;
+	}
+
+	if (!gst_element_seek_simple (stream->priv->pipeline,
+	                              GST_FORMAT_TIME,
+	                              GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE,
+	                              position)) {
+		g_set_error (error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_FAILED,
+			     "Seek failed");
+		goto done;
+	}
+
+	stream->priv->buffer.head = 0;
+	stream->priv->buffer.len = 0;
+	stream->priv->pos = absolute;
 
 	ok = TRUE;
 
@@ -155,94 +194,165 @@ _seekable_iface_init (GSeekableIface * iface)
 }
 
 void
-dmap_transcode_stream_new_buffer_cb (GstElement * element,
-                                     DmapTranscodeStream * stream)
-{
-	gsize i;
-	guint8 *ptr;
-	gint64 end_time;
-	GstSample *sample = NULL;
-	GstBuffer *buffer = NULL;
-	GstMemory *memory = NULL;
-	GstMapInfo info;
+dmap_transcode_stream_set_pipeline (DmapTranscodeStream * stream,
+                                    GstElement * pipeline,
+                                    GstElement * sink,
+                                    guint byte_rate,
+                                    gsize header_size)
+{
+	g_assert (NULL == stream->priv->pipeline);
+	g_assert (NULL == stream->priv->sink);
+	g_assert (GST_IS_APP_SINK (sink));
+
+	stream->priv->pipeline = gst_object_ref (pipeline);
+	stream->priv->sink = gst_object_ref (sink);
+	stream->priv->byte_rate = byte_rate;
+	stream->priv->header_size = header_size;
+}
 
-	/* FIXME: Is this necessary? I am trying to protect against this
-	 * thread manipulating data after the pipeline has been destroyed.
-	 * see also dmap_transcode_stream_close ().
-	 */
-	g_mutex_lock (&stream->priv->buffer_mutex);
+void
+dmap_transcode_stream_set_read_wait (DmapTranscodeStream * stream,
+                                     guint mseconds)
+{
+	stream->priv->read_wait = mseconds * GST_MSECOND;
+}
+
+static void
+_pipeline_destroy (GstElement * pipeline)
+{
+	gst_element_set_state (pipeline, GST_STATE_NULL);
+	gst_object_unref (GST_OBJECT (pipeline));
+}
 
-	if (stream->priv->buffer_closed) {
-		g_warning ("Buffer is closed, but unread data remains");
-		goto _return;
+static void
+_idle_free (GQueue * idle)
+{
+	g_queue_free_full (idle, (GDestroyNotify) _pipeline_destroy);
+}
+
+void
+dmap_transcode_stream_pool_ref (void)
+{
+	g_mutex_lock (&_pool_mutex);
+
+	if (0 == _pool_users++) {
+		_pool = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+		                               (GDestroyNotify) _idle_free);
 	}
 
-	end_time = g_get_monotonic_time () + QUEUE_PUSH_WAIT_SECONDS * G_TIME_SPAN_SECOND;
+	g_mutex_unlock (&_pool_mutex);
+}
+
+void
+dmap_transcode_stream_pool_unref (void)
+{
+	GHashTable *pool = NULL;
+
+	g_mutex_lock (&_pool_mutex);
 
-	sample = gst_app_sink_pull_sample (GST_APP_SINK (element));
-	if (NULL == sample) {
-		g_warning ("Error getting GStreamer sample");
-		goto _return;
+	g_assert (_pool_users > 0);
+
+	if (0 == --_pool_users) {
+		pool = _pool;
+		_pool = NULL;
 	}
 
-	buffer = gst_sample_get_buffer (sample);
-	if (NULL == buffer) {
-		g_warning ("Error getting GStreamer buffer");
-		goto _return;
+	g_mutex_unlock (&_pool_mutex);
+
+	/* Outside the lock; stopping a pipeline may take a while. */
+	if (NULL != pool) {
+		g_hash_table_destroy (pool);
 	}
+}
 
-	memory = gst_buffer_get_memory (buffer, 0);
-	if (NULL == memory) {
-		g_warning ("Error getting GStreamer memory");
-		goto _return;
+guint
+dmap_transcode_stream_pool_size (const gchar * transcode_mimetype)
+{
+	GQueue *idle;
+	guint size = 0;
+
+	g_mutex_lock (&_pool_mutex);
+
+	if (NULL == _pool) {
+		goto done;
 	}
 
-	if (gst_memory_map (memory, &info, GST_MAP_READ) == FALSE) {
-		g_warning ("Error mapping GStreamer memory");
-		goto _return;
+	idle = g_hash_table_lookup (_pool, transcode_mimetype);
+	if (NULL != idle) {
+		size = g_queue_get_length (idle);
 	}
 
-	/* FIXME: this actually allows buffer to grow larger than max. */
-	if (g_queue_get_length (stream->priv->buffer) + info.size > DECODED_BUFFER_SIZE) {
-		stream->priv->write_request = info.size;
-		if (!g_cond_wait_until (&stream->priv->buffer_write_ready,
-		                        &stream->priv->buffer_mutex, end_time)) {
-			g_warning ("Timeout waiting for buffer to empty; will drop");
-		}
-		/* Required again because g_cond_wait_until released mutex. */
-		if (stream->priv->buffer_closed) {
-			g_warning ("Unread data");
-			goto _return;
-		}
-	} else {
-		stream->priv->write_request = 0;
+done:
+	g_mutex_unlock (&_pool_mutex);
+
+	return size;
+}
+
+GstElement *
+dmap_transcode_stream_pool_take (const gchar * transcode_mimetype)
+{
+	GQueue *idle;
+	GstElement *pipeline = NULL;
+
+	g_mutex_lock (&_pool_mutex);
+
+	if (NULL == _pool) {
+		goto done;
 	}
 
-	if (g_queue_get_length (stream->priv->buffer) + info.size <= DECODED_BUFFER_SIZE) {
-		ptr = info.data;
+	idle = g_hash_table_lookup (_pool, transcode_mimetype);
+	if (NULL != idle) {
+		pipeline = g_queue_pop_head (idle);
+	}
 
-		for (i = 0; i < info.size; i++) {
-			g_queue_push_tail (stream->priv->buffer,
-					   GINT_TO_POINTER ((gint) * ptr++));
-		}
+done:
+	g_mutex_unlock (&_pool_mutex);
+
+	if (NULL != pipeline) {
+		g_debug ("Reusing idle %s pipeline", transcode_mimetype);
 	}
 
-	if (g_queue_get_length (stream->priv->buffer) >= stream->priv->read_request) {
-		stream->priv->read_request = 0;
-		g_cond_signal (&stream->priv->buffer_read_ready);
+	return pipeline;
+}
+
+void
+dmap_transcode_stream_pool_release (const gchar * transcode_mimetype,
+                                    GstElement * pipeline)
+{
+	GQueue *idle;
+	gboolean pooled = FALSE;
+
+	/* READY drops decodebin's dynamic elements and pads, which also
+	 * unlinks it from the encoder, but keeps everything else built. */
+	if (GST_STATE_CHANGE_FAILURE == gst_element_set_state (pipeline, GST_STATE_READY)) {
+		goto done;
 	}
 
-      _return:
-	if (NULL != memory) {
-		gst_memory_unmap (memory, &info);
-		gst_memory_unref (memory);
+	g_mutex_lock (&_pool_mutex);
+
+	/* No share is left to use it. */
+	if (NULL == _pool) {
+		goto unlock;
 	}
 
-	if (NULL != sample) {
-		gst_sample_unref (sample);
+	idle = g_hash_table_lookup (_pool, transcode_mimetype);
+	if (NULL == idle) {
+		idle = g_queue_new ();
+		g_hash_table_insert (_pool, g_strdup (transcode_mimetype), idle);
+	}
+
+	if (g_queue_get_length (idle) < PIPELINE_POOL_SIZE) {
+		g_queue_push_tail (idle, pipeline);
+		pooled = TRUE;
 	}
 
-	g_mutex_unlock (&stream->priv->buffer_mutex);
+unlock:
+	g_mutex_unlock (&_pool_mutex);
+
+done:
+	if (!pooled) {
+		_pipeline_destroy (pipeline);
+	}
 }
 
 GInputStream *
@@ -271,10 +381,45 @@ dmap_transcode_stream_new (const gchar * transcode_mimetype,
 	return stream;
 }
 
-static gssize
-_min (gssize a, gssize b)
+static gsize
+_consume_sample (DmapTranscodeStream * stream,
+                 GstSample * sample,
+                 guint8 * dst,
+                 gsize count)
 {
-	return a < b ? a : b;
+	gsize n = 0, rest;
+	GstBuffer *buffer;
+	GstMapInfo info;
+
+	buffer = gst_sample_get_buffer (sample);
+	if (NULL == buffer) {
+		g_warning ("Error getting GStreamer buffer");
+		goto done;
+	}
+
+	if (FALSE == gst_buffer_map (buffer, &info, GST_MAP_READ)) {
+		g_warning ("Error mapping GStreamer buffer");
+		goto done;
+	}
+
+	n = MIN (count, info.size);
+	memcpy (dst, info.data, n);
+
+	/* Keep whatever the caller has no room for; never drop it.
+	 * The ring is empty here, as _read drains it before pulling. */
+	rest = info.size - n;
+	if (rest > stream->priv->buffer.capacity) {
+		g_assert (0 == stream->priv->buffer.len);
+		dmap_private_utils_ring_buffer_clear (&stream->priv->buffer);
+		dmap_private_utils_ring_buffer_init (&stream->priv->buffer, rest);
+	}
+	dmap_private_utils_ring_buffer_write (&stream->priv->buffer,
+	                                      info.data + n, rest);
+
+	gst_buffer_unmap (buffer, &info);
+
+done:
+	return n;
 }
 
 static gssize
@@ -282,49 +427,58 @@ _read (GInputStream * stream,
        void *buffer,
        gsize count,
        G_GNUC_UNUSED GCancellable * cancellable,
-       G_GNUC_UNUSED GError ** error)
+       GError ** error)
 {
-	gsize i;
+	gssize nread;
+	GstClockTime timeout;
+	GstSample *sample;
 	DmapTranscodeStream *gst_stream = DMAP_TRANSCODE_STREAM (stream);
-	gint64 end_time;
-
-	end_time = g_get_monotonic_time () + QUEUE_POP_WAIT_SECONDS * G_TIME_SPAN_SECOND;
-
-	g_mutex_lock (&gst_stream->priv->buffer_mutex);
-
-	gst_stream->priv->read_request = count;
-	if (g_queue_get_length (gst_stream->priv->buffer) < count
-	    && !g_cond_wait_until (&gst_stream->priv->buffer_read_ready,
-	                           &gst_stream->priv->buffer_mutex, end_time)) {
-		/* Timeout: Count is now what's remaining.  Let's hope
-		 * we have enough of a lead on encoding so that this one
-		 * second timeout will go unnoticed.
-		 */
-		g_warning ("Timeout waiting for converted data");
-		/* Depending on timing, more data may have been written
-		 * since check: do not pull more than count:
-		 */
-		count = _min (count, g_queue_get_length (gst_stream->priv->buffer));
-	}
 
-	for (i = 0; i < count; i++) {
-		((guint8 *) buffer)[i] =
-			GPOINTER_TO_INT (g_queue_pop_head (gst_stream->priv->buffer));
-	}
+	/* Leftovers from the previous sample come first. */
+	nread = dmap_private_utils_ring_buffer_read (&gst_stream->priv->buffer,
+	                                             buffer, count);
 
-	if (gst_stream->priv->write_request > count) {
-		gst_stream->priv->write_request -= count;
-	} else {
-		gst_stream->priv->write_request = 0;
-	}
+	/* Pull from appsink only as the reader asks for data. With drop=FALSE
+	 * and a bounded max-buffers, a reader that stops asking stalls the
+	 * pipeline instead of losing decoded data.
+	 */
+	while ((gsize) nread < count
+	    && !gst_stream->priv->buffer_closed
+	    && NULL != gst_stream->priv->sink) {
+		/* Wait only if asked to, off the main loop, and only if
+		 * there is nothing to return. The main loop gets
+		 * G_IO_ERROR_WOULD_BLOCK at once and retries on a timer. */
+		timeout = 0 == nread ? gst_stream->priv->read_wait : 0;
+
+		sample = gst_app_sink_try_pull_sample (GST_APP_SINK (gst_stream->priv->sink),
+		                                       timeout);
+		if (NULL == sample) {
+			if (0 == nread
+			 && !gst_app_sink_is_eos (GST_APP_SINK (gst_stream->priv->sink))) {
+				/* Not an error: the reader should try
+				 * again later. */
+				g_set_error (error,
+				             G_IO_ERROR,
+				             G_IO_ERROR_WOULD_BLOCK,
+				             "No converted data available yet");
+				nread = -1;
+			}
+			break;
+		}
 
-	if (gst_stream->priv->write_request <= 0) {
-		g_cond_signal (&gst_stream->priv->buffer_write_ready);
+		nread += _consume_sample (gst_stream,
+		                          sample,
+		                          (guint8 *) buffer + nread,
+		                          count - nread);
+
+		gst_sample_unref (sample);
 	}
 
-	g_mutex_unlock (&gst_stream->priv->buffer_mutex);
+	if (nread > 0) {
+		gst_stream->priv->pos += nread;
+	}
 
-	return count;
+	return nread;
 }
 
 static gssize
@@ -352,12 +506,18 @@ _close (GInputStream * stream,
 
 	_kill_pipeline (gst_stream);
 
-	g_mutex_lock (&gst_stream->priv->buffer_mutex);
+	if (NULL != gst_stream->priv->sink) {
+		gst_object_unref (gst_stream->priv->sink);
+		gst_stream->priv->sink = NULL;
+	}
 
-	g_queue_free (gst_stream->priv->buffer);
-	gst_stream->priv->buffer_closed = TRUE;
+	if (NULL != gst_stream->priv->pipeline) {
+		gst_object_unref (gst_stream->priv->pipeline);
+		gst_stream->priv->pipeline = NULL;
+	}
 
-	g_mutex_unlock (&gst_stream->priv->buffer_mutex);
+	dmap_private_utils_ring_buffer_clear (&gst_stream->priv->buffer);
+	gst_stream->priv->buffer_closed = TRUE;
 
 	return TRUE;
 }
@@ -450,15 +610,179 @@ dmap_transcode_stream_init (DmapTranscodeStream * stream)
 {
 	stream->priv = dmap_transcode_stream_get_instance_private(stream);
 
-	stream->priv->buffer = g_queue_new ();
-	stream->priv->read_request = 0;
-	stream->priv->write_request = 0;
+	stream->priv->pipeline = NULL;
+	stream->priv->sink = NULL;
+	stream->priv->byte_rate = 0;
+	stream->priv->read_wait = 0;
+	stream->priv->pos = 0;
+	dmap_private_utils_ring_buffer_init (&stream->priv->buffer,
+	                                     DECODED_BUFFER_SIZE);
 	stream->priv->buffer_closed = FALSE;
+}
+
+/* unit-test requires HAVE_GSTREAMERAPP */
+#ifdef HAVE_CHECK
+
+#include <check.h>
+
+#define TEST_MIMETYPE "audio/x-test"
+
+static GstState
+_state (GstElement *pipeline)
+{
+	GstState state = GST_STATE_VOID_PENDING;
+
+	gst_element_get_state (pipeline, &state, NULL, 0);
+
+	return state;
+}
+
+START_TEST(_pool_take_release_test)
+{
+	GstElement *pipeline, *extra[PIPELINE_POOL_SIZE + 1];
+	guint i;
+
+	gst_init (NULL, NULL);
+	dmap_transcode_stream_pool_ref ();
+
+	ck_assert (NULL == dmap_transcode_stream_pool_take (TEST_MIMETYPE));
+
+	/* A released pipeline is stopped to READY and handed out again. */
+	pipeline = gst_pipeline_new ("test");
+	gst_element_set_state (pipeline, GST_STATE_PAUSED);
+	dmap_transcode_stream_pool_release (TEST_MIMETYPE, pipeline);
+	ck_assert_int_eq (1, dmap_transcode_stream_pool_size (TEST_MIMETYPE));
+	ck_assert (NULL == dmap_transcode_stream_pool_take ("audio/x-other"));
+
+	ck_assert (pipeline == dmap_transcode_stream_pool_take (TEST_MIMETYPE));
+	ck_assert_int_eq (GST_STATE_READY, _state (pipeline));
+	ck_assert_int_eq (0, dmap_transcode_stream_pool_size (TEST_MIMETYPE));
+	gst_object_unref (pipeline);
+
+	/* Only PIPELINE_POOL_SIZE are kept; the rest are stopped. */
+	for (i = 0; i < G_N_ELEMENTS (extra); i++) {
+		extra[i] = gst_pipeline_new (NULL);
+		gst_object_ref (extra[i]);
+		dmap_transcode_stream_pool_release (TEST_MIMETYPE, extra[i]);
+	}
+
+	ck_assert_int_eq (PIPELINE_POOL_SIZE,
+	                  dmap_transcode_stream_pool_size (TEST_MIMETYPE));
+	ck_assert_int_eq (GST_STATE_READY, _state (extra[0]));
+	ck_assert_int_eq (GST_STATE_NULL, _state (extra[PIPELINE_POOL_SIZE]));
+
+	/* The last user destroys what is left. */
+	dmap_transcode_stream_pool_unref ();
+	ck_assert_int_eq (0, dmap_transcode_stream_pool_size (TEST_MIMETYPE));
+	ck_assert_int_eq (GST_STATE_NULL, _state (extra[0]));
+
+	for (i = 0; i < G_N_ELEMENTS (extra); i++) {
+		gst_object_unref (extra[i]);
+	}
+}
+END_TEST
+
+START_TEST(_pool_no_users_test)
+{
+	GstElement *pipeline;
+
+	gst_init (NULL, NULL);
+
+	pipeline = gst_pipeline_new (NULL);
+	gst_object_ref (pipeline);
+	gst_element_set_state (pipeline, GST_STATE_PAUSED);
+
+	/* E.g., a stream that outlived the last share. */
+	dmap_transcode_stream_pool_release (TEST_MIMETYPE, pipeline);
+	ck_assert_int_eq (0, dmap_transcode_stream_pool_size (TEST_MIMETYPE));
+	ck_assert_int_eq (GST_STATE_NULL, _state (pipeline));
+	ck_assert (NULL == dmap_transcode_stream_pool_take (TEST_MIMETYPE));
+
+	gst_object_unref (pipeline);
+}
+END_TEST
+
+typedef struct
+{
+	DmapTranscodeStream parent;
+} _TestTranscodeStream;
+
+typedef struct
+{
+	DmapTranscodeStreamClass parent;
+} _TestTranscodeStreamClass;
+
+static GType _test_transcode_stream_get_type (void);
+
+G_DEFINE_TYPE (_TestTranscodeStream, _test_transcode_stream,
+               DMAP_TYPE_TRANSCODE_STREAM);
+
+static void
+_test_kill_pipeline (DmapTranscodeStream * stream)
+{
+	gst_element_set_state (stream->priv->pipeline, GST_STATE_NULL);
+}
 
-	// FIXME: Never g_mutex_clear'ed:
-	g_mutex_init (&stream->priv->buffer_mutex);
+static void
+_test_transcode_stream_class_init (_TestTranscodeStreamClass * klass)
+{
+	DMAP_TRANSCODE_STREAM_CLASS (klass)->kill_pipeline = _test_kill_pipeline;
+}
 
-	// FIXME: Never g_cond_clear'ed:
-	g_cond_init (&stream->priv->buffer_read_ready);
-	g_cond_init (&stream->priv->buffer_write_ready);
+static void
+_test_transcode_stream_init (G_GNUC_UNUSED _TestTranscodeStream * stream)
+{
 }
+
+/* Returns how long a read of a pipeline with no data took, in
+ * microseconds, having checked that it would block. */
+static gint64
+_read_empty_test (guint read_wait)
+{
+	gint64 start;
+	gchar buf[16];
+	GError *error = NULL;
+	GstElement *pipeline, *sink;
+	GInputStream *stream;
+
+	pipeline = gst_parse_launch ("appsrc ! appsink name=sink", NULL);
+	ck_assert (NULL != pipeline);
+	sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+	gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+	stream = g_object_new (_test_transcode_stream_get_type (), NULL);
+	dmap_transcode_stream_set_pipeline (DMAP_TRANSCODE_STREAM (stream),
+	                                    pipeline, sink, 0, 0);
+	dmap_transcode_stream_set_read_wait (DMAP_TRANSCODE_STREAM (stream),
+	                                     read_wait);
+
+	start = g_get_monotonic_time ();
+	ck_assert_int_eq (-1, g_input_stream_read (stream, buf, sizeof buf,
+	                                           NULL, &error));
+	start = g_get_monotonic_time () - start;
+
+	ck_assert (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK));
+	g_error_free (error);
+
+	g_object_unref (stream);
+	gst_object_unref (sink);
+	gst_object_unref (pipeline);
+
+	return start;
+}
+
+START_TEST(_read_would_block_test)
+{
+	gst_init (NULL, NULL);
+
+	/* The main loop is never made to wait for decoded data... */
+	ck_assert (_read_empty_test (0) < 100 * G_TIME_SPAN_MILLISECOND);
+
+	/* ...but a worker thread may choose to. */
+	ck_assert (_read_empty_test (100) >= 100 * G_TIME_SPAN_MILLISECOND);
+}
+END_TEST
+
+#include "dmap-transcode-stream-suite.c"
+
+#endif
@@ -27,7 +27,9 @@
 #include "dmap-transcode-stream-private.h"
 #include "gst-util.h"
 
-#define GST_APP_MAX_BUFFERS 1024
+#define GST_APP_MAX_BUFFERS 64
+#define TRANSCODE_MIMETYPE "audio/wav"
+#define WAV_HEADER_SIZE 44	/* RIFF, fmt and data chunk headers from wavenc */
 
 struct DmapTranscodeWavStreamPrivate
 {
@@ -62,11 +64,51 @@ _pad_added_cb (G_GNUC_UNUSED GstElement * element,
 	}
 }
 
+static guint
+_byte_rate (GstElement *audio_encode)
+{
+	gint rate, channels;
+	guint byte_rate = 0;
+	GstPad *pad = NULL;
+	GstCaps *caps = NULL;
+	GstStructure *structure;
+
+	/* Caps are fixed by now, as the pipeline has reached PLAYING. */
+	pad = gst_element_get_static_pad (audio_encode, "sink");
+	if (NULL == pad) {
+		goto done;
+	}
+
+	caps = gst_pad_get_current_caps (pad);
+	if (NULL == caps) {
+		goto done;
+	}
+
+	structure = gst_caps_get_structure (caps, 0);
+	if (gst_structure_get_int (structure, "rate", &rate)
+	 && gst_structure_get_int (structure, "channels", &channels)) {
+		/* S16LE; see filter. */
+		byte_rate = rate * channels * 2;
+	}
+
+done:
+	if (caps) {
+		gst_caps_unref (caps);
+	}
+
+	if (pad) {
+		gst_object_unref (pad);
+	}
+
+	return byte_rate;
+}
+
 GInputStream *
 dmap_transcode_wav_stream_new (GInputStream * src_stream)
 {
 	GstStateChangeReturn sret;
 	GstState state;
+	gboolean started = FALSE;
 	DmapTranscodeWavStream *stream = NULL;
 
 	GstElement *pipeline = NULL;
@@ -79,6 +121,17 @@ dmap_transcode_wav_stream_new (GInputStream * src_stream)
 
 	g_assert (G_IS_INPUT_STREAM (src_stream));
 
+	/* An idle pipeline from the pool is already built and linked. */
+	pipeline = dmap_transcode_stream_pool_take (TRANSCODE_MIMETYPE);
+	if (NULL != pipeline) {
+		src          = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+		decode       = gst_bin_get_by_name (GST_BIN (pipeline), "decode");
+		convert      = gst_bin_get_by_name (GST_BIN (pipeline), "convert");
+		audio_encode = gst_bin_get_by_name (GST_BIN (pipeline), "audioencode");
+		sink         = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+		goto play;
+	}
+
 	pipeline = gst_pipeline_new ("pipeline");
         if (NULL == pipeline) {
                 g_warning ("Could not create GStreamer pipeline");
@@ -142,14 +195,17 @@ dmap_transcode_wav_stream_new (GInputStream * src_stream)
 		goto done;
 	}
 
-	g_object_set (G_OBJECT (src), "stream", src_stream, NULL);
-
-	g_object_set (G_OBJECT (sink), "emit-signals", TRUE, "sync", FALSE, NULL);
+	g_object_set (G_OBJECT (sink), "emit-signals", FALSE, "sync", FALSE, NULL);
 	gst_app_sink_set_max_buffers (GST_APP_SINK (sink), GST_APP_MAX_BUFFERS);
 	gst_app_sink_set_drop (GST_APP_SINK (sink), FALSE);
 
 	g_signal_connect (decode, "pad-added", G_CALLBACK (_pad_added_cb), convert);
 
+play:
+	g_object_set (G_OBJECT (src), "stream", src_stream, NULL);
+
+	started = TRUE;
+
 	/* FIXME: this technique is shared with dmapd-dmap-av-share.c */
 	sret = gst_element_set_state (pipeline, GST_STATE_PLAYING);
 	if (GST_STATE_CHANGE_ASYNC == sret) {
@@ -169,17 +225,27 @@ dmap_transcode_wav_stream_new (GInputStream * src_stream)
         }
         g_assert (G_IS_SEEKABLE (stream));
 
-	g_signal_connect (sink, "new-sample", G_CALLBACK (dmap_transcode_stream_new_buffer_cb), stream);
+	dmap_transcode_stream_set_pipeline (DMAP_TRANSCODE_STREAM (stream),
+	                                    pipeline,
+	                                    sink,
+	                                    _byte_rate (audio_encode),
+	                                    WAV_HEADER_SIZE);
 
 	stream->priv->pipeline = gst_object_ref (pipeline);
         stream->priv->src = gst_object_ref (src);
         stream->priv->decode = gst_object_ref (decode);
         stream->priv->convert = gst_object_ref (convert);
-        stream->priv->filter = gst_caps_ref (filter);
+        stream->priv->filter = filter ? gst_caps_ref (filter) : NULL;
         stream->priv->audio_encode = gst_object_ref (audio_encode);
         stream->priv->sink = gst_object_ref (sink);
 
 done:
+	if (started && NULL == stream) {
+		/* May be stuck in PAUSED; stop it or return it to the pool. */
+		dmap_transcode_stream_pool_release (TRANSCODE_MIMETYPE, pipeline);
+		pipeline = NULL;
+	}
+
         if (pipeline) {
                 gst_object_unref (pipeline);
         }
@@ -217,8 +283,8 @@ _kill_pipeline (DmapTranscodeStream * stream)
 	DmapTranscodeWavStream *wav_stream =
 		DMAP_TRANSCODE_WAV_STREAM (stream);
 
-	gst_element_set_state (wav_stream->priv->pipeline, GST_STATE_NULL);
-	gst_object_unref (GST_OBJECT (wav_stream->priv->pipeline));
+	dmap_transcode_stream_pool_release (TRANSCODE_MIMETYPE,
+	                                    wav_stream->priv->pipeline);
 }
 
 G_DEFINE_TYPE_WITH_PRIVATE (DmapTranscodeWavStream,
@@ -25,6 +25,8 @@
 struct TestDmapDbPrivate {
 	GHashTable *db;
 	guint nextid;
+	guint capacity;
+	guint rejected;
 };
 
 static DmapRecord *
@@ -64,9 +66,19 @@ test_dmap_db_count (const DmapDb *db)
 }
 
 static guint
-test_dmap_db_add (DmapDb *db, DmapRecord *record, G_GNUC_UNUSED GError **error)
+test_dmap_db_add (DmapDb *db, DmapRecord *record, GError **error)
 {
         guint id;
+	TestDmapDbPrivate *priv = TEST_DMAP_DB (db)->priv;
+
+	if (0 != priv->capacity
+	 && g_hash_table_size (priv->db) >= priv->capacity) {
+		g_set_error (error, DMAP_ERROR, DMAP_STATUS_FAILED,
+		             "Database full; rejected record %u",
+		             ++priv->rejected);
+		return DMAP_DB_ID_BAD;
+	}
+
 	id = TEST_DMAP_DB (db)->priv->nextid--;
 	g_object_ref (record);
 	g_hash_table_insert (TEST_DMAP_DB (db)->priv->db, GUINT_TO_POINTER (id), record);
@@ -121,6 +133,12 @@ test_dmap_db_class_init (TestDmapDbClass *klass)
 	gobject_class->finalize = _finalize;
 }
 
+void
+test_dmap_db_set_capacity (TestDmapDb *db, guint capacity)
+{
+	db->priv->capacity = capacity;
+}
+
 TestDmapDb *
 test_dmap_db_new (void)
 {
@@ -51,6 +51,10 @@ typedef struct {
 TestDmapDb *test_dmap_db_new (void);
 GType test_dmap_db_get_type (void);
 
+/* Rejects records once the database holds capacity of them; 0, the
+ * default, means no limit. */
+void test_dmap_db_set_capacity (TestDmapDb *db, guint capacity);
+
 G_END_DECLS
 
 #endif
@@ -0,0 +1,127 @@
+/*
+ * Microbenchmark: push decoder-sized blocks through a DmapRingBuffer and
+ * through a per-byte GQueue, as DmapTranscodeStream once did. Reports
+ * both times; it asserts nothing about them, so is not part of the
+ * unit tests. Build it with "make ring-buffer-benchmark".
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <libdmapsharing/dmap-private-utils.h>
+
+#define DEFAULT_TOTAL_MIB 16
+#define DEFAULT_BLOCK 4096
+#define RING_CAPACITY (128 * 1024)
+
+static gint64
+_ring_buffer_run (const guint8 *in, guint8 *out, gsize block, gsize total)
+{
+	gsize i;
+	gint64 start;
+	DmapRingBuffer ring;
+
+	dmap_private_utils_ring_buffer_init (&ring, MAX (block, RING_CAPACITY));
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < total; i += block) {
+		dmap_private_utils_ring_buffer_write (&ring, in, block);
+		dmap_private_utils_ring_buffer_read (&ring, out, block);
+	}
+	start = g_get_monotonic_time () - start;
+
+	dmap_private_utils_ring_buffer_clear (&ring);
+
+	return start;
+}
+
+static gint64
+_queue_run (const guint8 *in, guint8 *out, gsize block, gsize total)
+{
+	gsize i, j;
+	gint64 start;
+	GQueue *queue;
+
+	queue = g_queue_new ();
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < total; i += block) {
+		for (j = 0; j < block; j++) {
+			g_queue_push_tail (queue, GINT_TO_POINTER ((gint) in[j]));
+		}
+		for (j = 0; j < block; j++) {
+			out[j] = GPOINTER_TO_INT (g_queue_pop_head (queue));
+		}
+	}
+	start = g_get_monotonic_time () - start;
+
+	g_queue_free (queue);
+
+	return start;
+}
+
+int
+main (int argc, char *argv[])
+{
+	gsize i, total_mib = DEFAULT_TOTAL_MIB, block = DEFAULT_BLOCK;
+	guint8 *in, *out;
+	gint64 ring_usec, queue_usec;
+	int status = EXIT_SUCCESS;
+
+	if (argc > 1) {
+		total_mib = g_ascii_strtoull (argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		block = g_ascii_strtoull (argv[2], NULL, 10);
+	}
+	if (argc > 3 || 0 == total_mib || 0 == block) {
+		g_printerr ("Usage: %s [MIB [BLOCK-SIZE]]\n", argv[0]);
+		status = EXIT_FAILURE;
+		goto done;
+	}
+
+	in = g_malloc (block);
+	out = g_malloc (block);
+	for (i = 0; i < block; i++) {
+		in[i] = i & 0xff;
+	}
+
+	ring_usec = _ring_buffer_run (in, out, block, total_mib * 1024 * 1024);
+	if (0 != memcmp (in, out, block)) {
+		g_printerr ("Ring buffer corrupted data\n");
+		status = EXIT_FAILURE;
+	}
+
+	memset (out, 0, block);
+	queue_usec = _queue_run (in, out, block, total_mib * 1024 * 1024);
+	if (0 != memcmp (in, out, block)) {
+		g_printerr ("GQueue corrupted data\n");
+		status = EXIT_FAILURE;
+	}
+
+	g_print ("%" G_GSIZE_FORMAT " MiB in %" G_GSIZE_FORMAT "-byte blocks:\n",
+	         total_mib, block);
+	g_print ("  ring buffer     %10" G_GINT64_FORMAT " us\n", ring_usec);
+	g_print ("  per-byte GQueue %10" G_GINT64_FORMAT " us\n", queue_usec);
+
+	g_free (in);
+	g_free (out);
+
+done:
+	return status;
+}